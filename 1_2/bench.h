@@ -0,0 +1,81 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 10000
+
+static inline uint64_t
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Optional first argument: how many threads to measure
+static inline size_t
+parse_iterations(int argc, char** argv) {
+    if (argc < 2) { return DEFAULT_ITERATIONS; }
+
+    long n = strtol(argv[1], NULL, 10);
+    return (n > 0) ? (size_t)n : DEFAULT_ITERATIONS;
+}
+
+// Virtual size and resident set of the process in KiB
+static inline int
+read_memory(size_t* vsz_kb, size_t* rss_kb) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL) { return -1; }
+
+    unsigned long size, resident;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    if (n != 2) { return -1; }
+
+    size_t page_kb = (size_t)sysconf(_SC_PAGESIZE) / 1024;
+    *vsz_kb = size * page_kb;
+    *rss_kb = resident * page_kb;
+    return 0;
+}
+
+// Memory can shrink between samples, e.g. when glibc frees cached stacks
+static inline size_t
+memory_delta(size_t after, size_t before) {
+    return (after > before) ? after - before : 0;
+}
+
+static inline int
+cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static inline void
+print_latency_header(void) {
+    printf("%-20s %9s %10s %10s %10s %10s %12s\n",
+           "mode", "threads", "mean us", "p50 us", "p99 us", "max us", "threads/s");
+}
+
+// Sorts `samples` in place; `total_ns` is the wall time of the whole run
+static inline void
+print_latency_row(const char* mode, uint64_t* samples, size_t n, uint64_t total_ns) {
+    if (n == 0) { return; }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) { sum += samples[i]; }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+
+    printf("%-20s %9zu %10.1f %10.1f %10.1f %10.1f %12.0f\n", mode, n,
+           (double)sum / (double)n / 1e3,
+           (double)samples[n / 2] / 1e3,
+           (double)samples[n * 99 / 100] / 1e3,
+           (double)samples[n - 1] / 1e3,
+           (double)n / ((double)total_ns / 1e9));
+}
+
+#endif
@@ -7,25 +7,112 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "bench.h"
 #include "utils.h"
 
+// Joinable threads: create+join cost, then how many joinable threads
+// can exist at once before pthread_create fails.
+// Usage: d [iterations] [max threads to try]
+
+#define DEFAULT_MAX_THREADS 100000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static int release = 0;
+
 void* mythread(void* arg) {
-    size_t thread_num = (size_t) arg;
-    printf("My thread_num = %7zu and tid = %lu\n", thread_num, pthread_self());
     return NULL;
 }
 
-int main(void) {
-    pthread_t tid;
+// Parks until the main thread has found the limit
+void* parked_thread(void* arg) {
+    pthread_mutex_lock(&lock);
+    while (!release) {
+        pthread_cond_wait(&released, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static int bench_create_join(size_t iterations) {
+    uint64_t* samples = malloc(iterations * sizeof(*samples));
+    if (samples == NULL) { return ERROR; }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        pthread_t tid;
+        uint64_t t = now_ns();
 
-    for (size_t i = 0;; i++) {
-        int err = pthread_create(&tid, NULL, mythread, (void*) i);
+        int err = pthread_create(&tid, NULL, mythread, NULL);
         if (err != SUCCESS) {
             fprintf(stderr, "Failed to create thread %zu : %s\n", i, strerror(err));
-            break;
+            free(samples);
+            return ERROR;
         }
+
+        err = pthread_join(tid, NULL);
+        if (err != SUCCESS) {
+            fprintf(stderr, "Failed to join thread %zu : %s\n", i, strerror(err));
+            free(samples);
+            return ERROR;
+        }
+
+        samples[i] = now_ns() - t;
     }
 
-    return EXIT_SUCCESS;
+    print_latency_row("create+join", samples, iterations, now_ns() - start);
+    free(samples);
+    return SUCCESS;
+}
+
+static int bench_max_threads(size_t max_threads) {
+    pthread_t* tids = malloc(max_threads * sizeof(*tids));
+    if (tids == NULL) { return ERROR; }
+
+    size_t vsz_before = 0, rss_before = 0, vsz_after = 0, rss_after = 0;
+    read_memory(&vsz_before, &rss_before);
+
+    int err = SUCCESS;
+    size_t count = 0;
+    while (count < max_threads) {
+        err = pthread_create(&tids[count], NULL, parked_thread, NULL);
+        if (err != SUCCESS) { break; }
+        count++;
+    }
+
+    read_memory(&vsz_after, &rss_after);
+
+    pthread_mutex_lock(&lock);
+    release = 1;
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    printf("\nmax joinable threads: %zu (%s)\n", count,
+           (err != SUCCESS) ? strerror(err) : "limit of this run");
+    if (count > 0) {
+        printf("memory per thread:    %zu KiB virtual, %zu KiB resident\n",
+               memory_delta(vsz_after, vsz_before) / count,
+               memory_delta(rss_after, rss_before) / count);
+    }
+    return SUCCESS;
 }
 
+int main(int argc, char** argv) {
+    size_t iterations = parse_iterations(argc, argv);
+
+    size_t max_threads = DEFAULT_MAX_THREADS;
+    if (argc > 2) { max_threads = (size_t)strtoul(argv[2], NULL, 10); }
+
+    print_latency_header();
+    if (bench_create_join(iterations) != SUCCESS) { return EXIT_FAILURE; }
+    if (max_threads > 0 && bench_max_threads(max_threads) != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -3,34 +3,89 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "bench.h"
 #include "utils.h"
 
-void* mythread(void* arg) {
+// Detached threads: the cost of pthread_create when the thread detaches
+// itself, and when the creator detaches it right away. Throughput counts
+// until every thread has finished, since nobody joins them.
+// Usage: e [iterations]
+
+static atomic_size_t finished = 0;
+
+void* self_detaching_thread(void* arg) {
     size_t thread_num = (size_t) arg;
-    printf("My thread_num = %7zu and tid = %lu\n", thread_num, pthread_self());
-    
+
     int err = pthread_detach(pthread_self());
     if (err != SUCCESS) {
         fprintf(stderr, "Failed to detach to %zu : %s\n", thread_num, strerror(err));
     }
+
+    atomic_fetch_add(&finished, 1);
+    return NULL;
+}
+
+void* mythread(void* arg) {
+    atomic_fetch_add(&finished, 1);
     return NULL;
 }
 
-int main(void) {
-    pthread_t tid;
+static void wait_finished(size_t count) {
+    while (atomic_load(&finished) < count) {
+        usleep(100);
+    }
+}
+
+static int bench_detach(const char* mode, size_t iterations, int self_detach) {
+    uint64_t* samples = malloc(iterations * sizeof(*samples));
+    if (samples == NULL) { return ERROR; }
 
-    for (size_t i = 0;; i++) {
-        int err = pthread_create(&tid, NULL, mythread, (void*) i);
+    atomic_store(&finished, 0);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        pthread_t tid;
+        uint64_t t = now_ns();
+
+        int err = pthread_create(&tid, NULL,
+                                 self_detach ? self_detaching_thread : mythread,
+                                 (void*) i);
         if (err != SUCCESS) {
             fprintf(stderr, "Failed to create thread %zu : %s\n", i, strerror(err));
-            break;
+            wait_finished(i);
+            free(samples);
+            return ERROR;
+        }
+
+        if (!self_detach) {
+            err = pthread_detach(tid);
+            if (err != SUCCESS) {
+                fprintf(stderr, "Failed to detach %zu : %s\n", i, strerror(err));
+            }
         }
+
+        samples[i] = now_ns() - t;
     }
+    wait_finished(iterations);
 
-    return EXIT_SUCCESS;
+    print_latency_row(mode, samples, iterations, now_ns() - start);
+    free(samples);
+    return SUCCESS;
 }
 
+int main(int argc, char** argv) {
+    size_t iterations = parse_iterations(argc, argv);
+
+    print_latency_header();
+    if (bench_detach("create+self-detach", iterations, 1) != SUCCESS ||
+        bench_detach("create+detach", iterations, 0) != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
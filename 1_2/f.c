@@ -3,46 +3,182 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 
+#include "bench.h"
 #include "utils.h"
 
+// Threads detached through their attribute: pthread_create cost, then
+// the memory a live thread takes for a range of stack and guard sizes.
+// Usage: f [iterations] [live threads per memory sample]
+
+#define DEFAULT_LIVE_THREADS 256
+
+// Sizes below PTHREAD_STACK_MIN are raised to it
+static const size_t stack_sizes[] = {
+    16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 8 * 1024 * 1024
+};
+static const size_t guard_sizes[] = { 0, 4096, 64 * 1024 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static int release = 0;
+
+static atomic_size_t started = 0;
+static atomic_size_t finished = 0;
+
 void* mythread(void* arg) {
-    size_t thread_num = (size_t) arg;
-    printf("My thread_num = %7zu and tid = %lu\n", thread_num, pthread_self());
+    atomic_fetch_add(&finished, 1);
     return NULL;
 }
 
-int main(void) {
-    int err;
+// Stays alive until the memory of all threads has been sampled
+void* parked_thread(void* arg) {
+    atomic_fetch_add(&started, 1);
 
-    pthread_attr_t detach_attr;
-    err = pthread_attr_init(&detach_attr);
+    pthread_mutex_lock(&lock);
+    while (!release) {
+        pthread_cond_wait(&released, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    atomic_fetch_add(&finished, 1);
+    return NULL;
+}
+
+static void wait_counter(atomic_size_t* counter, size_t count) {
+    while (atomic_load(counter) < count) {
+        usleep(100);
+    }
+}
+
+static int init_attr(pthread_attr_t* attr, size_t stack_size, size_t guard_size) {
+    int err = pthread_attr_init(attr);
     if (err != SUCCESS) {
-        fprintf(stderr, "Failed to init attribute : %s", strerror(err));
-        return EXIT_FAILURE;
+        fprintf(stderr, "Failed to init attribute : %s\n", strerror(err));
+        return ERROR;
     }
 
-    err = pthread_attr_setdetachstate(&detach_attr,PTHREAD_CREATE_DETACHED);
+    err = pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED);
+    if (err == SUCCESS && stack_size != 0) { err = pthread_attr_setstacksize(attr, stack_size); }
+    if (err == SUCCESS && stack_size != 0) { err = pthread_attr_setguardsize(attr, guard_size); }
     if (err != SUCCESS) {
-        fprintf(stderr, "Failed to set DETACHED to attribute : %s", strerror(err));
+        fprintf(stderr, "Failed to set attribute : %s\n", strerror(err));
+        pthread_attr_destroy(attr);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+static int bench_attr_detached(size_t iterations) {
+    pthread_attr_t detach_attr;
+    if (init_attr(&detach_attr, 0, 0) != SUCCESS) { return ERROR; }
+
+    uint64_t* samples = malloc(iterations * sizeof(*samples));
+    if (samples == NULL) {
         pthread_attr_destroy(&detach_attr);
-        return EXIT_FAILURE;
+        return ERROR;
     }
 
-    pthread_t tid;
+    atomic_store(&finished, 0);
+
+    uint64_t start = now_ns();
+    size_t i = 0;
+    for (; i < iterations; i++) {
+        pthread_t tid;
+        uint64_t t = now_ns();
 
-    for (size_t i = 0;; i++) {
         int err = pthread_create(&tid, &detach_attr, mythread, (void*) i);
         if (err != SUCCESS) {
             fprintf(stderr, "Failed to create thread %zu : %s\n", i, strerror(err));
             break;
         }
+
+        samples[i] = now_ns() - t;
     }
+    wait_counter(&finished, i);
 
+    print_latency_row("create (attr detach)", samples, i, now_ns() - start);
+
+    free(samples);
     pthread_attr_destroy(&detach_attr);
-    return EXIT_SUCCESS;
+    return (i == iterations) ? SUCCESS : ERROR;
 }
 
+// Keeps `count` threads alive and reports the growth of the process
+static int bench_memory(size_t stack_size, size_t guard_size, size_t count) {
+    if (stack_size < (size_t)PTHREAD_STACK_MIN) { stack_size = (size_t)PTHREAD_STACK_MIN; }
+
+    pthread_attr_t attr;
+    if (init_attr(&attr, stack_size, guard_size) != SUCCESS) { return ERROR; }
+
+    atomic_store(&started, 0);
+    atomic_store(&finished, 0);
+    release = 0;
+
+    size_t vsz_before = 0, rss_before = 0, vsz_after = 0, rss_after = 0;
+    read_memory(&vsz_before, &rss_before);
+
+    uint64_t start = now_ns();
+    size_t created = 0;
+    for (; created < count; created++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, &attr, parked_thread, NULL);
+        if (err != SUCCESS) {
+            fprintf(stderr, "Failed to create thread %zu : %s\n", created, strerror(err));
+            break;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    wait_counter(&started, created);
+    read_memory(&vsz_after, &rss_after);
+
+    pthread_mutex_lock(&lock);
+    release = 1;
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+    wait_counter(&finished, created);
+
+    pthread_attr_destroy(&attr);
+    if (created == 0) { return ERROR; }
+
+    printf("%10zu %10zu %10.1f %14zu %14zu\n",
+           stack_size / 1024, guard_size / 1024,
+           (double)elapsed / (double)created / 1e3,
+           memory_delta(vsz_after, vsz_before) / created,
+           memory_delta(rss_after, rss_before) / created);
+    return (created == count) ? SUCCESS : ERROR;
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = parse_iterations(argc, argv);
+
+    size_t live_threads = DEFAULT_LIVE_THREADS;
+    if (argc > 2) { live_threads = (size_t)strtoul(argv[2], NULL, 10); }
+    if (live_threads == 0) { live_threads = DEFAULT_LIVE_THREADS; }
+
+    int status = EXIT_SUCCESS;
+
+    print_latency_header();
+    if (bench_attr_detached(iterations) != SUCCESS) { status = EXIT_FAILURE; }
+
+    // glibc caches the stacks of exited threads, so freshly created ones
+    // may reuse memory that is already resident
+    printf("\n%10s %10s %10s %14s %14s\n",
+           "stack KiB", "guard KiB", "create us", "virt KiB/thr", "rss KiB/thr");
+
+    for (size_t s = 0; s < sizeof(stack_sizes) / sizeof(stack_sizes[0]); s++) {
+        for (size_t g = 0; g < sizeof(guard_sizes) / sizeof(guard_sizes[0]); g++) {
+            if (bench_memory(stack_sizes[s], guard_sizes[g], live_threads) != SUCCESS) {
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    return status;
+}
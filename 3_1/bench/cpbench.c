@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tree.h"
+
+// Compares the tree copier with cp -R on synthetic trees and prints one
+// CSV row per run:
+//   cpbench --cp=build/cp --work=/tmp/cpbench --runs=3 > results.csv
+// Dropping the page cache between runs (--cold) needs root.
+
+#define ERROR -1
+#define SUCCESS 0
+
+const unsigned DEFAULT_RUNS = 3;
+
+typedef struct {
+    const char* cp;
+    const char* work;
+    char** cp_args;
+    int cp_argc;
+
+    unsigned runs;
+    unsigned scale;
+    int cold;
+    int shapes[TREE_NUM];
+    int keep;
+} options_t;
+
+typedef struct {
+    double wall_s;
+    double user_s;
+    double sys_s;
+    long vol_cs;
+    long invol_cs;
+    long max_rss_kb;
+    int status;
+} run_result_t;
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double tv_s(const struct timeval* tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+static int drop_caches(void) {
+    sync();
+
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd == ERROR) { return ERROR; }
+
+    int err = (write(fd, "3", 1) == 1) ? SUCCESS : ERROR;
+    close(fd);
+    return err;
+}
+
+// Runs `argv` with stdout discarded and collects the child's own rusage
+static int run(char** argv, run_result_t* res) {
+    fflush(stdout);
+    double start = now_s();
+
+    pid_t pid = fork();
+    if (pid == ERROR) { return ERROR; }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != ERROR) { dup2(null_fd, STDOUT_FILENO); }
+
+        execvp(argv[0], argv);
+        fprintf(stderr, "exec '%s': %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int wstatus;
+    struct rusage ru;
+    while (wait4(pid, &wstatus, 0, &ru) == ERROR) {
+        if (errno != EINTR) { return ERROR; }
+    }
+
+    res->wall_s = now_s() - start;
+    res->user_s = tv_s(&ru.ru_utime);
+    res->sys_s = tv_s(&ru.ru_stime);
+    res->vol_cs = ru.ru_nvcsw;
+    res->invol_cs = ru.ru_nivcsw;
+    res->max_rss_kb = ru.ru_maxrss;
+    res->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    return SUCCESS;
+}
+
+static void print_row(const char* shape, const char* tool, unsigned run_idx,
+                      const options_t* opts, const tree_info_t* info,
+                      const run_result_t* r) {
+    double mib_s = (r->wall_s > 0.0) ? (double)info->bytes / r->wall_s / (1024.0 * 1024.0) : 0.0;
+
+    printf("%s,%s,%u,%s,%llu,%llu,%llu,%.4f,%.4f,%.4f,%ld,%ld,%ld,%.1f,%d\n",
+           shape, tool, run_idx, opts->cold ? "cold" : "warm",
+           (unsigned long long)info->files, (unsigned long long)info->dirs,
+           (unsigned long long)info->bytes,
+           r->wall_s, r->user_s, r->sys_s, r->vol_cs, r->invol_cs,
+           r->max_rss_kb, mib_s, r->status);
+    fflush(stdout);
+}
+
+static int bench_tool(const options_t* opts, const char* shape, const char* tool,
+                      char** argv, const char* dst, const tree_info_t* info) {
+    int failed = 0;
+
+    for (unsigned i = 0; i < opts->runs; i++) {
+        if (tree_remove(dst) != TREE_SUCCESS) { return ERROR; }
+
+        if (opts->cold && drop_caches() != SUCCESS) {
+            fprintf(stderr, "failed to drop caches: %s\n", strerror(errno));
+            return ERROR;
+        }
+
+        run_result_t r;
+        if (run(argv, &r) != SUCCESS) {
+            fprintf(stderr, "failed to run '%s': %s\n", argv[0], strerror(errno));
+            return ERROR;
+        }
+        if (r.status != 0) { failed = 1; }
+
+        print_row(shape, tool, i, opts, info, &r);
+    }
+
+    tree_remove(dst);
+    return failed ? ERROR : SUCCESS;
+}
+
+static int bench_shape(const options_t* opts, int shape) {
+    const char* name = tree_name(shape);
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+
+    snprintf(src, sizeof(src), "%s/src-%s", opts->work, name);
+    snprintf(dst, sizeof(dst), "%s/dst-%s", opts->work, name);
+
+    tree_info_t info;
+    if (tree_remove(src) != TREE_SUCCESS ||
+        tree_generate(shape, src, opts->scale, &info) != TREE_SUCCESS) {
+        fprintf(stderr, "failed to generate '%s' tree\n", name);
+        return ERROR;
+    }
+
+    // ours: <cp> [args...] src dst
+    char** ours = calloc((size_t)opts->cp_argc + 4, sizeof(*ours));
+    if (ours == NULL) { return ERROR; }
+
+    int n = 0;
+    ours[n++] = (char*)opts->cp;
+    for (int i = 0; i < opts->cp_argc; i++) { ours[n++] = opts->cp_args[i]; }
+    ours[n++] = src;
+    ours[n++] = dst;
+
+    char* system_cp[] = { "cp", "-R", src, dst, NULL };
+
+    int status = SUCCESS;
+    if (bench_tool(opts, name, "cp", ours, dst, &info) != SUCCESS) { status = ERROR; }
+    if (bench_tool(opts, name, "cp -R", system_cp, dst, &info) != SUCCESS) { status = ERROR; }
+
+    free(ours);
+    if (!opts->keep) { tree_remove(src); }
+    return status;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s --cp=PATH [options] [-- cp args...]\n"
+           "\n"
+           "Options:\n"
+           "  --cp=PATH         tree copier to compare with cp -R\n"
+           "  --work=DIR        where trees are generated (default: .)\n"
+           "  --shape=LIST      tiny, huge, deep, wide, sparse, hardlink\n"
+           "                    (default: all)\n"
+           "  --runs=N          runs per tool and shape (default: %u)\n"
+           "  --scale=N         multiply tree sizes by N (default: 1)\n"
+           "  --cold            drop the page cache before every run (root)\n"
+           "  --keep            keep generated source trees\n"
+           "  -h, --help        show this message\n",
+           name, DEFAULT_RUNS);
+}
+
+static int parse_unsigned(const char* str, unsigned* res) {
+    char* end;
+    unsigned long v = strtoul(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || v == 0 || v > UINT_MAX) { return ERROR; }
+
+    *res = (unsigned)v;
+    return SUCCESS;
+}
+
+static int parse_shapes(const char* list, int* shapes) {
+    char buf[256];
+    if (strlen(list) >= sizeof(buf)) { return ERROR; }
+    strcpy(buf, list);
+
+    memset(shapes, 0, TREE_NUM * sizeof(*shapes));
+    for (char* tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int shape = tree_parse(tok);
+        if (shape < 0) { return ERROR; }
+        shapes[shape] = 1;
+    }
+    return SUCCESS;
+}
+
+static int parse_options(options_t* opts, int argc, char** argv) {
+    enum { OPT_CP = 256, OPT_WORK, OPT_SHAPE, OPT_RUNS, OPT_SCALE, OPT_COLD,
+           OPT_KEEP };
+
+    static const struct option long_options[] = {
+        { "cp",    required_argument, NULL, OPT_CP    },
+        { "work",  required_argument, NULL, OPT_WORK  },
+        { "shape", required_argument, NULL, OPT_SHAPE },
+        { "runs",  required_argument, NULL, OPT_RUNS  },
+        { "scale", required_argument, NULL, OPT_SCALE },
+        { "cold",  no_argument,       NULL, OPT_COLD  },
+        { "keep",  no_argument,       NULL, OPT_KEEP  },
+        { "help",  no_argument,       NULL, 'h'       },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(opts, 0, sizeof(*opts));
+    opts->work = ".";
+    opts->runs = DEFAULT_RUNS;
+    opts->scale = 1;
+    for (int i = 0; i < TREE_NUM; i++) { opts->shapes[i] = 1; }
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case OPT_CP:
+            opts->cp = optarg;
+            break;
+        case OPT_WORK:
+            opts->work = optarg;
+            break;
+        case OPT_SHAPE:
+            if (parse_shapes(optarg, opts->shapes) != SUCCESS) { return ERROR; }
+            break;
+        case OPT_RUNS:
+            if (parse_unsigned(optarg, &opts->runs) != SUCCESS) { return ERROR; }
+            break;
+        case OPT_SCALE:
+            if (parse_unsigned(optarg, &opts->scale) != SUCCESS) { return ERROR; }
+            break;
+        case OPT_COLD:
+            opts->cold = 1;
+            break;
+        case OPT_KEEP:
+            opts->keep = 1;
+            break;
+        default:
+            return ERROR;
+        }
+    }
+
+    if (opts->cp == NULL) { return ERROR; }
+
+    opts->cp_args = argv + optind;
+    opts->cp_argc = argc - optind;
+    return SUCCESS;
+}
+
+int main(int argc, char** argv) {
+    options_t opts;
+    if (parse_options(&opts, argc, argv) != SUCCESS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (mkdir(opts.work, 0755) == ERROR && errno != EEXIST) {
+        fprintf(stderr, "failed to create '%s': %s\n", opts.work, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("shape,tool,run,cache,files,dirs,bytes,wall_s,user_s,sys_s,"
+           "vol_cs,invol_cs,max_rss_kb,mib_per_s,exit\n");
+
+    int status = EXIT_SUCCESS;
+    for (int shape = 0; shape < TREE_NUM; shape++) {
+        if (!opts.shapes[shape]) { continue; }
+        if (bench_shape(&opts, shape) != SUCCESS) { status = EXIT_FAILURE; }
+    }
+
+    return status;
+}
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "threadpool.h"
+
+// Thread pool microbenchmark and stress test. Every scenario is run for
+// each thread count and checks that tp_wait_idling only returns once
+// every submitted task, including recursively submitted ones, is done.
+//   empty    empty handlers submitted from a single thread
+//   fanout   handlers that submit children, like process_folder
+//   skew     several producers feeding a pool with uneven task costs
+//   latency  tp_add to handler start, tasks submitted at a steady pace
+
+#define ERROR -1
+#define SUCCESS 0
+
+const size_t DEFAULT_TASKS = 200000;
+const size_t FANOUT = 8;
+const size_t SKEW_PRODUCERS = 4;
+const uint64_t LATENCY_PACE_NS = 5000;
+
+static const size_t default_threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+typedef struct {
+    const char* name;
+    int (*run)(size_t thread_num, size_t tasks);
+} scenario_t;
+
+typedef struct {
+    size_t threads[64];
+    size_t thread_counts;
+    size_t tasks;
+    const char* scenario;
+} options_t;
+
+static tp_t* pool;
+static atomic_size_t handled;
+static atomic_size_t add_failed;
+static size_t fanout_depth;
+static uint64_t* latencies;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void spin_ns(uint64_t ns) {
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) {}
+}
+
+// Counts failed submissions, so that they are not mistaken for tasks
+// that tp_wait_idling did not wait for
+static void submit(void* task) {
+    if (tp_add(pool, task) != TP_SUCCESS) {
+        atomic_fetch_add_explicit(&add_failed, 1, memory_order_relaxed);
+    }
+}
+
+static int start_pool(size_t thread_num, void (*handler)(void*)) {
+    tp_conf_t conf = { 0 };
+    conf.thread_num = thread_num;
+    conf.handler = handler;
+
+    atomic_store(&handled, 0);
+    atomic_store(&add_failed, 0);
+    return (tp_init(&pool, &conf) == TP_SUCCESS) ? SUCCESS : ERROR;
+}
+
+static int finish_pool(size_t expected) {
+    tp_wait_idling(pool);
+    size_t done = atomic_load(&handled);
+    tp_destroy(pool);
+
+    size_t failed = atomic_load(&add_failed);
+    if (failed > 0) {
+        fprintf(stderr, "FAIL: tp_add failed for %zu of %zu tasks\n", failed, expected);
+        return ERROR;
+    }
+    if (done != expected) {
+        fprintf(stderr, "FAIL: tp_wait_idling returned after %zu of %zu tasks\n",
+                done, expected);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+static void print_row(const char* name, size_t thread_num, size_t tasks,
+                      uint64_t elapsed_ns) {
+    double s = (double)elapsed_ns / 1e9;
+    printf("%-8s %7zu %9zu %9.3f %12.0f", name, thread_num, tasks, s,
+           (s > 0.0) ? (double)tasks / s : 0.0);
+}
+
+static void empty_handler(void* arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&handled, 1, memory_order_relaxed);
+}
+
+static int run_empty(size_t thread_num, size_t tasks) {
+    if (start_pool(thread_num, empty_handler) != SUCCESS) { return ERROR; }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < tasks; i++) { submit(NULL); }
+    int status = finish_pool(tasks);
+
+    print_row("empty", thread_num, tasks, now_ns() - start);
+    putchar('\n');
+    return status;
+}
+
+// The task pointer carries the depth left below it
+static void fanout_handler(void* arg) {
+    size_t depth = (size_t)(uintptr_t)arg;
+
+    if (depth > 0) {
+        for (size_t i = 0; i < FANOUT; i++) {
+            submit((void*)(uintptr_t)(depth - 1));
+        }
+    }
+    atomic_fetch_add_explicit(&handled, 1, memory_order_relaxed);
+}
+
+static int run_fanout(size_t thread_num, size_t tasks) {
+    (void)tasks;
+
+    // 1 + 8 + ... + 8^depth tasks in total
+    size_t total = 0;
+    for (size_t level = 0, n = 1; level <= fanout_depth; level++, n *= FANOUT) {
+        total += n;
+    }
+
+    if (start_pool(thread_num, fanout_handler) != SUCCESS) { return ERROR; }
+
+    uint64_t start = now_ns();
+    submit((void*)(uintptr_t)fanout_depth);
+    int status = finish_pool(total);
+
+    print_row("fanout", thread_num, total, now_ns() - start);
+    putchar('\n');
+    return status;
+}
+
+// One task in a hundred is a hundred times as expensive
+static void skew_handler(void* arg) {
+    size_t i = (size_t)(uintptr_t)arg;
+    spin_ns((i % 100 == 0) ? 100000 : 1000);
+    atomic_fetch_add_explicit(&handled, 1, memory_order_relaxed);
+}
+
+static void* skew_producer(void* arg) {
+    size_t tasks = *(size_t*)arg;
+    for (size_t i = 0; i < tasks; i++) { submit((void*)(uintptr_t)i); }
+    return NULL;
+}
+
+static int run_skew(size_t thread_num, size_t tasks) {
+    pthread_t producers[SKEW_PRODUCERS];
+    size_t per_producer = tasks / SKEW_PRODUCERS / 10;
+
+    if (start_pool(thread_num, skew_handler) != SUCCESS) { return ERROR; }
+
+    uint64_t start = now_ns();
+    size_t started = 0;
+    while (started < SKEW_PRODUCERS &&
+           pthread_create(&producers[started], NULL, skew_producer, &per_producer) == 0) {
+        started++;
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(producers[i], NULL);
+    }
+
+    int status = finish_pool(per_producer * started);
+    if (started < SKEW_PRODUCERS) {
+        fprintf(stderr, "FAIL: started %zu of %zu producers\n", started, SKEW_PRODUCERS);
+        status = ERROR;
+    }
+
+    print_row("skew", thread_num, per_producer * SKEW_PRODUCERS, now_ns() - start);
+    putchar('\n');
+    return status;
+}
+
+// Each slot holds its enqueue time until the handler replaces it with
+// the latency
+static void latency_handler(void* arg) {
+    uint64_t* slot = arg;
+    *slot = now_ns() - *slot;
+    atomic_fetch_add_explicit(&handled, 1, memory_order_relaxed);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int run_latency(size_t thread_num, size_t tasks) {
+    // At least one sample for the percentiles below
+    tasks = (tasks >= 10) ? tasks / 10 : 1;
+    if (start_pool(thread_num, latency_handler) != SUCCESS) { return ERROR; }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < tasks; i++) {
+        latencies[i] = now_ns();
+        submit(&latencies[i]);
+        spin_ns(LATENCY_PACE_NS);
+    }
+    int status = finish_pool(tasks);
+    uint64_t elapsed = now_ns() - start;
+
+    qsort(latencies, tasks, sizeof(*latencies), cmp_u64);
+
+    print_row("latency", thread_num, tasks, elapsed);
+    printf(" %9.1f %9.1f %9.1f %9.1f\n",
+           (double)latencies[tasks / 2] / 1e3,
+           (double)latencies[tasks * 99 / 100] / 1e3,
+           (double)latencies[tasks * 999 / 1000] / 1e3,
+           (double)latencies[tasks - 1] / 1e3);
+    return status;
+}
+
+static const scenario_t scenarios[] = {
+    { "empty",   run_empty   },
+    { "fanout",  run_fanout  },
+    { "skew",    run_skew    },
+    { "latency", run_latency },
+};
+
+static void usage(const char* name) {
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  --threads=LIST    thread counts to run (default: 1,2,4,8,16,32,64)\n"
+           "  --tasks=N         tasks per run (default: %zu)\n"
+           "  --scenario=NAME   empty, fanout, skew or latency (default: all)\n"
+           "  -h, --help        show this message\n",
+           name, DEFAULT_TASKS);
+}
+
+static int parse_size(const char* str, size_t* res) {
+    char* end;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || v == 0) { return ERROR; }
+
+    *res = (size_t)v;
+    return SUCCESS;
+}
+
+static int parse_threads(options_t* opts, char* list) {
+    opts->thread_counts = 0;
+    for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (opts->thread_counts == sizeof(opts->threads) / sizeof(opts->threads[0])) {
+            return ERROR;
+        }
+        if (parse_size(tok, &opts->threads[opts->thread_counts++]) != SUCCESS) {
+            return ERROR;
+        }
+    }
+    return (opts->thread_counts > 0) ? SUCCESS : ERROR;
+}
+
+static int parse_options(options_t* opts, int argc, char** argv) {
+    enum { OPT_THREADS = 256, OPT_TASKS, OPT_SCENARIO };
+
+    static const struct option long_options[] = {
+        { "threads",  required_argument, NULL, OPT_THREADS  },
+        { "tasks",    required_argument, NULL, OPT_TASKS    },
+        { "scenario", required_argument, NULL, OPT_SCENARIO },
+        { "help",     no_argument,       NULL, 'h'          },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(opts, 0, sizeof(*opts));
+    opts->tasks = DEFAULT_TASKS;
+    opts->thread_counts = sizeof(default_threads) / sizeof(default_threads[0]);
+    memcpy(opts->threads, default_threads, sizeof(default_threads));
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case OPT_THREADS:
+            if (parse_threads(opts, optarg) != SUCCESS) { return ERROR; }
+            break;
+        case OPT_TASKS:
+            if (parse_size(optarg, &opts->tasks) != SUCCESS || opts->tasks == 0) {
+                return ERROR;
+            }
+            break;
+        case OPT_SCENARIO:
+            opts->scenario = optarg;
+            break;
+        default:
+            return ERROR;
+        }
+    }
+
+    return (optind == argc) ? SUCCESS : ERROR;
+}
+
+int main(int argc, char** argv) {
+    options_t opts;
+    if (parse_options(&opts, argc, argv) != SUCCESS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Deepest fan-out tree that stays within the task budget
+    fanout_depth = 0;
+    for (size_t n = FANOUT; n <= opts.tasks; n *= FANOUT) { fanout_depth++; }
+
+    latencies = malloc(opts.tasks * sizeof(*latencies));
+    if (latencies == NULL) { return EXIT_FAILURE; }
+
+    printf("%-8s %7s %9s %9s %12s %9s %9s %9s %9s\n", "scenario", "threads",
+           "tasks", "seconds", "tasks/s", "p50 us", "p99 us", "p999 us", "max us");
+
+    int status = EXIT_SUCCESS;
+    int found = 0;
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        if (opts.scenario != NULL && strcmp(opts.scenario, scenarios[s].name) != 0) {
+            continue;
+        }
+        found = 1;
+
+        for (size_t t = 0; t < opts.thread_counts; t++) {
+            if (scenarios[s].run(opts.threads[t], opts.tasks) != SUCCESS) {
+                status = EXIT_FAILURE;
+            }
+            fflush(stdout);
+        }
+    }
+
+    free(latencies);
+
+    if (!found) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    return status;
+}
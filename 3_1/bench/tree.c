@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include "tree.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ERROR -1
+#define SUCCESS 0
+
+#define TREE_SEED 0x9e3779b97f4a7c15ull
+#define TREE_BUF_SIZE (1024 * 1024)
+
+static const char* const tree_names[TREE_NUM] = {
+    [TREE_TINY]     = "tiny",
+    [TREE_HUGE]     = "huge",
+    [TREE_DEEP]     = "deep",
+    [TREE_WIDE]     = "wide",
+    [TREE_SPARSE]   = "sparse",
+    [TREE_HARDLINK] = "hardlink",
+};
+
+typedef struct {
+    uint64_t rng;
+    char* buf;
+    tree_info_t info;
+} tree_gen_t;
+
+
+const char* tree_name(int shape) {
+    return (shape >= 0 && shape < TREE_NUM) ? tree_names[shape] : NULL;
+}
+
+int tree_parse(const char* name) {
+    for (int i = 0; i < TREE_NUM; i++) {
+        if (strcmp(tree_names[i], name) == 0) { return i; }
+    }
+    return -1;
+}
+
+// xorshift64*, fixed seed so trees are the same everywhere
+static uint64_t tree_rand(tree_gen_t* g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545f4914f6cdd1dull;
+}
+
+// Rounds up to whole words, so no byte of the buffer is left unset
+static void tree_fill(tree_gen_t* g, size_t len) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t v = tree_rand(g);
+        memcpy(g->buf + i, &v, 8);
+    }
+}
+
+static int tree_mkdir(tree_gen_t* g, const char* path) {
+    if (mkdir(path, 0755) == ERROR && errno != EEXIST) {
+        fprintf(stderr, "mkdir '%s': %s\n", path, strerror(errno));
+        return TREE_FAILURE;
+    }
+
+    g->info.dirs++;
+    return TREE_SUCCESS;
+}
+
+// Writes `size` bytes, or only a 4 KiB block every `stride` bytes if
+// `stride` is non-zero, leaving the rest as holes
+static int tree_file(tree_gen_t* g, const char* path, uint64_t size, uint64_t stride) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == ERROR) {
+        fprintf(stderr, "open '%s': %s\n", path, strerror(errno));
+        return TREE_FAILURE;
+    }
+
+    int status = TREE_SUCCESS;
+    uint64_t off = 0;
+
+    while (off < size) {
+        size_t len = (size - off < TREE_BUF_SIZE) ? (size_t)(size - off) : TREE_BUF_SIZE;
+        if (stride != 0 && len > 4096) { len = 4096; }
+
+        tree_fill(g, len);
+        if (pwrite(fd, g->buf, len, (off_t)off) != (ssize_t)len) {
+            status = TREE_FAILURE;
+            break;
+        }
+
+        off += (stride != 0) ? stride : len;
+    }
+
+    if (status == TREE_SUCCESS && ftruncate(fd, (off_t)size) == ERROR) {
+        status = TREE_FAILURE;
+    }
+    if (close(fd) == ERROR) { status = TREE_FAILURE; }
+
+    if (status != TREE_SUCCESS) {
+        fprintf(stderr, "write '%s': %s\n", path, strerror(errno));
+        return status;
+    }
+
+    g->info.files++;
+    g->info.bytes += size;
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_tiny(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+
+    for (unsigned d = 0; d < 100; d++) {
+        snprintf(path, sizeof(path), "%s/d%03u", root, d);
+        if (tree_mkdir(g, path) != TREE_SUCCESS) { return TREE_FAILURE; }
+
+        for (unsigned f = 0; f < 100 * scale; f++) {
+            snprintf(path, sizeof(path), "%s/d%03u/f%05u", root, d, f);
+            uint64_t size = tree_rand(g) % 4096;
+            if (tree_file(g, path, size, 0) != TREE_SUCCESS) { return TREE_FAILURE; }
+        }
+    }
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_huge(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+
+    for (unsigned f = 0; f < 4; f++) {
+        snprintf(path, sizeof(path), "%s/huge%u", root, f);
+        uint64_t size = (uint64_t)scale * 128 * 1024 * 1024;
+        if (tree_file(g, path, size, 0) != TREE_SUCCESS) { return TREE_FAILURE; }
+    }
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_deep(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+    size_t len = (size_t)snprintf(path, sizeof(path), "%s", root);
+
+    for (unsigned d = 0; d < 100 * scale; d++) {
+        // Stops short of PATH_MAX for large scales
+        if (len + 32 >= sizeof(path)) { break; }
+        memcpy(path + len, "/d", 3);
+        len += 2;
+
+        if (tree_mkdir(g, path) != TREE_SUCCESS) { return TREE_FAILURE; }
+
+        for (unsigned f = 0; f < 4; f++) {
+            snprintf(path + len, sizeof(path) - len, "/f%u", f);
+            uint64_t size = tree_rand(g) % 16384;
+            if (tree_file(g, path, size, 0) != TREE_SUCCESS) { return TREE_FAILURE; }
+        }
+        path[len] = '\0';
+    }
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_wide(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+
+    for (unsigned f = 0; f < 20000 * scale; f++) {
+        snprintf(path, sizeof(path), "%s/file-with-a-longer-name-%07u", root, f);
+        if (tree_file(g, path, 1024, 0) != TREE_SUCCESS) { return TREE_FAILURE; }
+    }
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_sparse(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+
+    for (unsigned f = 0; f < 16; f++) {
+        snprintf(path, sizeof(path), "%s/sparse%02u", root, f);
+        uint64_t size = (uint64_t)scale * 64 * 1024 * 1024;
+        if (tree_file(g, path, size, 1024 * 1024) != TREE_SUCCESS) {
+            return TREE_FAILURE;
+        }
+    }
+    return TREE_SUCCESS;
+}
+
+static int tree_gen_hardlink(tree_gen_t* g, const char* root, unsigned scale) {
+    char path[PATH_MAX];
+    char link_path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/links", root);
+    if (tree_mkdir(g, path) != TREE_SUCCESS) { return TREE_FAILURE; }
+
+    for (unsigned f = 0; f < 2000 * scale; f++) {
+        uint64_t size = tree_rand(g) % 65536;
+
+        snprintf(path, sizeof(path), "%s/f%06u", root, f);
+        if (tree_file(g, path, size, 0) != TREE_SUCCESS) { return TREE_FAILURE; }
+
+        for (unsigned l = 0; l < 3; l++) {
+            snprintf(link_path, sizeof(link_path), "%s/links/f%06u.%u", root, f, l);
+            if (link(path, link_path) == ERROR) {
+                fprintf(stderr, "link '%s': %s\n", link_path, strerror(errno));
+                return TREE_FAILURE;
+            }
+            g->info.files++;
+            g->info.bytes += size;
+        }
+    }
+    return TREE_SUCCESS;
+}
+
+int tree_generate(int shape, const char* root, unsigned scale, tree_info_t* info) {
+    static int (*const generators[TREE_NUM])(tree_gen_t*, const char*, unsigned) = {
+        [TREE_TINY]     = tree_gen_tiny,
+        [TREE_HUGE]     = tree_gen_huge,
+        [TREE_DEEP]     = tree_gen_deep,
+        [TREE_WIDE]     = tree_gen_wide,
+        [TREE_SPARSE]   = tree_gen_sparse,
+        [TREE_HARDLINK] = tree_gen_hardlink,
+    };
+
+    if (shape < 0 || shape >= TREE_NUM || root == NULL || scale == 0) {
+        return TREE_INVALID_ARGUMENT;
+    }
+
+    tree_gen_t g = { 0 };
+    g.rng = TREE_SEED ^ (uint64_t)(shape + 1);
+    g.buf = malloc(TREE_BUF_SIZE);
+    if (g.buf == NULL) { return TREE_FAILURE; }
+
+    int status = tree_mkdir(&g, root);
+    if (status == TREE_SUCCESS) { status = generators[shape](&g, root, scale); }
+
+    free(g.buf);
+    if (info != NULL) { *info = g.info; }
+    return status;
+}
+
+static int tree_remove_entry(const char* path, const struct stat* st,
+                             int flag, struct FTW* ftw) {
+    (void)st;
+    (void)ftw;
+
+    int err = (flag == FTW_DP) ? rmdir(path) : unlink(path);
+    if (err == ERROR) {
+        fprintf(stderr, "remove '%s': %s\n", path, strerror(errno));
+        return TREE_FAILURE;
+    }
+    return SUCCESS;
+}
+
+int tree_remove(const char* root) {
+    struct stat st;
+    if (lstat(root, &st) == ERROR) {
+        return (errno == ENOENT) ? TREE_SUCCESS : TREE_FAILURE;
+    }
+
+    if (nftw(root, tree_remove_entry, 64, FTW_DEPTH | FTW_PHYS) != SUCCESS) {
+        return TREE_FAILURE;
+    }
+    return TREE_SUCCESS;
+}
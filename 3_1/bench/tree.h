@@ -0,0 +1,43 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdint.h>
+
+enum {
+    TREE_SUCCESS = 0,
+    TREE_FAILURE = -1,
+    TREE_INVALID_ARGUMENT = -3
+};
+
+// Shapes of synthetic source trees
+enum {
+    TREE_TINY,      // many files of a few KiB spread over a few dirs
+    TREE_HUGE,      // a handful of very large files
+    TREE_DEEP,      // one long chain of directories with a few files each
+    TREE_WIDE,      // a single directory with a lot of small files
+    TREE_SPARSE,    // large files that are mostly holes
+    TREE_HARDLINK,  // files with several hard links each
+
+    TREE_NUM
+};
+
+typedef struct {
+    uint64_t files;     // directory entries a copier has to create
+    uint64_t dirs;
+    uint64_t bytes;     // logical size of all files, links counted again
+} tree_info_t;
+
+const char* tree_name(int shape);
+
+// Returns the shape called `name`, or -1
+int tree_parse(const char* name);
+
+// Creates `root` and fills it with the given shape. Sizes are multiplied
+// by `scale`. The contents only depend on the shape and the scale, so
+// runs on different machines copy byte-identical trees.
+int tree_generate(int shape, const char* root, unsigned scale, tree_info_t* info);
+
+// rm -rf that does not follow symlinks; a missing path is not an error
+int tree_remove(const char* root);
+
+#endif /* TREE_H */
@@ -0,0 +1,36 @@
+#ifndef CANCEL_H
+#define CANCEL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Cooperative cancellation. A token counts as requested once it or any
+// of its ancestors is, so canceling a parent (the process, an engine)
+// cancels every child (its jobs) without knowing about them. Work
+// checks its token between steps and stops at the next one.
+typedef struct cancel {
+    const struct cancel* parent;
+    atomic_int requested;
+} cancel_t;
+
+// `parent` may be NULL, and has to outlive the token
+static inline void cancel_init(cancel_t* c, const cancel_t* parent) {
+    c->parent = parent;
+    atomic_init(&c->requested, 0);
+}
+
+// Async-signal-safe, so it may be called from a signal handler
+static inline void cancel_request(cancel_t* c) {
+    atomic_store_explicit(&c->requested, 1, memory_order_relaxed);
+}
+
+// Cheap enough to call for every chunk copied: one relaxed load per
+// level. A NULL token is never canceled.
+static inline int cancel_requested(const cancel_t* c) {
+    for (; c != NULL; c = c->parent) {
+        if (atomic_load_explicit(&c->requested, memory_order_relaxed)) { return 1; }
+    }
+    return 0;
+}
+
+#endif /* CANCEL_H */
@@ -1,72 +1,759 @@
+#define _GNU_SOURCE
+
 #include "copy.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "crc32c.h"
+#include "hist.h"
+#include "meta.h"
+#include "ratelimit.h"
+
 #define ERROR -1
 
-#ifndef BUF_SIZE
-#define BUF_SIZE 8192
-#endif
+// O_DIRECT wants block-aligned buffers and offsets
+#define VERIFY_ALIGN 4096
+#define VERIFY_BUF_SIZE (1024 * 1024)
+
+// Pipelined copies hand PIPE_DEPTH buffers of PIPE_BUF_SIZE bytes from
+// a reader thread to the worker; the reader itself barely uses stack
+#define PIPE_DEPTH 4
+#define PIPE_BUF_SIZE (1024 * 1024)
+#define PIPE_READER_STACK_SIZE (64 * 1024)
+
+// Mapped files and copy_file_range are processed in chunks of this
+// size, so checkpoints and hashing keep their granularity
+#define MAP_CHUNK_SIZE (1024 * 1024)
+#define CFR_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Files of this size and up are cloned in ranges, each followed by a
+// checkpoint. Clone ranges must be multiples of the block size.
+#define CLONE_CHUNK_SIZE (256 * 1024 * 1024)
+
+// Pairs of filesystems whose support for cloning is remembered
+#define CLONE_CACHE_SIZE 32
+
+
+// Where the copy of one file stands, shared by both copy loops
+typedef struct {
+    int out_fd;
+    off_t offset;
+    off_t next_checkpoint;
+    const copy_opts_t* opts;
+
+    // If set, updated with everything that is copied
+    uint32_t* crc;
+} copy_state_t;
+
+// Ring of buffers between the reader thread and the writing worker
+typedef struct {
+    int in_fd;
+
+    uint8_t* bufs[PIPE_DEPTH];
+    ssize_t lens[PIPE_DEPTH];   // 0 marks the end, ERROR a failed read
+
+    size_t head;                // next slot the reader fills
+    size_t tail;                // next slot the writer drains
+    int stop;                   // set by the writer when it gives up
+
+    // The worker's histograms, which the reader records its reads into
+    void* hist;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} copy_pipe_t;
+
 
+static void copy_state_init(copy_state_t* s, int out_fd, off_t offset,
+                            const copy_opts_t* opts, uint32_t* crc) {
+    s->out_fd = out_fd;
+    s->offset = offset;
+    s->opts = opts;
+    s->crc = crc;
+
+    s->next_checkpoint = -1;
+    if (opts != NULL && opts->checkpoint != NULL && opts->checkpoint_size > 0) {
+        s->next_checkpoint = offset + opts->checkpoint_size;
+    }
+}
+
+static ssize_t copy_read(int fd, uint8_t* buf, size_t len) {
+    while (1) {
+        HIST_BEGIN(t_read);
+        ssize_t nr = read(fd, buf, len);
+        HIST_END(HIST_READ, t_read);
+
+        if (nr != ERROR || errno != EINTR) { return nr; }
+    }
+}
+
+// Accounts for `len` more bytes in the destination and checkpoints.
+// Every engine comes through here once per chunk, which makes it the
+// place to notice a cancel.
+static int copy_advance(copy_state_t* s, size_t len) {
+    s->offset += (off_t)len;
+    if (s->next_checkpoint != -1 && s->offset >= s->next_checkpoint) {
+        HIST_BEGIN(t_sync);
+        int err = fdatasync(s->out_fd);
+        HIST_END(HIST_FDATASYNC, t_sync);
+        if (err == ERROR) { return COPY_IO_FAILURE; }
+
+        s->opts->checkpoint(s->opts->arg, s->offset);
+        s->next_checkpoint = s->offset + s->opts->checkpoint_size;
+    }
+
+    if (s->opts != NULL && cancel_requested(s->opts->cancel)) { return COPY_CANCELED; }
+    return COPY_SUCCESS;
+}
+
+static inline void copy_throttle(const copy_state_t* s, size_t len) {
+    if (s->opts != NULL) { rl_acquire(s->opts->limit, len, 0); }
+}
 
-static int copy_file_data(int in_fd, int out_fd) {
+static int copy_write(copy_state_t* s, const uint8_t* buf, size_t len) {
+    if (s->crc != NULL) { *s->crc = crc32c(*s->crc, buf, len); }
+    copy_throttle(s, len);
+
+    size_t total_written = 0;
+    while (total_written < len) {
+        HIST_BEGIN(t_write);
+        ssize_t nw = write(s->out_fd, buf + total_written, len - total_written);
+        HIST_END(HIST_WRITE, t_write);
+
+        if (nw == ERROR && errno == EINTR) { continue; }
+        if (nw == ERROR) { return COPY_IO_FAILURE; }
+
+        total_written += (size_t)nw;
+    }
+
+    return copy_advance(s, len);
+}
+
+static int copy_file_data(int in_fd, copy_state_t* s) {
     uint8_t buf[BUF_SIZE];
 
     while (1) {
-        ssize_t nr = read(in_fd, buf, sizeof(buf));
-        
-        if (nr == ERROR && errno == EINTR) { continue; }
+        ssize_t nr = copy_read(in_fd, buf, sizeof(buf));
         if (nr == ERROR) { return COPY_IO_FAILURE; }
-        if (nr == 0) { break; }
+        if (nr == 0) { return COPY_SUCCESS; }
+
+        int status = copy_write(s, buf, (size_t)nr);
+        if (status != COPY_SUCCESS) { return status; }
+    }
+}
+
+static void* copy_pipe_reader(void* arg) {
+    copy_pipe_t* p = arg;
+    HIST_ADOPT(p->hist);
+
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (p->head - p->tail == PIPE_DEPTH && !p->stop) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+
+        if (stop) { return NULL; }
+
+        // The slot is not visible to the writer until head moves
+        size_t slot = p->head % PIPE_DEPTH;
+        ssize_t nr = copy_read(p->in_fd, p->bufs[slot], PIPE_BUF_SIZE);
+
+        pthread_mutex_lock(&p->lock);
+        p->lens[slot] = nr;
+        p->head++;
+        pthread_cond_signal(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+
+        if (nr <= 0) { return NULL; }
+    }
+}
+
+static int copy_pipe_init(copy_pipe_t* p, int in_fd) {
+    memset(p, 0, sizeof(*p));
+    p->in_fd = in_fd;
+    p->hist = HIST_SELF();
+
+    for (size_t i = 0; i < PIPE_DEPTH; i++) {
+        p->bufs[i] = malloc(PIPE_BUF_SIZE);
+        if (p->bufs[i] == NULL) {
+            for (size_t j = 0; j < i; j++) { free(p->bufs[j]); }
+            return COPY_FAILURE;
+        }
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    return COPY_SUCCESS;
+}
+
+static void copy_pipe_destroy(copy_pipe_t* p) {
+    for (size_t i = 0; i < PIPE_DEPTH; i++) { free(p->bufs[i]); }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+}
+
+// A reader thread keeps up to PIPE_DEPTH buffers filled ahead while the
+// calling worker writes, so both devices are busy at the same time.
+// Falls back to the plain loop if the thread cannot be started.
+static int copy_file_data_pipelined(int in_fd, copy_state_t* s) {
+    copy_pipe_t p;
+    if (copy_pipe_init(&p, in_fd) != COPY_SUCCESS) {
+        return copy_file_data(in_fd, s);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PIPE_READER_STACK_SIZE);
+
+    pthread_t reader;
+    int err = pthread_create(&reader, &attr, copy_pipe_reader, &p);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        copy_pipe_destroy(&p);
+        return copy_file_data(in_fd, s);
+    }
+
+    int status = COPY_SUCCESS;
+    while (1) {
+        pthread_mutex_lock(&p.lock);
+        while (p.head == p.tail) {
+            pthread_cond_wait(&p.changed, &p.lock);
+        }
+        pthread_mutex_unlock(&p.lock);
+
+        size_t slot = p.tail % PIPE_DEPTH;
+        ssize_t nr = p.lens[slot];
+
+        if (nr == ERROR) { status = COPY_IO_FAILURE; }
+        if (nr <= 0) { break; }
+
+        status = copy_write(s, p.bufs[slot], (size_t)nr);
+        if (status != COPY_SUCCESS) { break; }
+
+        pthread_mutex_lock(&p.lock);
+        p.tail++;
+        pthread_cond_signal(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_signal(&p.changed);
+    pthread_mutex_unlock(&p.lock);
+
+    pthread_join(reader, NULL);
+    copy_pipe_destroy(&p);
+    return status;
+}
+
+// Reopens a partially copied destination and positions both descriptors
+// at the resume offset. Returns the offset actually used, which is 0 if
+// the destination is shorter than expected and has to be rewritten.
+static off_t copy_resume_open(int in_fd, const char* dst, off_t offset,
+                              int* out_fd) {
+    *out_fd = open(dst, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (*out_fd == ERROR) { return ERROR; }
+
+    struct stat st;
+    if (fstat(*out_fd, &st) == ERROR || st.st_size < offset) {
+        offset = 0;
+    }
+
+    // Anything past the durable offset may be garbage after a crash
+    if (ftruncate(*out_fd, offset) == ERROR ||
+        lseek(*out_fd, offset, SEEK_SET) == ERROR ||
+        lseek(in_fd, offset, SEEK_SET) == ERROR) {
+        close(*out_fd);
+        *out_fd = ERROR;
+        return ERROR;
+    }
+
+    return offset;
+}
+
+// A source truncated while it is mapped raises SIGBUS on access past
+// its new end, and so does a destination mapping the disk cannot back.
+// The handler is installed by the first mapped copy, so programs that
+// never use the mmap engines keep theirs untouched. It only jumps back
+// into the copy loop that armed it and passes every other fault on to
+// the handler it replaced.
+static _Thread_local sigjmp_buf* copy_sigbus_jmp = NULL;
+static pthread_once_t copy_sigbus_once = PTHREAD_ONCE_INIT;
+static struct sigaction copy_sigbus_prev;
+
+static void copy_sigbus_handler(int sig, siginfo_t* info, void* ctx) {
+    if (copy_sigbus_jmp != NULL) { siglongjmp(*copy_sigbus_jmp, 1); }
+
+    if (copy_sigbus_prev.sa_flags & SA_SIGINFO) {
+        copy_sigbus_prev.sa_sigaction(sig, info, ctx);
+    } else if (copy_sigbus_prev.sa_handler != SIG_DFL &&
+               copy_sigbus_prev.sa_handler != SIG_IGN) {
+        copy_sigbus_prev.sa_handler(sig);
+    } else {
+        // A fault outside a copy is a real bug: die from it as usual
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+static void copy_sigbus_install(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = copy_sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &copy_sigbus_prev);
+}
+
+static uint8_t* copy_map(int fd, off_t start, size_t len, int prot, int flags) {
+    int map_flags = MAP_SHARED;
+    if (flags & COPY_MMAP_POPULATE) { map_flags |= MAP_POPULATE; }
+
+    void* map = mmap(NULL, len, prot, map_flags, fd, start);
+    if (map == MAP_FAILED) { return NULL; }
+
+    madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (flags & COPY_MMAP_HUGEPAGE) { madvise(map, len, MADV_HUGEPAGE); }
+#endif
+    return map;
+}
+
+// Copies src[pos, len) to the destination, turning SIGBUS into an
+// I/O error. Kept apart so that nothing live across sigsetjmp changes.
+static int copy_mapped(copy_state_t* s, const uint8_t* src, uint8_t* dst,
+                       size_t skip, size_t len) {
+    int status = COPY_SUCCESS;
+    sigjmp_buf jmp;
+
+    if (sigsetjmp(jmp, 1) == 0) {
+        copy_sigbus_jmp = &jmp;
+
+        for (size_t pos = skip; pos < len && status == COPY_SUCCESS; ) {
+            size_t n = (len - pos < MAP_CHUNK_SIZE) ? len - pos : MAP_CHUNK_SIZE;
+
+            if (dst == NULL) {
+                // A fault inside write() comes back as EFAULT, not SIGBUS
+                status = copy_write(s, src + pos, n);
+            } else {
+                if (s->crc != NULL) { *s->crc = crc32c(*s->crc, src + pos, n); }
+                copy_throttle(s, n);
+                memcpy(dst + pos, src + pos, n);
+                status = copy_advance(s, n);
+            }
+            pos += n;
+        }
+    } else {
+        status = COPY_IO_FAILURE;
+    }
+
+    copy_sigbus_jmp = NULL;
+    return status;
+}
+
+// Copies [s->offset, size) of the source from a mapping, either with
+// write() or into a mapping of the destination. Returns COPY_FAILURE
+// without touching anything if the files cannot be mapped.
+static int copy_file_data_mmap(int in_fd, copy_state_t* s, off_t size,
+                               int engine, int flags) {
+    pthread_once(&copy_sigbus_once, copy_sigbus_install);
+
+    // Mappings start on a page boundary
+    off_t page = (off_t)sysconf(_SC_PAGESIZE);
+    off_t start = s->offset / page * page;
+    size_t len = (size_t)(size - start);
+    size_t skip = (size_t)(s->offset - start);
+
+    uint8_t* src = copy_map(in_fd, start, len, PROT_READ, flags);
+    if (src == NULL) { return COPY_FAILURE; }
+
+    uint8_t* dst = NULL;
+    if (engine == COPY_ENGINE_MMAP_DST) {
+        // Blocks are reserved up front, so running out of space shows up
+        // here and not as SIGBUS halfway through
+        if (ftruncate(s->out_fd, size) == ERROR ||
+            (fallocate(s->out_fd, 0, s->offset, size - s->offset) == ERROR &&
+             errno != EOPNOTSUPP)) {
+            munmap(src, len);
+            return COPY_IO_FAILURE;
+        }
+
+        dst = copy_map(s->out_fd, start, len, PROT_READ | PROT_WRITE, 0);
+        if (dst == NULL) {
+            munmap(src, len);
+            return COPY_FAILURE;
+        }
+    }
+
+    int status = copy_mapped(s, src, dst, skip, len);
+
+    // The descriptors did not move along with the mappings
+    if (dst != NULL) { munmap(dst, len); }
+    munmap(src, len);
+
+    if (status == COPY_SUCCESS &&
+        (lseek(in_fd, s->offset, SEEK_SET) == ERROR ||
+         lseek(s->out_fd, s->offset, SEEK_SET) == ERROR)) {
+        status = COPY_IO_FAILURE;
+    }
+    return status;
+}
+
+// Lets the kernel move the data, which may share extents or offload the
+// copy to the storage. Returns COPY_FAILURE before copying anything if
+// the filesystems do not support it.
+static int copy_file_data_cfr(int in_fd, copy_state_t* s) {
+    int first = 1;
 
-        ssize_t total_written = 0;
-        while (total_written < nr) {
-            ssize_t nw = write(out_fd, buf + total_written,
-                               (size_t)(nr - total_written));
+    while (1) {
+        ssize_t n = copy_file_range(in_fd, NULL, s->out_fd, NULL, CFR_CHUNK_SIZE, 0);
+
+        if (n == ERROR && errno == EINTR) { continue; }
+        if (n == ERROR) {
+            int unsupported = errno == EXDEV || errno == ENOSYS ||
+                              errno == EOPNOTSUPP || errno == EINVAL;
+            return (first && unsupported) ? COPY_FAILURE : COPY_IO_FAILURE;
+        }
+        if (n == 0) { return COPY_SUCCESS; }
+
+        first = 0;
+        copy_throttle(s, (size_t)n);
+        int status = copy_advance(s, (size_t)n);
+        if (status != COPY_SUCCESS) { return status; }
+    }
+}
+
+// Whether FICLONE works from one filesystem to another is found out by
+// the first file copied between them and then remembered, so trees on
+// filesystems without reflink pay for one failed ioctl and not one per
+// file
+enum { CLONE_UNKNOWN, CLONE_WORKS, CLONE_UNSUPPORTED };
+
+typedef struct {
+    dev_t src_dev;
+    dev_t dst_dev;
+    int state;
+} copy_clone_dev_t;
+
+static copy_clone_dev_t copy_clone_devs[CLONE_CACHE_SIZE];
+static size_t copy_clone_dev_num = 0;
+static pthread_mutex_t copy_clone_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int copy_clone_state(dev_t src_dev, dev_t dst_dev) {
+    int state = CLONE_UNKNOWN;
+
+    pthread_mutex_lock(&copy_clone_lock);
+    for (size_t i = 0; i < copy_clone_dev_num; i++) {
+        if (copy_clone_devs[i].src_dev == src_dev && copy_clone_devs[i].dst_dev == dst_dev) {
+            state = copy_clone_devs[i].state;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&copy_clone_lock);
+
+    return state;
+}
+
+// Once full, further pairs are simply tried for every file
+static void copy_clone_learn(dev_t src_dev, dev_t dst_dev, int state) {
+    pthread_mutex_lock(&copy_clone_lock);
 
-            if (nw == ERROR && errno == EINTR) { continue; }
-            if (nw == ERROR) { return COPY_IO_FAILURE; }
+    size_t i = 0;
+    while (i < copy_clone_dev_num &&
+           (copy_clone_devs[i].src_dev != src_dev || copy_clone_devs[i].dst_dev != dst_dev)) {
+        i++;
+    }
+    if (i == copy_clone_dev_num && i < CLONE_CACHE_SIZE) {
+        copy_clone_devs[i].src_dev = src_dev;
+        copy_clone_devs[i].dst_dev = dst_dev;
+        copy_clone_dev_num++;
+    }
+    // A pair that cloned once keeps its state: a later EINVAL is about
+    // that one file
+    if (i < copy_clone_dev_num && copy_clone_devs[i].state != CLONE_WORKS) {
+        copy_clone_devs[i].state = state;
+    }
+
+    pthread_mutex_unlock(&copy_clone_lock);
+}
+
+static int copy_clone_unsupported(int err) {
+    return err == EXDEV || err == EOPNOTSUPP || err == EINVAL ||
+           err == ENOTTY || err == ENOSYS;
+}
+
+// Shares the extents of the source with the destination on filesystems
+// with reflinks (btrfs, xfs, bcachefs), so no data is read or written.
+// Small files take one FICLONE, large ones and resumed copies go through
+// FICLONERANGE in chunks so the journal still sees progress. Returns
+// COPY_FAILURE with both descriptors at s->offset if the rest has to be
+// copied the usual way.
+static int copy_file_data_clone(int in_fd, copy_state_t* s, off_t size) {
+    struct stat out_st;
+    if (s->opts->st == NULL || fstat(s->out_fd, &out_st) == ERROR) { return COPY_FAILURE; }
 
-            total_written += nw;
+    dev_t src_dev = s->opts->st->st_dev;
+    dev_t dst_dev = out_st.st_dev;
+    if (copy_clone_state(src_dev, dst_dev) == CLONE_UNSUPPORTED) { return COPY_FAILURE; }
+
+    off_t start = s->offset;
+    int err = 0;
+
+    if (s->offset == 0 && size < CLONE_CHUNK_SIZE) {
+        HIST_BEGIN(t_clone);
+        if (ioctl(s->out_fd, FICLONE, in_fd) == ERROR) { err = errno; }
+        HIST_END(HIST_CLONE, t_clone);
+    } else {
+        while (1) {
+            // The last range runs to the end of the file, whatever its
+            // size is by now
+            struct file_clone_range range = { 0 };
+            range.src_fd = in_fd;
+            range.src_offset = (uint64_t)s->offset;
+            range.dest_offset = (uint64_t)s->offset;
+            int last = size - s->offset <= CLONE_CHUNK_SIZE;
+            if (!last) { range.src_length = CLONE_CHUNK_SIZE; }
+
+            HIST_BEGIN(t_clone);
+            int res = ioctl(s->out_fd, FICLONERANGE, &range);
+            HIST_END(HIST_CLONE, t_clone);
+            if (res == ERROR) {
+                err = errno;
+                break;
+            }
+            if (last) { break; }
+
+            int status = copy_advance(s, CLONE_CHUNK_SIZE);
+            if (status != COPY_SUCCESS) { return status; }
         }
     }
 
+    if (err != 0) {
+        // An unaligned resume offset is no verdict on the filesystems
+        if (start == 0 && copy_clone_unsupported(err)) {
+            copy_clone_learn(src_dev, dst_dev, CLONE_UNSUPPORTED);
+        }
+        if (!copy_clone_unsupported(err)) { return COPY_IO_FAILURE; }
+
+        // Ranges cloned so far are kept
+        if (lseek(in_fd, s->offset, SEEK_SET) == ERROR ||
+            lseek(s->out_fd, s->offset, SEEK_SET) == ERROR) {
+            return COPY_IO_FAILURE;
+        }
+        return COPY_FAILURE;
+    }
+
+    copy_clone_learn(src_dev, dst_dev, CLONE_WORKS);
+
+    off_t end = lseek(s->out_fd, 0, SEEK_END);
+    if (end == ERROR || lseek(in_fd, end, SEEK_SET) == ERROR) { return COPY_IO_FAILURE; }
+    return copy_advance(s, (size_t)(end - s->offset));
+}
+
+static const copy_engine_rule_t* copy_pick_engine(const copy_opts_t* opts, off_t len) {
+    const copy_engine_rule_t* res = NULL;
+
+    for (size_t i = 0; opts != NULL && i < opts->engine_num; i++) {
+        if (len >= opts->engines[i].min_size) { res = &opts->engines[i]; }
+    }
+    return res;
+}
+
+static int copy_run_engine(int in_fd, copy_state_t* s, off_t size) {
+    const copy_opts_t* opts = s->opts;
+
+    if (opts != NULL && opts->reflink && s->crc == NULL && size > s->offset) {
+        int status = copy_file_data_clone(in_fd, s, size);
+        if (status != COPY_FAILURE) { return status; }
+    }
+
+    const copy_engine_rule_t* rule = copy_pick_engine(opts, size - s->offset);
+    int engine = (rule != NULL) ? rule->engine : COPY_ENGINE_RW;
+
+    // Only the first attempt of an engine may report COPY_FAILURE, in
+    // which case nothing was copied and read/write takes over
+    int status = COPY_FAILURE;
+    if ((engine == COPY_ENGINE_MMAP || engine == COPY_ENGINE_MMAP_DST) &&
+        size > s->offset) {
+        status = copy_file_data_mmap(in_fd, s, size, engine, rule->flags);
+        if (status == COPY_SUCCESS) {
+            // Picks up anything appended since the stat
+            status = copy_file_data(in_fd, s);
+        }
+    } else if (engine == COPY_ENGINE_CFR && s->crc == NULL) {
+        status = copy_file_data_cfr(in_fd, s);
+    }
+    if (status != COPY_FAILURE) { return status; }
+
+    if (opts != NULL && opts->pipeline_min > 0 && size - s->offset >= opts->pipeline_min) {
+        return copy_file_data_pipelined(in_fd, s);
+    }
+    return copy_file_data(in_fd, s);
+}
+
+// Adds everything `fd` returns from its current position on to `crc`
+static int copy_checksum_fd(int fd, uint8_t* buf, size_t size, uint32_t* crc) {
+    while (1) {
+        ssize_t nr = read(fd, buf, size);
+
+        if (nr == ERROR && errno == EINTR) { continue; }
+        if (nr == ERROR) { return COPY_IO_FAILURE; }
+        if (nr == 0) { return COPY_SUCCESS; }
+
+        *crc = crc32c(*crc, buf, (size_t)nr);
+    }
+}
+
+// The part kept from an earlier run was never in the copy buffer, so
+// on resume it is hashed from the source
+static int copy_checksum_prefix(int in_fd, off_t offset, uint32_t* crc) {
+    uint8_t buf[BUF_SIZE];
+    off_t pos = 0;
+
+    while (pos < offset) {
+        size_t len = (offset - pos < BUF_SIZE) ? (size_t)(offset - pos) : BUF_SIZE;
+        ssize_t nr = pread(in_fd, buf, len, pos);
+
+        if (nr == ERROR && errno == EINTR) { continue; }
+        if (nr <= 0) { return COPY_IO_FAILURE; }
+
+        *crc = crc32c(*crc, buf, (size_t)nr);
+        pos += nr;
+    }
     return COPY_SUCCESS;
 }
 
-int copy_file(const char *src, const char *dst, int mode) {
+// Reads the destination back from storage rather than from the page
+// cache: with O_DIRECT where supported, otherwise by writing it out and
+// dropping its clean pages first
+static int copy_verify(const char* dst, int out_fd, off_t size, uint32_t expected) {
+    size_t buf_size = VERIFY_BUF_SIZE;
+    if (size < VERIFY_BUF_SIZE) {
+        buf_size = ((size_t)size + VERIFY_ALIGN - 1) / VERIFY_ALIGN * VERIFY_ALIGN;
+        if (buf_size == 0) { buf_size = VERIFY_ALIGN; }
+    }
+
+    uint8_t* buf = aligned_alloc(VERIFY_ALIGN, buf_size);
+    if (buf == NULL) { return COPY_FAILURE; }
+
+    uint32_t crc = 0;
+    int fd = open(dst, O_RDONLY | O_DIRECT);
+    int status = (fd != ERROR) ? copy_checksum_fd(fd, buf, buf_size, &crc)
+                               : COPY_OPEN_FAILURE;
+
+    // Some filesystems accept O_DIRECT on open and refuse it on read
+    if (status != COPY_SUCCESS) {
+        if (fd != ERROR) { close(fd); }
+
+        crc = 0;
+        status = COPY_IO_FAILURE;
+        fd = open(dst, O_RDONLY);
+
+        if (fd != ERROR && fdatasync(out_fd) != ERROR) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            status = copy_checksum_fd(fd, buf, buf_size, &crc);
+        }
+    }
+
+    if (fd != ERROR) { close(fd); }
+    free(buf);
+
+    if (status != COPY_SUCCESS) { return status; }
+    return (crc == expected) ? COPY_SUCCESS : COPY_VERIFY_FAILURE;
+}
+
+int copy_file(const char *src, const char *dst, int mode,
+              const copy_opts_t* opts) {
     int status = COPY_SUCCESS;
     int in_fd = -1, out_fd = -1;
+    off_t offset = 0;
 
+    if (opts != NULL) { rl_acquire(opts->limit, 0, 1); }
+
+    HIST_BEGIN(t_open);
     in_fd = open(src, O_RDONLY);
+    HIST_END(HIST_OPEN, t_open);
     if (in_fd == ERROR) { return COPY_OPEN_FAILURE; }
 
-    unlink(dst);
+    if (opts != NULL && opts->offset > 0) {
+        offset = copy_resume_open(in_fd, dst, opts->offset, &out_fd);
+    } else {
+        HIST_BEGIN(t_unlink);
+        unlink(dst);
+        HIST_END(HIST_UNLINK, t_unlink);
+
+        // Readable for the mmap-dst engine and --verify
+        HIST_BEGIN(t_create);
+        out_fd = open(dst, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        HIST_END(HIST_OPEN, t_create);
+    }
 
-    out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (out_fd == ERROR) {
         close(in_fd);
         return COPY_OPEN_FAILURE;
     }
 
-    status = copy_file_data(in_fd, out_fd);
+    uint32_t crc = 0;
+    uint32_t* crc_ptr = NULL;
+    if (opts != NULL && opts->verify) {
+        crc_ptr = &crc;
+        status = copy_checksum_prefix(in_fd, offset, crc_ptr);
+        if (status != COPY_SUCCESS) { goto exit; }
+    }
+
+    copy_state_t state;
+    copy_state_init(&state, out_fd, offset, opts, crc_ptr);
+
+    off_t size = (opts != NULL && opts->st != NULL) ? opts->st->st_size : 0;
+    status = copy_run_engine(in_fd, &state, size);
     if (status != COPY_SUCCESS) { goto exit; }
 
+    // Before metadata, which may take away the read permission
+    if (crc_ptr != NULL) {
+        status = copy_verify(dst, out_fd, state.offset, crc);
+        if (status != COPY_SUCCESS) { goto exit; }
+    }
+
+    if (opts != NULL && opts->st != NULL) {
+        int err = meta_apply_fd(in_fd, out_fd, opts->st, opts->preserve);
+        if (err == META_MODE_FAILURE) {
+            status = COPY_MODE_CHANGE_FAILURE;
+        } else if (err != META_SUCCESS) {
+            status = COPY_METADATA_FAILURE;
+        }
+        goto exit;
+    }
+
+    HIST_BEGIN(t_chmod);
     int err = fchmod(out_fd, mode);
+    HIST_END(HIST_CHMOD, t_chmod);
     if (err == ERROR) {
         status = COPY_MODE_CHANGE_FAILURE;
         goto exit;
     }
 
-exit:
+exit:;
+    HIST_BEGIN(t_close);
     close(in_fd);
     close(out_fd);
+    HIST_END(HIST_CLOSE, t_close);
     return status;
 }
 
@@ -75,12 +762,16 @@ int mkdir_with_mode(const char* dir, int mode) {
 
     if (!S_ISDIR(mode)) { return COPY_INVALID_ARGUMENT; }
 
+    HIST_BEGIN(t_mkdir);
     status = mkdir(dir, S_IRWXU);
+    HIST_END(HIST_MKDIR, t_mkdir);
     if (status == ERROR && errno != EEXIST) {
         return COPY_FAILURE;
     }
     
+    HIST_BEGIN(t_chmod);
     status = chmod(dir, mode); 
+    HIST_END(HIST_CHMOD, t_chmod);
     if (status == ERROR) {
         return COPY_MODE_CHANGE_FAILURE;
     }
@@ -88,3 +779,115 @@ int mkdir_with_mode(const char* dir, int mode) {
     return COPY_SUCCESS;
 }
 
+
+typedef struct {
+    const char* name;
+    int value;
+} copy_name_t;
+
+static const copy_name_t copy_engine_names[] = {
+    { "rw",       COPY_ENGINE_RW       },
+    { "mmap",     COPY_ENGINE_MMAP     },
+    { "mmap-dst", COPY_ENGINE_MMAP_DST },
+    { "cfr",      COPY_ENGINE_CFR      },
+};
+
+static const copy_name_t copy_mmap_flag_names[] = {
+    { "populate", COPY_MMAP_POPULATE },
+    { "hugepage", COPY_MMAP_HUGEPAGE },
+};
+
+static int copy_lookup(const copy_name_t* names, size_t num,
+                       const char* str, size_t len, int* value) {
+    for (size_t i = 0; i < num; i++) {
+        if (strlen(names[i].name) == len && strncmp(names[i].name, str, len) == 0) {
+            *value = names[i].value;
+            return COPY_SUCCESS;
+        }
+    }
+    return COPY_INVALID_ARGUMENT;
+}
+
+static int copy_parse_size(const char* str, size_t len, off_t* res) {
+    char* end;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (end == str) { return COPY_INVALID_ARGUMENT; }
+
+    size_t digits = (size_t)(end - str);
+    if (digits + 1 == len) {
+        switch (*end) {
+        case 'K': case 'k': v <<= 10; break;
+        case 'M': case 'm': v <<= 20; break;
+        case 'G': case 'g': v <<= 30; break;
+        default: return COPY_INVALID_ARGUMENT;
+        }
+    } else if (digits != len) {
+        return COPY_INVALID_ARGUMENT;
+    }
+
+    *res = (off_t)v;
+    return COPY_SUCCESS;
+}
+
+// One rule: ENGINE[+MOD...][@SIZE]
+static int copy_parse_rule(const char* str, size_t len, copy_engine_rule_t* rule) {
+    const char* at = memchr(str, '@', len);
+    size_t name_len = (at != NULL) ? (size_t)(at - str) : len;
+
+    rule->min_size = 0;
+    rule->flags = 0;
+    if (at != NULL &&
+        copy_parse_size(at + 1, len - name_len - 1, &rule->min_size) != COPY_SUCCESS) {
+        return COPY_INVALID_ARGUMENT;
+    }
+
+    size_t engine_len = strcspn(str, "+@");
+    if (engine_len > name_len) { engine_len = name_len; }
+    if (copy_lookup(copy_engine_names, sizeof(copy_engine_names) / sizeof(copy_engine_names[0]),
+                    str, engine_len, &rule->engine) != COPY_SUCCESS) {
+        return COPY_INVALID_ARGUMENT;
+    }
+
+    for (size_t pos = engine_len; pos < name_len; ) {
+        pos++;  // '+'
+        size_t mod_len = strcspn(str + pos, "+@,");
+        if (pos + mod_len > name_len) { mod_len = name_len - pos; }
+
+        int flag;
+        if (copy_lookup(copy_mmap_flag_names,
+                        sizeof(copy_mmap_flag_names) / sizeof(copy_mmap_flag_names[0]),
+                        str + pos, mod_len, &flag) != COPY_SUCCESS) {
+            return COPY_INVALID_ARGUMENT;
+        }
+        rule->flags |= flag;
+        pos += mod_len;
+    }
+
+    return COPY_SUCCESS;
+}
+
+int copy_parse_engines(const char* spec, copy_engine_rule_t* rules, size_t* num) {
+    if (spec == NULL || rules == NULL || num == NULL) { return COPY_INVALID_ARGUMENT; }
+
+    size_t n = 0;
+    for (const char* p = spec; *p != '\0'; ) {
+        size_t len = strcspn(p, ",");
+        if (len == 0 || n == COPY_ENGINE_RULES_MAX) { return COPY_INVALID_ARGUMENT; }
+
+        copy_engine_rule_t rule;
+        if (copy_parse_rule(p, len, &rule) != COPY_SUCCESS) { return COPY_INVALID_ARGUMENT; }
+
+        // Insertion sort by size
+        size_t i = n++;
+        for (; i > 0 && rules[i - 1].min_size > rule.min_size; i--) {
+            rules[i] = rules[i - 1];
+        }
+        rules[i] = rule;
+
+        p += len;
+        if (*p == ',') { p++; }
+    }
+
+    *num = n;
+    return COPY_SUCCESS;
+}
@@ -1,6 +1,12 @@
 #ifndef COPY_H
 #define COPY_H
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cancel.h"
+#include "ratelimit.h"
+
 enum {
     COPY_SUCCESS = 0,
     COPY_FAILURE = -1,
@@ -8,10 +14,102 @@ enum {
     COPY_OPEN_FAILURE = -3,
     COPY_IO_FAILURE = -4,
     COPY_INVALID_ARGUMENT = -6,
-    COPY_NOT_FOUND = -7
+    COPY_NOT_FOUND = -7,
+    COPY_METADATA_FAILURE = -8,
+    COPY_VERIFY_FAILURE = -9,
+    COPY_CANCELED = -10
+};
+
+// Ways of moving the data of one file
+enum {
+    COPY_ENGINE_RW,         // read/write through a buffer (the default)
+    COPY_ENGINE_MMAP,       // write() straight from a mapping of the source
+    COPY_ENGINE_MMAP_DST,   // memcpy between mappings of source and destination
+    COPY_ENGINE_CFR,        // copy_file_range, in the kernel
+
+    COPY_ENGINE_NUM
 };
 
-int copy_file(const char* src, const char* dst, int mode);
+// Modifiers of the mmap engines
+enum {
+    COPY_MMAP_POPULATE = 1 << 0,    // prefault the source with MAP_POPULATE
+    COPY_MMAP_HUGEPAGE = 1 << 1     // ask for transparent huge pages
+};
+
+// Files with at least `min_size` bytes to copy use `engine`, unless a
+// rule with a larger `min_size` also applies
+typedef struct {
+    off_t min_size;
+    int engine;
+    int flags;
+} copy_engine_rule_t;
+
+#define COPY_ENGINE_RULES_MAX 8
+
+typedef struct {
+    // Continue a partial copy: the first `offset` bytes of dst are
+    // kept and copying starts from this offset. 0 copies from scratch.
+    off_t offset;
+
+    // If set, called every `checkpoint_size` bytes after the data
+    // written so far has been flushed with fdatasync
+    off_t checkpoint_size;
+    void (*checkpoint)(void* arg, off_t offset);
+    void* arg;
+
+    // If set, metadata selected by `preserve` (META_* flags) is copied
+    // from this source stat instead of only applying `mode`
+    const struct stat* st;
+    int preserve;
+
+    // If set, a CRC-32C of the data is taken from the copy buffer, then
+    // the destination is read back, bypassing the page cache where the
+    // filesystem allows it, and compared. Fails with COPY_VERIFY_FAILURE
+    // on a mismatch.
+    int verify;
+
+    // Files with at least this many bytes left to copy are read by a
+    // separate thread into a ring of buffers while the caller writes.
+    // Needs `st` for the size; 0 never pipelines.
+    off_t pipeline_min;
+
+    // Engine per size class, sorted by min_size; none means read/write.
+    // Engines that cannot take the file (copy_file_range across
+    // filesystems, mmap of a special file) fall back to read/write, and
+    // so does copy_file_range with `verify`.
+    const copy_engine_rule_t* engines;
+    size_t engine_num;
+
+    // Try to share the source's extents with FICLONE/FICLONERANGE before
+    // any engine. Needs `st`; skipped with `verify`, which wants the
+    // data to pass through the copy.
+    int reflink;
+
+    // Shared limiter charged with every byte written and one operation
+    // per file; NULL for none
+    rl_t* limit;
+
+    // Checked after every chunk; once requested the copy stops with
+    // COPY_CANCELED, leaving a partial destination for the caller to
+    // keep or remove. NULL for none.
+    const cancel_t* cancel;
+} copy_opts_t;
+
+// `opts` may be NULL for a plain copy
+int copy_file(const char* src, const char* dst, int mode,
+              const copy_opts_t* opts);
 int mkdir_with_mode(const char* dir, int mode);
 
+// Parses "ENGINE[+MOD...][@SIZE],..." like "rw,mmap+populate@64M,cfr@1G"
+// into at most COPY_ENGINE_RULES_MAX rules sorted by size. Engines are
+// rw, mmap, mmap-dst and cfr; modifiers populate and hugepage; sizes
+// take a K, M or G suffix.
+int copy_parse_engines(const char* spec, copy_engine_rule_t* rules, size_t* num);
+
+// Size of the copy buffer, which lives on the stack of copy_file and is
+// by far the largest frame a worker has
+#ifndef BUF_SIZE
+#define BUF_SIZE 8192
+#endif
+
 #endif
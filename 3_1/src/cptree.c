@@ -0,0 +1,1417 @@
+#define _GNU_SOURCE
+
+#include "cptree.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "hist.h"
+#include "journal.h"
+#include "log.h"
+#include "meta.h"
+#include "trace.h"
+
+#define SUCCESS 0
+
+// Workers need little stack: the deepest frame is copy_file with its
+// BUF_SIZE buffer, the rest covers libc, logging and metadata calls.
+// With the 8 MiB default, hundreds of workers would reserve gigabytes.
+#define WORKER_STACK_SIZE (BUF_SIZE + 120 * 1024)
+
+// Large files are checkpointed into the journal every this many bytes
+#define JOURNAL_CHUNK_SIZE (64 * 1024 * 1024)
+
+// Destination filesystems a CPTREE_DURABLE_SYNCFS job remembers having
+// synced
+#define CPTREE_SYNCFS_DEVS 16
+
+struct cptree {
+    tp_t* pool;
+    tp_t* flusher;      // NULL without flush threads
+    size_t thread_num;
+    rl_t* limit;
+
+    // Parent of every job's token
+    cancel_t cancel;
+};
+
+struct cptree_job {
+    cptree_t* engine;
+    cptree_job_conf_t conf;
+    copy_engine_rule_t engines[COPY_ENGINE_RULES_MAX];
+    char* src_root;
+    char* dst_root;
+
+    journal_t* journal;
+
+    // Set for list jobs writing a tree, where directories are created
+    // on demand instead of being walked
+    dircache_t* dircache;
+
+    // Where the path relative to the roots starts in task->src_path
+    size_t rel_offset;
+
+    stats_t* stats;
+    atomic_int journal_failed;
+    cancel_t cancel;
+
+    // Queued and running tasks, plus one held until cptree_job_wait
+    atomic_size_t pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+
+    // CPTREE_DURABLE_SYNCFS: destination directories in the order they
+    // were completed, which is children before parents. Under `lock`.
+    char** sync_dirs;
+    size_t sync_dir_num;
+    size_t sync_dir_cap;
+};
+
+// A directory whose metadata is applied only once everything below it
+// is done, so a read-only mode or restored mtime is not disturbed by
+// its children being written. Each pending child holds a reference,
+// and so does the walk of the directory itself.
+typedef struct dir_state {
+    struct dir_state* parent;
+    atomic_size_t refs;
+
+    struct stat st;
+    char* src_path;
+    char* dst_path;
+
+    // Removed once empty instead of getting metadata
+    int remove;
+} dir_state_t;
+
+typedef struct {
+    struct stat st;
+    char* src_path;
+    char* dst_path;
+
+    cptree_job_t* job;
+    dir_state_t* parent;
+
+    // --delete: dst_path is to be removed. src_path is NULL and only
+    // the type in st_mode and st_dev are set.
+    int remove;
+
+    // How much of a partial copy the journal knows to be durable
+    off_t durable;
+} task_t;
+
+// A CPTREE_DURABLE_ASYNC flush, run on the flusher pool
+typedef struct {
+    cptree_job_t* job;
+    char* path;         // destination file or directory
+    char* src_path;     // journaled as done once flushed; NULL for none
+    struct stat st;
+} flush_t;
+
+// Names of one source directory, for --delete. Open addressing over
+// copies of the names, grown at half full.
+typedef struct {
+    char** slots;
+    size_t cap;
+    size_t num;
+} name_set_t;
+
+
+static char* task_path_join(const char* a, const char* b) {
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+
+    int need_sep = (la == 0) ? 0 : (a[la-1] != '/');
+
+    size_t total = la + need_sep + lb + 1;
+    char* res = malloc(total);
+    if (res == NULL) { return NULL; }
+
+    strcpy(res, a);
+    if (need_sep) { strcat(res, "/"); }
+    strcat(res, b);
+
+    return res;
+}
+
+static inline void task_destroy(task_t* task) {
+    free(task->src_path);
+    free(task->dst_path);
+    free(task);
+}
+
+static void job_notify(cptree_job_t* job, int type, const char* src,
+                       const char* dst, const struct stat* st, int status) {
+    if (job->conf.callback == NULL) { return; }
+
+    cptree_event_t event = { type, src, dst, st, status };
+    job->conf.callback(&event, job->conf.arg);
+}
+
+static inline void job_error(cptree_job_t* job, const char* src, const char* dst,
+                             const struct stat* st, int status) {
+    stats_add(job->stats, STAT_ERRORS, 1);
+    job_notify(job, CPTREE_EVENT_ERROR, src, dst, st, status);
+}
+
+static inline void job_skip(cptree_job_t* job, const task_t* task) {
+    stats_add(job->stats, STAT_SKIPPED, 1);
+    job_notify(job, CPTREE_EVENT_SKIP, task->src_path, task->dst_path, &task->st, -1);
+}
+
+// Reports its own errors
+static task_t* task_init(cptree_job_t* job, const char* src, const char* dst,
+                         const char* filename) {
+    task_t* task = malloc(sizeof(*task));
+    if (task == NULL) {
+        LOG_ERROR("task allocation failed for '%s/%s'", src, filename);
+        job_error(job, src, dst, NULL, -1);
+        return NULL;
+    }
+
+    task->src_path = NULL;
+    task->dst_path = NULL;
+    task->job = job;
+    task->parent = NULL;
+    task->remove = 0;
+    task->durable = 0;
+
+    if (filename != NULL) {
+        task->src_path = task_path_join(src, filename);
+        task->dst_path = task_path_join(dst, filename);
+    } else {
+        task->src_path = strdup(src);
+        task->dst_path = strdup(dst);
+    }
+
+    if (task->src_path == NULL || task->dst_path == NULL) {
+        LOG_ERROR("task allocation failed for '%s/%s'", src, filename);
+        job_error(job, src, dst, NULL, -1);
+        task_destroy(task);
+        return NULL;
+    }
+
+    rl_acquire(job->engine->limit, 0, 1);
+
+    HIST_BEGIN(t_lstat);
+    int err = lstat(task->src_path, &task->st);
+    HIST_END(HIST_LSTAT, t_lstat);
+
+    if (err != 0) {
+        LOG_ERROR("lstat failed for '%s'", task->src_path);
+        job_error(job, task->src_path, task->dst_path, NULL, -1);
+        task_destroy(task);
+        return NULL;
+    }
+
+    if (S_ISREG(task->st.st_mode)) {
+        stats_add(job->stats, STAT_FILES_FOUND, 1);
+        stats_add(job->stats, STAT_BYTES_FOUND, (uint64_t)task->st.st_size);
+    }
+
+    return task;
+}
+
+static void job_removed(cptree_job_t* job, const char* path, const struct stat* st) {
+    stats_add(job->stats, STAT_DELETED, 1);
+    job_notify(job, CPTREE_EVENT_DELETE, NULL, path, st, -1);
+}
+
+// Removal tasks only carry what readdir or a cheap fstatat tells
+static task_t* remove_task_init(cptree_job_t* job, const char* dir, const char* name,
+                                mode_t mode, dev_t dev) {
+    task_t* task = calloc(1, sizeof(*task));
+    if (task != NULL) { task->dst_path = task_path_join(dir, name); }
+
+    if (task == NULL || task->dst_path == NULL) {
+        LOG_ERROR("task allocation failed for '%s/%s'", dir, name);
+        job_error(job, NULL, dir, NULL, -1);
+        free(task);
+        return NULL;
+    }
+
+    task->st.st_mode = mode;
+    task->st.st_dev = dev;
+    task->job = job;
+    task->remove = 1;
+    return task;
+}
+
+// What readdir says the entry is, or what fstatat does if it does not
+// know. 0 if neither does.
+static mode_t entry_mode(DIR* dir, const struct dirent* entry) {
+    if (entry->d_type != DT_UNKNOWN) { return DTTOIF(entry->d_type); }
+
+    struct stat st;
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) { return 0; }
+    return st.st_mode;
+}
+
+static void job_journal_error(cptree_job_t* job, int status) {
+    if (atomic_exchange(&job->journal_failed, 1) == 0) {
+        LOG_ERROR("failed to write journal: %d, "
+                  "progress of this run may not be resumable", status);
+    }
+}
+
+static void task_checkpoint(void* arg, off_t offset) {
+    task_t* task = arg;
+
+    int status = journal_file_chunk(task->job->journal, task->src_path,
+                                    &task->st, offset);
+    if (status != JOURNAL_SUCCESS) {
+        job_journal_error(task->job, status);
+    } else {
+        task->durable = offset;
+    }
+}
+
+// Queued per source device, so each disk gets its share of workers
+static int job_add(cptree_job_t* job, task_t* task) {
+    atomic_fetch_add(&job->pending, 1);
+
+    int status = tp_add_keyed(job->engine->pool, task, (uint64_t)task->st.st_dev);
+    if (status != TP_SUCCESS) { atomic_fetch_sub(&job->pending, 1); }
+    return status;
+}
+
+// The last task to finish wakes up cptree_job_wait, which may free the
+// job as soon as the lock is released. It drops `pending` to zero only
+// under the lock, which the waiter reads it under, so the job cannot go
+// away between the decrement and the broadcast. The count only goes up
+// while someone else holds a share, so reading 1 means ours is last.
+static void job_task_done(cptree_job_t* job) {
+    size_t n = atomic_load(&job->pending);
+    while (n > 1) {
+        if (atomic_compare_exchange_weak(&job->pending, &n, n - 1)) { return; }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    atomic_fetch_sub(&job->pending, 1);
+    pthread_cond_broadcast(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Reopened by path rather than handed over from the copy, so every
+// descriptor lives on one thread. Write-only files are reopened as such.
+static int flush_path(const char* path, int is_dir) {
+    int fd = open(path, (is_dir ? O_DIRECTORY : 0) | O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == EACCES && !is_dir) { fd = open(path, O_WRONLY | O_CLOEXEC); }
+    if (fd == -1) { return -1; }
+
+    HIST_BEGIN(t_sync);
+    int err = is_dir ? fsync(fd) : fdatasync(fd);
+    HIST_END(HIST_FDATASYNC, t_sync);
+
+    close(fd);
+    return err;
+}
+
+static void flush_run(cptree_job_t* job, const char* path, const char* src_path,
+                      const struct stat* st) {
+    if (flush_path(path, S_ISDIR(st->st_mode)) != 0) {
+        LOG_ERROR("failed to flush '%s'", path);
+        job_error(job, src_path, path, st, -1);
+    } else if (src_path != NULL) {
+        int status = journal_file_done(job->journal, src_path, st);
+        if (status != JOURNAL_SUCCESS) { job_journal_error(job, status); }
+    }
+}
+
+static void flush_handler(void* arg) {
+    flush_t* f = arg;
+    cptree_job_t* job = f->job;
+
+    if (!cancel_requested(&job->cancel)) {
+        flush_run(job, f->path, f->src_path, &f->st);
+    }
+
+    free(f->path);
+    free(f->src_path);
+    free(f);
+    job_task_done(job);
+}
+
+// Hands `path` to the flusher pool, or flushes it right here if that
+// fails. `src_path` is journaled as done after the flush, if not NULL.
+static void job_flush(cptree_job_t* job, const char* path, const char* src_path,
+                      const struct stat* st) {
+    flush_t* f = calloc(1, sizeof(*f));
+    if (f != NULL) {
+        f->job = job;
+        f->path = strdup(path);
+        f->src_path = (src_path != NULL) ? strdup(src_path) : NULL;
+        f->st = *st;
+
+        if (f->path != NULL && (src_path == NULL || f->src_path != NULL)) {
+            atomic_fetch_add(&job->pending, 1);
+            if (tp_add(job->engine->flusher, f) == TP_SUCCESS) { return; }
+            atomic_fetch_sub(&job->pending, 1);
+        }
+
+        free(f->path);
+        free(f->src_path);
+        free(f);
+    }
+
+    flush_run(job, path, src_path, st);
+}
+
+// CPTREE_DURABLE_SYNCFS: keeps the directory for cptree_job_wait, which
+// takes over `path`. Fsynced right away if there is no room.
+static void job_sync_later(cptree_job_t* job, char* path) {
+    pthread_mutex_lock(&job->lock);
+    if (job->sync_dir_num == job->sync_dir_cap) {
+        size_t cap = (job->sync_dir_cap == 0) ? 64 : 2 * job->sync_dir_cap;
+        char** dirs = realloc(job->sync_dirs, cap * sizeof(*dirs));
+        if (dirs != NULL) {
+            job->sync_dirs = dirs;
+            job->sync_dir_cap = cap;
+        }
+    }
+
+    int kept = job->sync_dir_num < job->sync_dir_cap;
+    if (kept) { job->sync_dirs[job->sync_dir_num++] = path; }
+    pthread_mutex_unlock(&job->lock);
+
+    if (kept) { return; }
+
+    if (flush_path(path, 1) != 0) {
+        LOG_ERROR("failed to flush '%s'", path);
+        job_error(job, NULL, path, NULL, -1);
+    }
+    free(path);
+}
+
+static void dir_release(cptree_job_t* job, dir_state_t* dir) {
+    while (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        if (job->conf.sink != NULL) {
+            // Metadata went out with the entry
+        } else if (!dir->remove) {
+            int status = meta_apply_path(dir->src_path, dir->dst_path,
+                                         &dir->st, job->conf.preserve);
+            if (status != META_SUCCESS) {
+                LOG_WARN("failed to copy metadata of '%s' to '%s': %d",
+                         dir->src_path, dir->dst_path, status);
+            }
+
+            // Complete now, deletions included
+            if (job->conf.durability == CPTREE_DURABLE_ASYNC) {
+                job_flush(job, dir->dst_path, NULL, &dir->st);
+            } else if (job->conf.durability == CPTREE_DURABLE_SYNCFS) {
+                job_sync_later(job, dir->dst_path);
+                dir->dst_path = NULL;
+            }
+        } else if (!cancel_requested(&job->cancel)) {
+            rl_acquire(job->engine->limit, 0, 1);
+            if (rmdir(dir->dst_path) != 0) {
+                LOG_ERROR("failed to remove directory '%s'", dir->dst_path);
+                job_error(job, NULL, dir->dst_path, &dir->st, -1);
+            } else {
+                job_removed(job, dir->dst_path, &dir->st);
+            }
+        }
+
+        dir_state_t* parent = dir->parent;
+
+        free(dir->src_path);
+        free(dir->dst_path);
+        free(dir);
+
+        dir = parent;
+    }
+}
+
+// Moves the task's paths and its reference on the parent into a new
+// directory state. The returned state holds one reference for the walk.
+static dir_state_t* dir_state_init(task_t* task) {
+    dir_state_t* dir = malloc(sizeof(*dir));
+    if (dir == NULL) { return NULL; }
+
+    dir->parent = task->parent;
+    atomic_init(&dir->refs, 1);
+
+    dir->st = task->st;
+    dir->src_path = task->src_path;
+    dir->dst_path = task->dst_path;
+    dir->remove = task->remove;
+
+    task->parent = NULL;
+    task->src_path = NULL;
+    task->dst_path = NULL;
+
+    return dir;
+}
+
+static int job_excluded(const cptree_job_t* job, const char* name, int is_dir) {
+    return job->conf.filter != NULL &&
+           filter_match(job->conf.filter, name, is_dir) == FILTER_EXCLUDE;
+}
+
+static uint64_t name_hash(const char* name) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *name != '\0'; name++) {
+        h ^= (uint8_t)*name;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static char** name_set_slot(char** slots, size_t cap, const char* name) {
+    size_t i = (size_t)name_hash(name) & (cap - 1);
+    while (slots[i] != NULL && strcmp(slots[i], name) != 0) { i = (i + 1) & (cap - 1); }
+    return &slots[i];
+}
+
+static int name_set_add(name_set_t* set, const char* name) {
+    if (2 * (set->num + 1) > set->cap) {
+        size_t cap = (set->cap == 0) ? 64 : 2 * set->cap;
+        char** slots = calloc(cap, sizeof(*slots));
+        if (slots == NULL) { return CPTREE_ALLOCATION_FAILURE; }
+
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->slots[i] != NULL) { *name_set_slot(slots, cap, set->slots[i]) = set->slots[i]; }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+
+    char** slot = name_set_slot(set->slots, set->cap, name);
+    if (*slot != NULL) { return CPTREE_SUCCESS; }
+
+    *slot = strdup(name);
+    if (*slot == NULL) { return CPTREE_ALLOCATION_FAILURE; }
+
+    set->num++;
+    return CPTREE_SUCCESS;
+}
+
+static int name_set_contains(const name_set_t* set, const char* name) {
+    return set->cap > 0 && *name_set_slot(set->slots, set->cap, name) != NULL;
+}
+
+static void name_set_free(name_set_t* set) {
+    for (size_t i = 0; i < set->cap; i++) { free(set->slots[i]); }
+    free(set->slots);
+}
+
+// Queues removals as children of `parent`, so its metadata is applied,
+// or it is removed itself, only after they are done
+static void job_add_remove(cptree_job_t* job, dir_state_t* parent, const char* name,
+                           mode_t mode, dev_t dev) {
+    task_t* task = remove_task_init(job, parent->dst_path, name, mode, dev);
+    if (task == NULL) { return; }
+
+    task->parent = parent;
+    atomic_fetch_add(&parent->refs, 1);
+
+    if (job_add(job, task) != TP_SUCCESS) {
+        LOG_ERROR("failed to enqueue removal of '%s'", task->dst_path);
+        job_error(job, NULL, task->dst_path, &task->st, -1);
+        task_destroy(task);
+        dir_release(job, parent);
+    }
+}
+
+// Destination directories --delete reads are opened without following
+// a symlink in their last component; the components before it were
+// checked by the walk (job_make_room), except for the root itself,
+// which the caller named and may well be a symlink.
+static DIR* dst_opendir(const char* path, int nofollow) {
+    HIST_BEGIN(t_opendir);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (nofollow ? O_NOFOLLOW : 0));
+    HIST_END(HIST_OPENDIR, t_opendir);
+    if (fd == -1) { return NULL; }
+
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) { close(fd); }
+    return dir;
+}
+
+// --delete: everything in the destination directory that the source
+// directory does not have is removed by pool tasks, a directory at a
+// time. Excluded names are kept, as they would be by a walk that copies.
+static void job_delete_extraneous(cptree_job_t* job, dir_state_t* state,
+                                  const name_set_t* names) {
+    rl_acquire(job->engine->limit, 0, 1);
+
+    DIR* dir = dst_opendir(state->dst_path, state->parent != NULL);
+    if (dir == NULL) {
+        LOG_ERROR("failed to open directory '%s'", state->dst_path);
+        job_error(job, state->src_path, state->dst_path, &state->st, -1);
+        return;
+    }
+
+    // Removals queue on the destination's device
+    struct stat st;
+    dev_t dev = (fstat(dirfd(dir), &st) == 0) ? st.st_dev : state->st.st_dev;
+
+    while (!cancel_requested(&job->cancel)) {
+        HIST_BEGIN(t_readdir);
+        struct dirent* entry = readdir(dir);
+        HIST_END(HIST_READDIR, t_readdir);
+        if (entry == NULL) { break; }
+
+        const char* name = entry->d_name;
+        if (!strcmp(".", name) || !strcmp("..", name) || name_set_contains(names, name)) {
+            continue;
+        }
+
+        mode_t mode = entry_mode(dir, entry);
+        if (job_excluded(job, name, S_ISDIR(mode))) {
+            LOG_DEBUG("keeping excluded '%s/%s'", state->dst_path, name);
+            continue;
+        }
+
+        job_add_remove(job, state, name, mode, dev);
+    }
+
+    closedir(dir);
+}
+
+// Files of a directory being removed go right away; subdirectories get
+// tasks of their own, and the directory itself goes with the last of
+// them in dir_release
+static void process_remove(task_t* task) {
+    cptree_job_t* job = task->job;
+
+    if (!S_ISDIR(task->st.st_mode)) {
+        rl_acquire(job->engine->limit, 0, 1);
+        if (unlink(task->dst_path) != 0) {
+            LOG_ERROR("failed to remove '%s'", task->dst_path);
+            job_error(job, NULL, task->dst_path, &task->st, -1);
+            return;
+        }
+        job_removed(job, task->dst_path, &task->st);
+        return;
+    }
+
+    dir_state_t* state = dir_state_init(task);
+    if (state == NULL) {
+        LOG_ERROR("allocation failed for '%s'", task->dst_path);
+        job_error(job, NULL, task->dst_path, &task->st, -1);
+        return;
+    }
+
+    rl_acquire(job->engine->limit, 0, 1);
+
+    DIR* dir = dst_opendir(state->dst_path, 1);
+    if (dir == NULL) {
+        LOG_ERROR("failed to open directory '%s'", state->dst_path);
+        job_error(job, NULL, state->dst_path, &state->st, -1);
+        dir_release(job, state);
+        return;
+    }
+
+    while (!cancel_requested(&job->cancel)) {
+        HIST_BEGIN(t_readdir);
+        struct dirent* entry = readdir(dir);
+        HIST_END(HIST_READDIR, t_readdir);
+        if (entry == NULL) { break; }
+
+        const char* name = entry->d_name;
+        if (!strcmp(".", name) || !strcmp("..", name)) { continue; }
+
+        mode_t mode = entry_mode(dir, entry);
+        if (S_ISDIR(mode)) {
+            job_add_remove(job, state, name, mode, task->st.st_dev);
+            continue;
+        }
+
+        rl_acquire(job->engine->limit, 0, 1);
+        if (unlinkat(dirfd(dir), name, 0) != 0) {
+            LOG_ERROR("failed to remove '%s/%s'", state->dst_path, name);
+            job_error(job, NULL, state->dst_path, NULL, -1);
+            continue;
+        }
+
+        stats_add(job->stats, STAT_DELETED, 1);
+        if (job->conf.callback != NULL) {
+            char* path = task_path_join(state->dst_path, name);
+            struct stat st = { 0 };
+            st.st_mode = mode;
+            if (path != NULL) { job_notify(job, CPTREE_EVENT_DELETE, NULL, path, &st, -1); }
+            free(path);
+        }
+    }
+
+    closedir(dir);
+    dir_release(job, state);
+}
+
+// Removes the directory `name` in `dir_fd` and everything below it,
+// depth-first through descriptors, so that nothing under it is reached
+// through a symlink. `path` names it in errors and events.
+static int job_remove_tree(cptree_job_t* job, int dir_fd, const char* name,
+                           const char* path) {
+    rl_acquire(job->engine->limit, 0, 1);
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = (fd != -1) ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd != -1) { close(fd); }
+        LOG_ERROR("failed to open directory '%s'", path);
+        return -1;
+    }
+
+    int status = SUCCESS;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* child = entry->d_name;
+        if (!strcmp(".", child) || !strcmp("..", child)) { continue; }
+
+        char* child_path = task_path_join(path, child);
+        if (child_path == NULL) {
+            LOG_ERROR("allocation failed for '%s/%s'", path, child);
+            status = -1;
+            continue;
+        }
+
+        struct stat st = { 0 };
+        st.st_mode = entry_mode(dir, entry);
+
+        int err;
+        if (S_ISDIR(st.st_mode)) {
+            err = job_remove_tree(job, dirfd(dir), child, child_path);
+        } else {
+            rl_acquire(job->engine->limit, 0, 1);
+            err = unlinkat(dirfd(dir), child, 0);
+            if (err != 0) {
+                LOG_ERROR("failed to remove '%s'", child_path);
+            } else {
+                job_removed(job, child_path, &st);
+            }
+        }
+
+        if (err != 0) { status = -1; }
+        free(child_path);
+    }
+
+    closedir(dir);
+    if (status != SUCCESS) { return status; }
+
+    if (unlinkat(dir_fd, name, AT_REMOVEDIR) != 0) {
+        LOG_ERROR("failed to remove directory '%s'", path);
+        return -1;
+    }
+
+    struct stat st = { 0 };
+    st.st_mode = S_IFDIR;
+    job_removed(job, path, &st);
+    return SUCCESS;
+}
+
+// --delete: an entry of another kind under the same name goes before
+// the copy, so that a mirror replaces it instead of failing on it, and
+// never writes through a symlink that the destination has where the
+// source has a directory. Regular files over regular files are left to
+// copy_file, which may resume them.
+static int job_make_room(cptree_job_t* job, const task_t* task) {
+    struct stat st;
+    if (lstat(task->dst_path, &st) != 0) {
+        if (errno == ENOENT) { return SUCCESS; }
+        LOG_ERROR("lstat failed for '%s'", task->dst_path);
+        job_error(job, task->src_path, task->dst_path, &task->st, -1);
+        return -1;
+    }
+
+    int src_dir = S_ISDIR(task->st.st_mode);
+    if (!S_ISLNK(st.st_mode) && S_ISDIR(st.st_mode) == src_dir) { return SUCCESS; }
+
+    LOG_DEBUG("replacing '%s', which is of another type", task->dst_path);
+
+    int err;
+    if (S_ISDIR(st.st_mode)) {
+        err = job_remove_tree(job, AT_FDCWD, task->dst_path, task->dst_path);
+    } else {
+        rl_acquire(job->engine->limit, 0, 1);
+        err = unlink(task->dst_path);
+        if (err != 0) {
+            LOG_ERROR("failed to remove '%s'", task->dst_path);
+        } else {
+            job_removed(job, task->dst_path, &st);
+        }
+    }
+
+    if (err != 0) { job_error(job, task->src_path, task->dst_path, &task->st, -1); }
+    return err;
+}
+
+static const char* job_rel_path(const cptree_job_t* job, const char* src_path) {
+    size_t len = strlen(src_path);
+    return src_path + ((len > job->rel_offset) ? job->rel_offset : len);
+}
+
+// The directory, or the sink's entry for it. Reports its own errors.
+static int job_mkdir(cptree_job_t* job, const task_t* task) {
+    int status;
+    if (job->conf.sink != NULL) {
+        status = sink_dir(job->conf.sink, job_rel_path(job, task->src_path), &task->st);
+        if (status != SINK_SUCCESS) {
+            LOG_ERROR("failed to add directory '%s' to the destination: %d",
+                      task->src_path, status);
+        }
+    } else if (job->conf.delete && task->parent != NULL &&
+               job_make_room(job, task) != SUCCESS) {
+        return -1;
+    } else {
+        // Created owner-writable; the real mode is applied by
+        // dir_release once the subtree has been copied
+        status = mkdir_with_mode(task->dst_path, S_IFDIR | S_IRWXU);
+        if (status != COPY_SUCCESS) { LOG_ERROR("failed to mkdir '%s'", task->dst_path); }
+    }
+
+    if (status != SUCCESS) {
+        job_error(job, task->src_path, task->dst_path, &task->st, status);
+        return status;
+    }
+
+    stats_add(job->stats, STAT_DIRS, 1);
+    job_notify(job, CPTREE_EVENT_DIR, task->src_path, task->dst_path, &task->st, status);
+    return status;
+}
+
+// No journal, metadata or flushing: all of it is up to the sink
+static void process_file_sink(task_t* task) {
+    cptree_job_t* job = task->job;
+
+    rl_acquire(job->engine->limit, (uint64_t)task->st.st_size, 1);
+
+    int status = sink_file(job->conf.sink, task->src_path,
+                           job_rel_path(job, task->src_path), &task->st);
+    if (status != SINK_SUCCESS) {
+        LOG_ERROR("failed to add '%s' to the destination: %d", task->src_path, status);
+        job_error(job, task->src_path, task->dst_path, &task->st, status);
+        return;
+    }
+
+    stats_add(job->stats, STAT_FILES, 1);
+    stats_add(job->stats, STAT_BYTES, (uint64_t)task->st.st_size);
+    job_notify(job, CPTREE_EVENT_FILE, task->src_path, task->dst_path, &task->st, status);
+}
+
+static void process_file(task_t* task) {
+    cptree_job_t* job = task->job;
+    if (job->conf.sink != NULL) {
+        process_file_sink(task);
+        return;
+    }
+
+    copy_opts_t opts = { 0 };
+    opts.st = &task->st;
+    opts.preserve = job->conf.preserve;
+    opts.verify = job->conf.verify;
+    opts.pipeline_min = job->conf.pipeline_min;
+    opts.engines = job->engines;
+    opts.engine_num = job->conf.engine_num;
+    opts.reflink = job->conf.reflink;
+    opts.limit = job->engine->limit;
+    opts.cancel = &job->cancel;
+
+    if (job->journal != NULL) {
+        int state = journal_lookup(job->journal, task->src_path,
+                                   &task->st, &opts.offset);
+        if (state == JOURNAL_DONE) {
+            LOG_DEBUG("skipping '%s', already copied", task->src_path);
+            job_skip(job, task);
+            return;
+        }
+        if (state == JOURNAL_PARTIAL) {
+            LOG_DEBUG("resuming '%s' at offset %lld", task->src_path,
+                      (long long)opts.offset);
+        }
+
+        opts.checkpoint_size = JOURNAL_CHUNK_SIZE;
+        opts.checkpoint = task_checkpoint;
+        opts.arg = task;
+        task->durable = opts.offset;
+    }
+
+    // Reported
+    if (job->conf.delete && task->parent != NULL && job_make_room(job, task) != SUCCESS) {
+        return;
+    }
+
+    int status = copy_file(task->src_path, task->dst_path,
+                           task->st.st_mode, &opts);
+    if (status == COPY_MODE_CHANGE_FAILURE) {
+        LOG_WARN("failed to copy mode of '%s' to '%s',"
+                 "but data was copied fully",
+                 task->src_path, task->dst_path);
+    } else if (status == COPY_METADATA_FAILURE) {
+        LOG_WARN("failed to copy metadata of '%s' to '%s',"
+                 "but data was copied fully",
+                 task->src_path, task->dst_path);
+    } else if (status == COPY_CANCELED) {
+        // Rolled back, unless the journal has a checkpoint of it that
+        // resume continues from
+        if (task->durable > 0) {
+            LOG_DEBUG("keeping partial copy '%s' for resume", task->dst_path);
+        } else if (unlink(task->dst_path) != 0) {
+            LOG_WARN("failed to remove partial copy '%s'", task->dst_path);
+        }
+        return;
+    } else if (status == COPY_VERIFY_FAILURE) {
+        LOG_ERROR("checksum mismatch between '%s' and its copy '%s'",
+                  task->src_path, task->dst_path);
+        job_error(job, task->src_path, task->dst_path, &task->st, status);
+        return;
+    } else if (status != COPY_SUCCESS) {
+        LOG_ERROR("failed to create copy of '%s' at '%s': %d",
+                  task->src_path, task->dst_path, status);
+        job_error(job, task->src_path, task->dst_path, &task->st, status);
+        return;
+    }
+
+    stats_add(job->stats, STAT_FILES, 1);
+    stats_add(job->stats, STAT_BYTES, (uint64_t)task->st.st_size);
+
+    // Journaled by the flusher, once the data is durable
+    if (job->conf.durability == CPTREE_DURABLE_ASYNC) {
+        job_flush(job, task->dst_path, (job->journal != NULL) ? task->src_path : NULL,
+                  &task->st);
+    } else if (job->journal != NULL) {
+        status = journal_file_done(job->journal, task->src_path, &task->st);
+        if (status != JOURNAL_SUCCESS) { job_journal_error(job, status); }
+    }
+
+    job_notify(job, CPTREE_EVENT_FILE, task->src_path, task->dst_path, &task->st, status);
+}
+
+static void process_folder(task_t* task) {
+    cptree_job_t* job = task->job;
+    if (job_mkdir(job, task) != SUCCESS) { return; }
+
+    dir_state_t* state = dir_state_init(task);
+    if (state == NULL) {
+        LOG_ERROR("allocation failed for '%s'", task->src_path);
+        job_error(job, task->src_path, task->dst_path, &task->st, -1);
+        return;
+    }
+
+    rl_acquire(job->engine->limit, 0, 1);
+
+    HIST_BEGIN(t_opendir);
+    DIR* dir = opendir(state->src_path);
+    HIST_END(HIST_OPENDIR, t_opendir);
+    if (dir == NULL) {
+        LOG_ERROR("failed to open directory '%s'", state->src_path);
+        job_error(job, state->src_path, state->dst_path, &state->st, -1);
+        dir_release(job, state);
+        return;
+    }
+
+    // Everything the source has, so that nothing is deleted that should
+    // not be if a readdir or an allocation fails
+    name_set_t names = { 0 };
+    int complete = job->conf.delete;
+
+    while (!cancel_requested(&job->cancel)) {
+        HIST_BEGIN(t_readdir);
+        errno = 0;
+        struct dirent* entry = readdir(dir);
+        HIST_END(HIST_READDIR, t_readdir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                LOG_ERROR("failed to read directory '%s'", state->src_path);
+                job_error(job, state->src_path, state->dst_path, &state->st, -1);
+                complete = 0;
+            }
+            break;
+        }
+
+        char* filename = entry->d_name;
+        if (!strcmp(".", filename)|| !strcmp("..", filename)) { continue; }
+
+        if (complete && name_set_add(&names, filename) != CPTREE_SUCCESS) {
+            LOG_ERROR("allocation failed, not deleting anything in '%s'", state->dst_path);
+            job_error(job, state->src_path, state->dst_path, &state->st, -1);
+            complete = 0;
+        }
+
+        // Decided on the name and d_type alone where the filesystem
+        // fills it in, which saves the lstat and prunes whole subtrees
+        int known = entry->d_type != DT_UNKNOWN;
+        if (known && job_excluded(job, filename, entry->d_type == DT_DIR)) {
+            LOG_DEBUG("excluding '%s/%s'", state->src_path, filename);
+            continue;
+        }
+
+        task_t* new_task = task_init(job, state->src_path, state->dst_path, filename);
+        if (new_task == NULL) { continue; }
+
+        if (!known && job_excluded(job, filename, S_ISDIR(new_task->st.st_mode))) {
+            LOG_DEBUG("excluding '%s'", new_task->src_path);
+            task_destroy(new_task);
+            continue;
+        }
+
+        new_task->parent = state;
+        atomic_fetch_add(&state->refs, 1);
+
+        if (job_add(job, new_task) != TP_SUCCESS) {
+            LOG_ERROR("failed to enqueue '%s'", new_task->src_path);
+            job_error(job, new_task->src_path, new_task->dst_path, &new_task->st, -1);
+            task_destroy(new_task);
+            dir_release(job, state);
+        }
+    }
+
+    closedir(dir);
+
+    if (complete && !cancel_requested(&job->cancel)) {
+        job_delete_extraneous(job, state, &names);
+    }
+    name_set_free(&names);
+
+    dir_release(job, state);
+}
+
+static void process_file_or_skip(task_t* task) {
+    if (S_ISREG(task->st.st_mode)) {
+        process_file(task);
+    } else if (S_ISLNK(task->st.st_mode)) {
+        LOG_INFO("ignoring '%s' because this is symlink", task->src_path);
+        job_skip(task->job, task);
+    } else {
+        LOG_INFO("ignoring '%s' because of unsupported file type", task->src_path);
+        job_skip(task->job, task);
+    }
+}
+
+// List jobs: the listed entry's directory (or the entry itself, if it
+// is a directory) is created together with all its parents
+static int task_ensure_dirs(task_t* task) {
+    cptree_job_t* job = task->job;
+    const char* rel = task->src_path + job->rel_offset;
+
+    size_t len = strlen(rel);
+    if (!S_ISDIR(task->st.st_mode)) {
+        while (len > 0 && rel[len - 1] != '/') { len--; }
+        if (len > 0) { len--; }
+    }
+
+    int status = dircache_ensure(job->dircache, rel, len);
+    if (status != DIRCACHE_SUCCESS) {
+        LOG_ERROR("failed to create parent directories for '%s': %d",
+                  task->dst_path, status);
+        job_error(job, task->src_path, task->dst_path, &task->st, -1);
+    }
+    return status;
+}
+
+static const char* task_kind(const task_t* task) {
+    if (task->remove) { return "remove"; }
+    if (S_ISDIR(task->st.st_mode)) { return "dir"; }
+    if (S_ISREG(task->st.st_mode)) { return "file"; }
+    return "other";
+}
+
+static void tp_handler(void* arg) {
+    task_t* task = arg;
+    cptree_job_t* job = task->job;
+
+    if (trace_enabled) {
+        trace_label(task_kind(task), task->remove ? task->dst_path : task->src_path);
+    }
+
+    if (cancel_requested(&job->cancel)) {
+        // Dropped, see tp_drop
+    } else if (task->remove) {
+        process_remove(task);
+    } else if (job->conf.list) {
+        // Listed directories are created, but never walked. A sink
+        // gets no entries for their parents.
+        if (job->dircache != NULL && task_ensure_dirs(task) != DIRCACHE_SUCCESS) {
+            // Reported
+        } else if (!S_ISDIR(task->st.st_mode)) {
+            process_file_or_skip(task);
+        } else if (job->conf.sink != NULL) {
+            job_mkdir(job, task);
+        }
+    } else if (S_ISDIR(task->st.st_mode)) {
+        process_folder(task);
+    } else {
+        process_file_or_skip(task);
+    }
+
+    dir_release(job, task->parent);
+    task_destroy(task);
+    job_task_done(job);
+}
+
+// Tasks the pool dequeues after a cancel never reach tp_handler. They
+// still hold a reference on their parent, which then gets its
+// metadata, and count as pending.
+static void tp_drop(void* arg) {
+    task_t* task = arg;
+    cptree_job_t* job = task->job;
+
+    dir_release(job, task->parent);
+    task_destroy(task);
+    job_task_done(job);
+}
+
+int cptree_init(cptree_t** p, const cptree_conf_t* conf) {
+    if (p == NULL || conf == NULL || conf->thread_num == 0) {
+        return CPTREE_INVALID_ARGUMENT;
+    }
+
+    cptree_t* engine = calloc(1, sizeof(*engine));
+    if (engine == NULL) { return CPTREE_ALLOCATION_FAILURE; }
+
+    engine->thread_num = conf->thread_num;
+    engine->limit = conf->limit;
+    cancel_init(&engine->cancel, conf->cancel);
+
+    tp_conf_t tconf = { 0 };
+    tconf.thread_num = conf->thread_num;
+    tconf.queue_limit = conf->device_threads;
+    tconf.handler = tp_handler;
+    tconf.drop = tp_drop;
+    tconf.cancel = &engine->cancel;
+    tconf.stack_size = WORKER_STACK_SIZE;
+    tconf.name = "cp-worker";
+
+    int status = tp_init(&engine->pool, &tconf);
+    if (status != TP_SUCCESS) {
+        LOG_ERROR("failed to init threadpool: %d", status);
+        free(engine);
+        return CPTREE_POOL_FAILURE;
+    }
+
+    if (conf->flush_threads > 0) {
+        tconf.thread_num = conf->flush_threads;
+        tconf.queue_limit = 0;
+        tconf.handler = flush_handler;
+        tconf.drop = flush_handler;     // skips the flush of canceled jobs
+        tconf.name = "cp-flush";
+
+        status = tp_init(&engine->flusher, &tconf);
+        if (status != TP_SUCCESS) {
+            LOG_ERROR("failed to init flusher threadpool: %d", status);
+            tp_destroy(engine->pool);
+            free(engine);
+            return CPTREE_POOL_FAILURE;
+        }
+    }
+
+    *p = engine;
+    return CPTREE_SUCCESS;
+}
+
+void cptree_destroy(cptree_t* engine) {
+    if (engine == NULL) { return; }
+
+    tp_destroy(engine->pool);
+    if (engine->flusher != NULL) { tp_destroy(engine->flusher); }
+    free(engine);
+}
+
+void cptree_shutdown(void) {
+    log_shutdown();
+}
+
+void cptree_cancel(cptree_t* engine) {
+    if (engine == NULL) { return; }
+    cancel_request(&engine->cancel);
+}
+
+tp_t* cptree_pool(cptree_t* engine) {
+    return engine->pool;
+}
+
+static int job_open_journal(cptree_job_t* job, const char* path) {
+    journal_conf_t conf = { 0 };
+    conf.path = path;
+    conf.src_root = job->src_root;
+    conf.dst_root = job->dst_root;
+    conf.resume = job->conf.resume;
+
+    // Asynchronous durability journals files only once they are flushed
+    if (job->conf.durability != CPTREE_DURABLE_ASYNC) { conf.sync_path = job->dst_root; }
+
+    int status = journal_open(&job->journal, &conf);
+    if (status == JOURNAL_ROOT_MISMATCH) {
+        LOG_ERROR("journal '%s' was written for different roots", conf.path);
+    } else if (status == JOURNAL_NOT_A_JOURNAL) {
+        LOG_ERROR("'%s' is not a journal, refusing to resume from it", conf.path);
+    } else if (status != JOURNAL_SUCCESS) {
+        LOG_ERROR("failed to open journal '%s': %d", conf.path, status);
+    }
+    return status;
+}
+
+// Only once no task of the job is queued or running
+static void job_free(cptree_job_t* job) {
+    if (job->journal != NULL) { journal_close(job->journal, 0); }
+    dircache_destroy(job->dircache);
+    stats_destroy(job->stats);
+
+    for (size_t i = 0; i < job->sync_dir_num; i++) { free(job->sync_dirs[i]); }
+    free(job->sync_dirs);
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done);
+
+    free(job->src_root);
+    free(job->dst_root);
+    free(job);
+}
+
+int cptree_submit(cptree_t* engine, const cptree_job_conf_t* conf, cptree_job_t** p) {
+    if (engine == NULL || conf == NULL || p == NULL ||
+        conf->src_root == NULL || conf->dst_root == NULL ||
+        conf->engine_num > COPY_ENGINE_RULES_MAX || (conf->list && conf->delete) ||
+        (conf->durability == CPTREE_DURABLE_ASYNC && engine->flusher == NULL) ||
+        (conf->sink != NULL && (conf->journal_path != NULL || conf->delete ||
+                                conf->verify || conf->durability != CPTREE_DURABLE_NONE))) {
+        return CPTREE_INVALID_ARGUMENT;
+    }
+
+    cptree_job_t* job = calloc(1, sizeof(*job));
+    if (job == NULL) { return CPTREE_ALLOCATION_FAILURE; }
+
+    job->engine = engine;
+    job->conf = *conf;
+    job->conf.src_root = NULL;
+    job->conf.dst_root = NULL;
+    job->conf.journal_path = NULL;
+    job->conf.engines = NULL;
+    if (conf->engine_num > 0) {
+        memcpy(job->engines, conf->engines, conf->engine_num * sizeof(*conf->engines));
+    }
+
+    atomic_init(&job->journal_failed, 0);
+    cancel_init(&job->cancel, &engine->cancel);
+    atomic_init(&job->pending, 1);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    job->src_root = strdup(conf->src_root);
+    job->dst_root = strdup(conf->dst_root);
+    if (job->src_root == NULL || job->dst_root == NULL ||
+        stats_init(&job->stats, engine->thread_num) != STATS_SUCCESS) {
+        job_free(job);
+        return CPTREE_ALLOCATION_FAILURE;
+    }
+
+    if (conf->journal_path != NULL &&
+        job_open_journal(job, conf->journal_path) != JOURNAL_SUCCESS) {
+        job_free(job);
+        return CPTREE_JOURNAL_FAILURE;
+    }
+
+    size_t root_len = strlen(job->src_root);
+    job->rel_offset = root_len;
+    if (root_len > 0 && job->src_root[root_len - 1] != '/') { job->rel_offset++; }
+
+    if (conf->list) {
+        int status = (conf->sink != NULL) ? DIRCACHE_SUCCESS
+                   : dircache_init(&job->dircache, job->src_root, job->dst_root);
+        if (status != DIRCACHE_SUCCESS) {
+            LOG_ERROR("failed to init directory cache: %d", status);
+            job_free(job);
+            return CPTREE_ALLOCATION_FAILURE;
+        }
+    } else {
+        task_t* first_task = task_init(job, job->src_root, job->dst_root, NULL);
+        if (first_task == NULL || job_add(job, first_task) != TP_SUCCESS) {
+            if (first_task != NULL) { task_destroy(first_task); }
+            job_free(job);
+            return CPTREE_FAILURE;
+        }
+    }
+
+    *p = job;
+    return CPTREE_SUCCESS;
+}
+
+// Normalizes a listed path in place: drops empty and "." components and
+// rejects ".." so that entries cannot escape the roots.
+// Returns NULL for paths that name nothing to copy.
+static char* list_normalize_path(char* path) {
+    char* out = path;
+    char* p = path;
+
+    while (*p != '\0') {
+        while (*p == '/') { p++; }
+        if (*p == '\0') { break; }
+
+        char* end = p;
+        while (*end != '\0' && *end != '/') { end++; }
+        size_t len = (size_t)(end - p);
+
+        if (len == 2 && p[0] == '.' && p[1] == '.') { return NULL; }
+
+        if (!(len == 1 && p[0] == '.')) {
+            if (out != path) { *out++ = '/'; }
+            memmove(out, p, len);
+            out += len;
+        }
+        p = end;
+    }
+
+    *out = '\0';
+    return (out == path) ? NULL : path;
+}
+
+int cptree_job_add_path(cptree_job_t* job, const char* rel_path) {
+    if (job == NULL || rel_path == NULL || !job->conf.list) {
+        return CPTREE_INVALID_ARGUMENT;
+    }
+    if (cancel_requested(&job->cancel)) { return CPTREE_CANCELED; }
+
+    char* copy = strdup(rel_path);
+    if (copy == NULL) { return CPTREE_ALLOCATION_FAILURE; }
+
+    char* rel = list_normalize_path(copy);
+    if (rel == NULL) {
+        LOG_WARN("skipping '%s' from file list", rel_path);
+        free(copy);
+        return CPTREE_INVALID_ARGUMENT;
+    }
+
+    // Every directory on the way has to pass the filter, just as if
+    // the tree was walked
+    char* name = rel;
+    for (char* slash = strchr(name, '/'); slash != NULL; slash = strchr(name, '/')) {
+        *slash = '\0';
+        int excluded = job_excluded(job, name, 1);
+        *slash = '/';
+
+        if (excluded) {
+            LOG_DEBUG("excluding '%s' from file list", rel_path);
+            free(copy);
+            return CPTREE_EXCLUDED;
+        }
+        name = slash + 1;
+    }
+
+    task_t* task = task_init(job, job->src_root, job->dst_root, rel);
+    if (task != NULL && job_excluded(job, name, S_ISDIR(task->st.st_mode))) {
+        LOG_DEBUG("excluding '%s' from file list", rel_path);
+        task_destroy(task);
+        free(copy);
+        return CPTREE_EXCLUDED;
+    }
+
+    free(copy);
+    if (task == NULL) { return CPTREE_FAILURE; }
+
+    if (job_add(job, task) != TP_SUCCESS) {
+        LOG_ERROR("failed to enqueue '%s'", task->src_path);
+        job_error(job, task->src_path, task->dst_path, &task->st, -1);
+        task_destroy(task);
+        return CPTREE_POOL_FAILURE;
+    }
+    return CPTREE_SUCCESS;
+}
+
+void cptree_job_cancel(cptree_job_t* job) {
+    if (job == NULL) { return; }
+    cancel_request(&job->cancel);
+}
+
+// Syncs the filesystem `fd` is on, unless it is among the `num` in
+// `devs` already
+static int job_syncfs(cptree_job_t* job, int fd, dev_t* devs, size_t* num) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) { return -1; }
+
+    for (size_t i = 0; i < *num; i++) {
+        if (devs[i] == st.st_dev) { return 0; }
+    }
+
+    LOG_DEBUG("syncing the filesystem of device %llu", (unsigned long long)st.st_dev);
+    rl_acquire(job->engine->limit, 0, 1);
+    if (syncfs(fd) != 0) { return -1; }
+
+    // Only a cache; past its end every directory on another
+    // filesystem syncs it again
+    if (*num < CPTREE_SYNCFS_DEVS) { devs[(*num)++] = st.st_dev; }
+    return 0;
+}
+
+// End of a CPTREE_DURABLE_SYNCFS job, or of a CPTREE_DURABLE_ASYNC list
+// job: the destination root's filesystem first, then any other the
+// walk went into as its directories are fsynced
+static void job_sync(cptree_job_t* job) {
+    dev_t devs[CPTREE_SYNCFS_DEVS];
+    size_t dev_num = 0;
+
+    int fd = open(job->dst_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || job_syncfs(job, fd, devs, &dev_num) != 0) {
+        LOG_ERROR("failed to sync the filesystem of '%s'", job->dst_root);
+        job_error(job, NULL, job->dst_root, NULL, -1);
+    }
+    if (fd != -1) { close(fd); }
+
+    for (size_t i = 0; i < job->sync_dir_num; i++) {
+        const char* path = job->sync_dirs[i];
+
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || job_syncfs(job, fd, devs, &dev_num) != 0 || fsync(fd) != 0) {
+            LOG_ERROR("failed to flush '%s'", path);
+            job_error(job, NULL, path, NULL, -1);
+        }
+        if (fd != -1) { close(fd); }
+    }
+}
+
+int cptree_job_wait(cptree_job_t* job) {
+    if (job == NULL) { return CPTREE_INVALID_ARGUMENT; }
+
+    job_task_done(job);
+
+    pthread_mutex_lock(&job->lock);
+    while (atomic_load(&job->pending) > 0) {
+        pthread_cond_wait(&job->done, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (job->dircache != NULL &&
+        dircache_finish(job->dircache, job->conf.preserve) != DIRCACHE_SUCCESS) {
+        LOG_WARN("failed to copy metadata of some directories");
+    }
+
+    int sync = job->conf.durability == CPTREE_DURABLE_SYNCFS ||
+               (job->conf.durability == CPTREE_DURABLE_ASYNC && job->conf.list);
+    if (sync && !cancel_requested(&job->cancel)) { job_sync(job); }
+
+    uint64_t totals[STAT_NUM];
+    stats_read(job->stats, totals);
+
+    int canceled = cancel_requested(&job->cancel);
+    int status = canceled ? CPTREE_CANCELED
+               : (totals[STAT_ERRORS] > 0) ? CPTREE_PARTIAL : CPTREE_SUCCESS;
+
+    if (job->journal != NULL) {
+        // Kept around if anything is missing, so that a resumed run only
+        // retries that
+        int remove = status == CPTREE_SUCCESS;
+        if (journal_close(job->journal, remove) != JOURNAL_SUCCESS) {
+            LOG_ERROR("failed to flush journal");
+            status = CPTREE_JOURNAL_FAILURE;
+        }
+        job->journal = NULL;
+    }
+
+    return status;
+}
+
+stats_t* cptree_job_stats(cptree_job_t* job) {
+    return job->stats;
+}
+
+void cptree_job_destroy(cptree_job_t* job) {
+    if (job == NULL) { return; }
+    job_free(job);
+}
@@ -0,0 +1,223 @@
+#ifndef CPTREE_H
+#define CPTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cancel.h"
+#include "copy.h"
+#include "filter.h"
+#include "meta.h"
+#include "ratelimit.h"
+#include "sink.h"
+#include "stats.h"
+#include "threadpool.h"
+
+// libcptree: the tree copier behind cp, for programs that copy many
+// trees and want to keep one warm worker pool for all of them.
+//
+//   cptree_t* engine;
+//   cptree_init(&engine, &conf);
+//
+//   cptree_job_t* job;
+//   cptree_submit(engine, &job_conf, &job);
+//   ...                            // callbacks arrive on worker threads
+//   cptree_job_wait(job);
+//   cptree_job_destroy(job);
+//
+//   cptree_destroy(engine);
+//
+// Any number of jobs may run at once; all functions are thread-safe.
+//
+// Process-wide state: log messages go to stderr through a background
+// thread, started by the first one and stopped by cptree_shutdown. The
+// first file copied with an mmap engine installs a SIGBUS handler that
+// turns faults on the mappings (a source truncated under the copy) into
+// I/O errors and hands every other SIGBUS to the handler installed
+// before it. Nothing is registered with atexit.
+
+enum {
+    CPTREE_SUCCESS = 0,
+    CPTREE_FAILURE = -1,
+    CPTREE_ALLOCATION_FAILURE = -2,
+    CPTREE_INVALID_ARGUMENT = -3,
+    CPTREE_POOL_FAILURE = -4,
+    CPTREE_JOURNAL_FAILURE = -5,
+    CPTREE_CANCELED = -6,
+    CPTREE_PARTIAL = -7,            // finished, but some entries failed
+    CPTREE_EXCLUDED = -8
+};
+
+typedef struct cptree cptree_t;
+typedef struct cptree_job cptree_job_t;
+
+typedef struct {
+    size_t thread_num;
+
+    // At most this many tasks per source device at a time, 0 for any
+    size_t device_threads;
+
+    // Shared by every job of the engine and charged per byte and per
+    // file operation; NULL for none. Owned by the caller.
+    rl_t* limit;
+
+    // Threads that flush for CPTREE_DURABLE_ASYNC jobs. 0 starts none,
+    // and such jobs are refused.
+    size_t flush_threads;
+
+    // Parent of the engine's token: requesting it cancels every job, as
+    // cptree_cancel does. NULL for none; owned by the caller, who keeps
+    // it until the engine is destroyed.
+    const cancel_t* cancel;
+} cptree_conf_t;
+
+int cptree_init(cptree_t** engine, const cptree_conf_t* conf);
+
+// Stops the workers. All jobs have to be waited for and destroyed
+// first.
+void cptree_destroy(cptree_t* engine);
+
+// Cancels every job of the engine, running or yet to be submitted, as
+// cptree_job_cancel does. Cannot be undone.
+void cptree_cancel(cptree_t* engine);
+
+// Writes out pending log messages and stops the thread writing them.
+// Call once before exiting, after the last engine is destroyed; later
+// messages are written directly.
+void cptree_shutdown(void);
+
+// For tp_stats and the stats reporter
+tp_t* cptree_pool(cptree_t* engine);
+
+enum {
+    CPTREE_EVENT_FILE,      // a regular file was copied
+    CPTREE_EVENT_DIR,       // a directory was created
+    CPTREE_EVENT_SKIP,      // unsupported type, or done in an earlier run
+    CPTREE_EVENT_ERROR,     // see `status`
+    CPTREE_EVENT_DELETE     // an entry only the destination had was removed
+};
+
+typedef struct {
+    int type;
+    const char* src_path;   // NULL for deletions
+    const char* dst_path;
+    const struct stat* st;  // NULL if the source could not be stat'ed;
+                            // only the type is set for deletions
+
+    // COPY_* (SINK_* with a sink) status of the failed operation, or -1
+    // if there is none (allocation, lstat, opendir)
+    int status;
+} cptree_event_t;
+
+// When copies reach stable storage, and what a crash (power loss, not
+// just a killed process) leaves behind
+enum {
+    // Nothing is flushed; the kernel writes back whenever it likes. A
+    // crash, even after cptree_job_wait, may leave any copied file
+    // missing, empty or short. With a journal, the destination root's
+    // filesystem is synced before each batch of records (about once a
+    // second) that lists files as done, so resume after a crash is
+    // safe, except for files on other filesystems mounted below the
+    // destination root.
+    CPTREE_DURABLE_NONE,
+
+    // Every file is fdatasync'ed by the flusher pool right after it is
+    // copied, and every directory fsync'ed once everything below it is
+    // done. cptree_job_wait returns once all of it is durable. Files
+    // are journaled as done only after their flush, so a crash loses
+    // only files the journal does not list and resume is safe. Costs
+    // one flush per file, but the workers do not wait for it.
+    CPTREE_DURABLE_ASYNC,
+
+    // Nothing is flushed while copying. At the end, one syncfs per
+    // destination filesystem, then an fsync of every directory,
+    // children before parents. cptree_job_wait returns once all of it
+    // is durable. The cheapest for many small files, but until then a
+    // crash is as bad as with CPTREE_DURABLE_NONE, and the journal is
+    // kept safe the same way.
+    CPTREE_DURABLE_SYNCFS
+};
+
+// Called on worker threads, possibly several at once. Must not block
+// for long: it holds up a worker.
+typedef void (*cptree_callback_t)(const cptree_event_t* event, void* arg);
+
+typedef struct {
+    const char* src_root;
+    const char* dst_root;
+
+    // Copy only what is added with cptree_job_add_path instead of
+    // walking src_root
+    int list;
+
+    // Record progress in this file, and skip what it says is done if
+    // `resume` is set. NULL for no journal.
+    const char* journal_path;
+    int resume;
+
+    // META_* flags of what to copy besides data
+    int preserve;
+    int verify;
+
+    // See copy_opts_t; 0 never pipelines
+    off_t pipeline_min;
+    const copy_engine_rule_t* engines;  // at most COPY_ENGINE_RULES_MAX
+    size_t engine_num;
+    int reflink;
+
+    // Entries it excludes are neither stat'ed nor copied, and excluded
+    // directories are not opened. NULL copies everything. Compiled, and
+    // owned by the caller, who keeps it until the job is destroyed.
+    const filter_t* filter;
+
+    // Mirror: remove whatever the destination has and the source does
+    // not, except excluded names. Not for list jobs.
+    int delete;
+
+    // CPTREE_DURABLE_*. List jobs never fsync directories one by one and
+    // get a syncfs of the destination root's filesystem instead.
+    int durability;
+
+    // Entries go here instead of into a tree at dst_root, which is then
+    // only used in dst_path of events. Not with a journal, delete,
+    // verify or durability. Owned by the caller, who calls sink_finish
+    // once the job is waited for.
+    sink_t* sink;
+
+    cptree_callback_t callback;         // NULL for none
+    void* arg;
+} cptree_job_conf_t;
+
+// Starts copying in the background. Everything in `conf` but the
+// filter is copied, so it may go away right after; the job keeps its
+// own stats.
+int cptree_submit(cptree_t* engine, const cptree_job_conf_t* conf, cptree_job_t** job);
+
+// List jobs only: queues `rel_path`, relative to both roots, creating
+// its parent directories on demand. Paths with ".." are refused, and so
+// are paths with a component the filter excludes (CPTREE_EXCLUDED).
+int cptree_job_add_path(cptree_job_t* job, const char* rel_path);
+
+// Returns at once; cptree_job_wait still has to be called, and returns
+// CPTREE_CANCELED. Queued tasks are dropped as workers reach them and
+// nothing new is queued. Files being copied stop after their current
+// chunk: without a journal the partial copy is removed, with one it is
+// kept for resume to continue. Directories created so far still get
+// their metadata; durability flushes and deletions not yet done are
+// skipped. Entries already handed to a sink are finished.
+void cptree_job_cancel(cptree_job_t* job);
+
+// Waits for the job to finish or drain after a cancel, then applies
+// directory metadata of list jobs and closes the journal, which is
+// removed if everything was copied. Call once; no paths may be added
+// afterwards.
+int cptree_job_wait(cptree_job_t* job);
+
+// Live counters of the job (STAT_*)
+stats_t* cptree_job_stats(cptree_job_t* job);
+
+void cptree_job_destroy(cptree_job_t* job);
+
+#endif /* CPTREE_H */
@@ -0,0 +1,138 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u     // reflected
+
+// The crc32 instruction has a latency of three cycles but a throughput
+// of one, so three independent lanes keep it busy. The lanes are merged
+// by shifting a CRC over CRC32C_LANE zero bytes, which is linear and
+// done with four table lookups.
+#define CRC32C_LANE 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_shift_table[4][256];
+
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t*, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+// Slicing-by-8, for CPUs without the instruction
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc) {
+    return crc32c_shift_table[0][crc & 0xff] ^
+           crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+           crc32c_shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    uint64_t c0 = crc;
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+
+        for (const uint8_t* end = p + CRC32C_LANE; p < end; p += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p, 8);
+            memcpy(&v1, p + CRC32C_LANE, 8);
+            memcpy(&v2, p + 2 * CRC32C_LANE, 8);
+
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+
+        c0 = crc32c_shift(crc32c_shift((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        p += 2 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+
+    crc = (uint32_t)c0;
+    while (len-- > 0) { crc = _mm_crc32_u8(crc, *p++); }
+    return crc;
+}
+
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    // Shifting is linear, so it is enough to know where every single
+    // bit ends up
+    static const uint8_t zeros[CRC32C_LANE];
+    uint32_t bit_shift[32];
+    for (int b = 0; b < 32; b++) {
+        bit_shift[b] = crc32c_sw(1u << b, zeros, sizeof(zeros));
+    }
+    for (int t = 0; t < 4; t++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t v = 0;
+            for (int b = 0; b < 8; b++) {
+                if (i & (1u << b)) { v ^= bit_shift[t * 8 + b]; }
+            }
+            crc32c_shift_table[t][i] = v;
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) { crc32c_impl = crc32c_hw; }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, len);
+}
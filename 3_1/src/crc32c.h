@@ -0,0 +1,15 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs. Start with 0
+// and feed consecutive pieces of the data:
+//   uint32_t crc = 0;
+//   crc = crc32c(crc, a, len_a);
+//   crc = crc32c(crc, b, len_b);
+// Uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif /* CRC32C_H */
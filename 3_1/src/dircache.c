@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+
+#include "dircache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "copy.h"
+#include "meta.h"
+
+#define ERROR -1
+
+#define STRIPE_NUM 64
+#define STRIPE_INITIAL_CAPACITY 64
+
+typedef struct dir_node {
+    struct dir_node* next;
+    uint64_t hash;
+    struct stat st;
+    size_t depth;
+    size_t len;
+    char path[];
+} dir_node_t;
+
+// Every stripe is an independent chained hash table with its own lock,
+// so lookups of unrelated directories rarely contend
+typedef struct {
+    pthread_mutex_t lock;
+    dir_node_t** buckets;
+    size_t cap;
+    size_t num;
+} stripe_t;
+
+struct dircache {
+    char* src_root;
+    char* dst_root;
+    size_t src_len;
+    size_t dst_len;
+
+    stripe_t stripes[STRIPE_NUM];
+};
+
+
+static uint64_t dircache_hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static inline stripe_t* dircache_stripe(dircache_t* c, uint64_t hash) {
+    return &c->stripes[(hash >> 32) % STRIPE_NUM];
+}
+
+static int stripe_contains(stripe_t* s, const char* path, size_t len,
+                           uint64_t hash) {
+    for (dir_node_t* n = s->buckets[hash & (s->cap - 1)]; n != NULL; n = n->next) {
+        if (n->hash == hash && n->len == len && memcmp(n->path, path, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int stripe_grow(stripe_t* s) {
+    size_t cap = s->cap * 2;
+    dir_node_t** buckets = calloc(cap, sizeof(*buckets));
+    if (buckets == NULL) { return DIRCACHE_ALLOCATION_FAILURE; }
+
+    for (size_t i = 0; i < s->cap; i++) {
+        dir_node_t* n = s->buckets[i];
+        while (n != NULL) {
+            dir_node_t* next = n->next;
+            n->next = buckets[n->hash & (cap - 1)];
+            buckets[n->hash & (cap - 1)] = n;
+            n = next;
+        }
+    }
+
+    free(s->buckets);
+    s->buckets = buckets;
+    s->cap = cap;
+    return DIRCACHE_SUCCESS;
+}
+
+static int dircache_lookup(dircache_t* c, const char* path, size_t len,
+                           uint64_t hash) {
+    stripe_t* s = dircache_stripe(c, hash);
+
+    pthread_mutex_lock(&s->lock);
+    int found = stripe_contains(s, path, len, hash);
+    pthread_mutex_unlock(&s->lock);
+
+    return found;
+}
+
+static int dircache_insert(dircache_t* c, const char* path, size_t len,
+                           uint64_t hash, const struct stat* st) {
+    stripe_t* s = dircache_stripe(c, hash);
+    int status = DIRCACHE_SUCCESS;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (stripe_contains(s, path, len, hash)) { goto exit; }
+
+    if (s->num >= s->cap) {
+        status = stripe_grow(s);
+        if (status != DIRCACHE_SUCCESS) { goto exit; }
+    }
+
+    dir_node_t* n = malloc(sizeof(*n) + len);
+    if (n == NULL) {
+        status = DIRCACHE_ALLOCATION_FAILURE;
+        goto exit;
+    }
+
+    n->hash = hash;
+    n->st = *st;
+    n->len = len;
+    memcpy(n->path, path, len);
+
+    n->depth = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] == '/') { n->depth++; }
+    }
+
+    n->next = s->buckets[hash & (s->cap - 1)];
+    s->buckets[hash & (s->cap - 1)] = n;
+    s->num++;
+
+exit:
+    pthread_mutex_unlock(&s->lock);
+    return status;
+}
+
+static char* dircache_join(const char* root, size_t root_len,
+                           const char* rel, size_t len) {
+    char* res = malloc(root_len + 1 + len + 1);
+    if (res == NULL) { return NULL; }
+
+    memcpy(res, root, root_len);
+    if (len > 0) {
+        res[root_len] = '/';
+        memcpy(res + root_len + 1, rel, len);
+        res[root_len + 1 + len] = '\0';
+    } else {
+        res[root_len] = '\0';
+    }
+    return res;
+}
+
+static int dircache_mkdir(dircache_t* c, const char* rel, size_t len,
+                          struct stat* st) {
+    char* src = dircache_join(c->src_root, c->src_len, rel, len);
+    char* dst = dircache_join(c->dst_root, c->dst_len, rel, len);
+    int status = DIRCACHE_ALLOCATION_FAILURE;
+
+    if (src == NULL || dst == NULL) { goto exit; }
+
+    // The source mode is applied by dircache_finish, after the
+    // directory has been filled
+    status = DIRCACHE_MKDIR_FAILURE;
+    if (stat(src, st) == ERROR) { goto exit; }
+    if (mkdir_with_mode(dst, S_IFDIR | S_IRWXU) != COPY_SUCCESS) { goto exit; }
+
+    status = DIRCACHE_SUCCESS;
+
+exit:
+    free(src);
+    free(dst);
+    return status;
+}
+
+static char* dircache_strip_root(const char* root, size_t* len) {
+    size_t n = strlen(root);
+    while (n > 1 && root[n - 1] == '/') { n--; }
+
+    char* res = strndup(root, n);
+    *len = n;
+    return res;
+}
+
+int dircache_init(dircache_t** p, const char* src_root, const char* dst_root) {
+    if (p == NULL || src_root == NULL || dst_root == NULL) {
+        return DIRCACHE_INVALID_ARGUMENT;
+    }
+
+    dircache_t* c = calloc(1, sizeof(*c));
+    if (c == NULL) { return DIRCACHE_ALLOCATION_FAILURE; }
+
+    int failed = 0;
+
+    c->src_root = dircache_strip_root(src_root, &c->src_len);
+    c->dst_root = dircache_strip_root(dst_root, &c->dst_len);
+    if (c->src_root == NULL || c->dst_root == NULL) { failed = 1; }
+
+    for (size_t i = 0; i < STRIPE_NUM; i++) {
+        pthread_mutex_init(&c->stripes[i].lock, NULL);
+        c->stripes[i].cap = STRIPE_INITIAL_CAPACITY;
+        c->stripes[i].buckets = calloc(STRIPE_INITIAL_CAPACITY,
+                                       sizeof(*c->stripes[i].buckets));
+        if (c->stripes[i].buckets == NULL) { failed = 1; }
+    }
+
+    if (failed) {
+        dircache_destroy(c);
+        return DIRCACHE_ALLOCATION_FAILURE;
+    }
+
+    *p = c;
+    return DIRCACHE_SUCCESS;
+}
+
+void dircache_destroy(dircache_t* c) {
+    if (c == NULL) { return; }
+
+    for (size_t i = 0; i < STRIPE_NUM; i++) {
+        stripe_t* s = &c->stripes[i];
+        for (size_t b = 0; s->buckets != NULL && b < s->cap; b++) {
+            dir_node_t* n = s->buckets[b];
+            while (n != NULL) {
+                dir_node_t* next = n->next;
+                free(n);
+                n = next;
+            }
+        }
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free(c->src_root);
+    free(c->dst_root);
+    free(c);
+}
+
+int dircache_ensure(dircache_t* c, const char* rel_dir, size_t len) {
+    uint64_t hash = dircache_hash(rel_dir, len);
+    if (dircache_lookup(c, rel_dir, len, hash)) { return DIRCACHE_SUCCESS; }
+
+    // Parents first; recursion depth is bounded by the path depth
+    if (len > 0) {
+        size_t parent_len = len;
+        while (parent_len > 0 && rel_dir[parent_len - 1] != '/') { parent_len--; }
+        if (parent_len > 0) { parent_len--; }
+
+        int status = dircache_ensure(c, rel_dir, parent_len);
+        if (status != DIRCACHE_SUCCESS) { return status; }
+    }
+
+    // Two workers racing on the same new directory may both get here;
+    // mkdir_with_mode tolerates EEXIST, so this only costs a syscall
+    struct stat st;
+    int status = dircache_mkdir(c, rel_dir, len, &st);
+    if (status != DIRCACHE_SUCCESS) { return status; }
+
+    return dircache_insert(c, rel_dir, len, hash, &st);
+}
+
+static int dir_node_deeper(const void* a, const void* b) {
+    const dir_node_t* x = *(const dir_node_t* const*)a;
+    const dir_node_t* y = *(const dir_node_t* const*)b;
+
+    if (x->depth != y->depth) { return (x->depth > y->depth) ? -1 : 1; }
+    return 0;
+}
+
+int dircache_finish(dircache_t* c, int preserve) {
+    size_t num = 0;
+    for (size_t i = 0; i < STRIPE_NUM; i++) { num += c->stripes[i].num; }
+
+    dir_node_t** nodes = malloc((num ? num : 1) * sizeof(*nodes));
+    if (nodes == NULL) { return DIRCACHE_ALLOCATION_FAILURE; }
+
+    size_t k = 0;
+    for (size_t i = 0; i < STRIPE_NUM; i++) {
+        stripe_t* s = &c->stripes[i];
+        for (size_t b = 0; b < s->cap; b++) {
+            for (dir_node_t* n = s->buckets[b]; n != NULL; n = n->next) {
+                nodes[k++] = n;
+            }
+        }
+    }
+
+    // Children before parents, so restored mtimes are not bumped again
+    qsort(nodes, num, sizeof(*nodes), dir_node_deeper);
+
+    int status = DIRCACHE_SUCCESS;
+    for (size_t i = 0; i < num; i++) {
+        char* src = dircache_join(c->src_root, c->src_len, nodes[i]->path, nodes[i]->len);
+        char* dst = dircache_join(c->dst_root, c->dst_len, nodes[i]->path, nodes[i]->len);
+
+        if (src == NULL || dst == NULL ||
+            meta_apply_path(src, dst, &nodes[i]->st, preserve) != META_SUCCESS) {
+            status = DIRCACHE_METADATA_FAILURE;
+        }
+
+        free(src);
+        free(dst);
+    }
+
+    free(nodes);
+    return status;
+}
@@ -0,0 +1,32 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stddef.h>
+
+enum {
+    DIRCACHE_SUCCESS = 0,
+    DIRCACHE_FAILURE = -1,
+    DIRCACHE_ALLOCATION_FAILURE = -2,
+    DIRCACHE_INVALID_ARGUMENT = -3,
+    DIRCACHE_MKDIR_FAILURE = -4,
+    DIRCACHE_METADATA_FAILURE = -5
+};
+
+// Concurrent set of destination directories that are known to exist.
+// Used when copying from a file list, where parent directories have to
+// be created on demand instead of by the tree walk.
+typedef struct dircache dircache_t;
+
+int dircache_init(dircache_t** c, const char* src_root, const char* dst_root);
+void dircache_destroy(dircache_t* c);
+
+// Makes sure `rel_dir` (relative to the roots, "" for the root itself)
+// and all its parents exist in the destination. Each directory gets an
+// owner-writable mode and is created at most once.
+int dircache_ensure(dircache_t* c, const char* rel_dir, size_t len);
+
+// Applies the source metadata selected by `preserve` (META_* flags) to
+// every created directory, deepest first. Call once all copies are done.
+int dircache_finish(dircache_t* c, int preserve);
+
+#endif /* DIRCACHE_H */
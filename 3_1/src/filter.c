@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+
+#include "filter.h"
+
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_RULE UINT32_MAX
+
+// Patterns looked up in the hash table, by what the wildcard-free part
+// of the pattern has to match
+enum { KIND_LITERAL, KIND_SUFFIX, KIND_PREFIX, KIND_GENERAL };
+
+typedef struct {
+    int action;
+    int syntax;
+    int dir_only;
+    int kind;
+
+    char* pattern;      // without the trailing '/' of dir_only globs
+    size_t len;         // of the literal part for the table kinds
+    regex_t regex;
+} filter_rule_t;
+
+// The earliest rule for one (kind, string), separately for rules that
+// match anything and rules that only match directories
+typedef struct {
+    const char* key;
+    size_t len;
+    int kind;
+    uint32_t rule_any;
+    uint32_t rule_dir;
+} filter_entry_t;
+
+struct filter {
+    filter_rule_t* rules;
+    size_t rule_num;
+    size_t rule_cap;
+
+    filter_entry_t* table;      // open addressing, NULL key is empty
+    size_t table_mask;
+
+    // Distinct literal lengths of suffix and prefix rules
+    size_t suffix_lens[64];
+    size_t suffix_len_num;
+    size_t prefix_lens[64];
+    size_t prefix_len_num;
+
+    // KIND_GENERAL rules and regexes, in rule order
+    uint32_t* general;
+    size_t general_num;
+};
+
+int filter_init(filter_t** p) {
+    if (p == NULL) { return FILTER_INVALID_ARGUMENT; }
+
+    filter_t* f = calloc(1, sizeof(*f));
+    if (f == NULL) { return FILTER_ALLOCATION_FAILURE; }
+
+    *p = f;
+    return FILTER_SUCCESS;
+}
+
+void filter_destroy(filter_t* f) {
+    if (f == NULL) { return; }
+
+    for (size_t i = 0; i < f->rule_num; i++) {
+        if (f->rules[i].syntax == FILTER_REGEX) { regfree(&f->rules[i].regex); }
+        free(f->rules[i].pattern);
+    }
+
+    free(f->rules);
+    free(f->table);
+    free(f->general);
+    free(f);
+}
+
+static int filter_is_wild(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static int filter_has_wild(const char* s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (filter_is_wild(s[i])) { return 1; }
+    }
+    return 0;
+}
+
+// Picks the cheapest way to match a glob
+static void filter_classify(filter_rule_t* r) {
+    size_t len = strlen(r->pattern);
+    r->kind = KIND_GENERAL;
+    r->len = len;
+
+    if (!filter_has_wild(r->pattern, len)) {
+        r->kind = KIND_LITERAL;
+    } else if (r->pattern[0] == '*' && !filter_has_wild(r->pattern + 1, len - 1)) {
+        r->kind = KIND_SUFFIX;
+        r->len = len - 1;
+    } else if (len > 0 && r->pattern[len - 1] == '*' &&
+               !filter_has_wild(r->pattern, len - 1)) {
+        r->kind = KIND_PREFIX;
+        r->len = len - 1;
+    }
+}
+
+int filter_add(filter_t* f, int action, int syntax, const char* pattern) {
+    if (f == NULL || pattern == NULL || pattern[0] == '\0' ||
+        (action != FILTER_INCLUDE && action != FILTER_EXCLUDE) ||
+        (syntax != FILTER_GLOB && syntax != FILTER_REGEX)) {
+        return FILTER_INVALID_ARGUMENT;
+    }
+
+    if (f->rule_num == f->rule_cap) {
+        size_t cap = (f->rule_cap == 0) ? 8 : 2 * f->rule_cap;
+        filter_rule_t* rules = realloc(f->rules, cap * sizeof(*rules));
+        if (rules == NULL) { return FILTER_ALLOCATION_FAILURE; }
+
+        f->rules = rules;
+        f->rule_cap = cap;
+    }
+
+    filter_rule_t* r = &f->rules[f->rule_num];
+    memset(r, 0, sizeof(*r));
+    r->action = action;
+    r->syntax = syntax;
+
+    r->pattern = strdup(pattern);
+    if (r->pattern == NULL) { return FILTER_ALLOCATION_FAILURE; }
+
+    if (syntax == FILTER_REGEX) {
+        r->kind = KIND_GENERAL;
+        if (regcomp(&r->regex, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            free(r->pattern);
+            return FILTER_BAD_PATTERN;
+        }
+    } else {
+        size_t len = strlen(r->pattern);
+        if (r->pattern[len - 1] == '/') {
+            r->dir_only = 1;
+            r->pattern[--len] = '\0';
+        }
+        // Names never contain '/', so such a glob could never match
+        if (len == 0 || strchr(r->pattern, '/') != NULL) {
+            free(r->pattern);
+            return FILTER_BAD_PATTERN;
+        }
+        filter_classify(r);
+    }
+
+    f->rule_num++;
+    return FILTER_SUCCESS;
+}
+
+// FNV-1a over the kind and the key
+static uint64_t filter_hash(int kind, const char* key, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    h = (h ^ (uint64_t)kind) * 1099511628211ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static const filter_entry_t* filter_lookup(const filter_t* f, int kind,
+                                           const char* key, size_t len) {
+    if (f->table == NULL) { return NULL; }
+
+    size_t i = (size_t)filter_hash(kind, key, len) & f->table_mask;
+    while (f->table[i].key != NULL) {
+        const filter_entry_t* e = &f->table[i];
+        if (e->kind == kind && e->len == len && memcmp(e->key, key, len) == 0) { return e; }
+        i = (i + 1) & f->table_mask;
+    }
+    return NULL;
+}
+
+static void filter_insert(filter_t* f, uint32_t idx) {
+    const filter_rule_t* r = &f->rules[idx];
+    const char* key = (r->kind == KIND_SUFFIX) ? r->pattern + 1 : r->pattern;
+
+    size_t i = (size_t)filter_hash(r->kind, key, r->len) & f->table_mask;
+    while (f->table[i].key != NULL) {
+        filter_entry_t* e = &f->table[i];
+        if (e->kind == r->kind && e->len == r->len && memcmp(e->key, key, r->len) == 0) { break; }
+        i = (i + 1) & f->table_mask;
+    }
+
+    filter_entry_t* e = &f->table[i];
+    if (e->key == NULL) {
+        e->key = key;
+        e->len = r->len;
+        e->kind = r->kind;
+        e->rule_any = NO_RULE;
+        e->rule_dir = NO_RULE;
+    }
+
+    // Rules are inserted in order, so the first one of each sticks
+    uint32_t* slot = r->dir_only ? &e->rule_dir : &e->rule_any;
+    if (*slot == NO_RULE) { *slot = idx; }
+}
+
+static int filter_add_len(size_t* lens, size_t* num, size_t len) {
+    for (size_t i = 0; i < *num; i++) {
+        if (lens[i] == len) { return FILTER_SUCCESS; }
+    }
+    if (*num == 64) { return FILTER_FAILURE; }
+
+    lens[(*num)++] = len;
+    return FILTER_SUCCESS;
+}
+
+int filter_compile(filter_t* f) {
+    if (f == NULL) { return FILTER_INVALID_ARGUMENT; }
+
+    size_t table_size = 8;
+    while (table_size < 2 * f->rule_num) { table_size *= 2; }
+
+    f->table = calloc(table_size, sizeof(*f->table));
+    f->general = malloc((f->rule_num + 1) * sizeof(*f->general));
+    if (f->table == NULL || f->general == NULL) { return FILTER_ALLOCATION_FAILURE; }
+    f->table_mask = table_size - 1;
+
+    for (uint32_t i = 0; i < f->rule_num; i++) {
+        filter_rule_t* r = &f->rules[i];
+
+        // More distinct lengths than there is room for are matched the
+        // slow way
+        if (r->kind == KIND_SUFFIX &&
+            filter_add_len(f->suffix_lens, &f->suffix_len_num, r->len) != FILTER_SUCCESS) {
+            r->kind = KIND_GENERAL;
+        }
+        if (r->kind == KIND_PREFIX &&
+            filter_add_len(f->prefix_lens, &f->prefix_len_num, r->len) != FILTER_SUCCESS) {
+            r->kind = KIND_GENERAL;
+        }
+
+        if (r->kind == KIND_GENERAL) {
+            f->general[f->general_num++] = i;
+        } else {
+            filter_insert(f, i);
+        }
+    }
+
+    return FILTER_SUCCESS;
+}
+
+static uint32_t filter_pick(const filter_entry_t* e, int is_dir, uint32_t best) {
+    if (e == NULL) { return best; }
+
+    if (e->rule_any < best) { best = e->rule_any; }
+    if (is_dir && e->rule_dir < best) { best = e->rule_dir; }
+    return best;
+}
+
+static int filter_rule_matches(const filter_rule_t* r, const char* name, int is_dir) {
+    if (r->dir_only && !is_dir) { return 0; }
+
+    if (r->syntax == FILTER_REGEX) { return regexec(&r->regex, name, 0, NULL, 0) == 0; }
+    return fnmatch(r->pattern, name, 0) == 0;
+}
+
+int filter_match(const filter_t* f, const char* name, int is_dir) {
+    if (f == NULL || f->rule_num == 0) { return FILTER_INCLUDE; }
+
+    size_t len = strlen(name);
+    uint32_t best = NO_RULE;
+
+    best = filter_pick(filter_lookup(f, KIND_LITERAL, name, len), is_dir, best);
+
+    for (size_t i = 0; i < f->suffix_len_num; i++) {
+        size_t l = f->suffix_lens[i];
+        if (l > len) { continue; }
+        best = filter_pick(filter_lookup(f, KIND_SUFFIX, name + len - l, l), is_dir, best);
+    }
+
+    for (size_t i = 0; i < f->prefix_len_num; i++) {
+        size_t l = f->prefix_lens[i];
+        if (l > len) { continue; }
+        best = filter_pick(filter_lookup(f, KIND_PREFIX, name, l), is_dir, best);
+    }
+
+    // Only rules ordered before the best table hit can still change it
+    for (size_t i = 0; i < f->general_num && f->general[i] < best; i++) {
+        if (filter_rule_matches(&f->rules[f->general[i]], name, is_dir)) {
+            best = f->general[i];
+            break;
+        }
+    }
+
+    return (best == NO_RULE) ? FILTER_INCLUDE : f->rules[best].action;
+}
@@ -0,0 +1,43 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+enum {
+    FILTER_SUCCESS = 0,
+    FILTER_FAILURE = -1,
+    FILTER_ALLOCATION_FAILURE = -2,
+    FILTER_INVALID_ARGUMENT = -3,
+    FILTER_BAD_PATTERN = -4
+};
+
+enum { FILTER_INCLUDE, FILTER_EXCLUDE };
+enum { FILTER_GLOB, FILTER_REGEX };
+
+// Ordered include/exclude rules over single names (a d_name, not a
+// path). The first rule that matches decides; a name no rule matches
+// is included. A glob ending in '/' only matches directories, so
+//   --include='*/' --include='*.c' --exclude='*'
+// copies the C files of the whole tree.
+//
+// filter_compile sorts the globs into hash tables: plain names ("build",
+// ".git"), suffixes ("*.o") and prefixes ("tmp*") take one lookup per
+// distinct length, whatever the number of rules. Other globs go through
+// fnmatch and regexes (POSIX extended, unanchored) through regexec, and
+// only those ordered before the best hit so far are tried.
+typedef struct filter filter_t;
+
+int filter_init(filter_t** f);
+void filter_destroy(filter_t* f);
+
+// Rules are matched in the order they are added
+int filter_add(filter_t* f, int action, int syntax, const char* pattern);
+
+// Builds the matcher; call once after the last filter_add
+int filter_compile(filter_t* f);
+
+// FILTER_INCLUDE or FILTER_EXCLUDE for an entry called `name`.
+// Thread-safe once compiled.
+int filter_match(const filter_t* f, const char* name, int is_dir);
+
+#endif /* FILTER_H */
@@ -0,0 +1,178 @@
+#include "hist.h"
+
+#ifdef CP_SYSCALL_HIST
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Log-linear buckets as in HdrHistogram: every power of two is split
+// into HIST_SUB_BUCKETS linear sub-buckets, which bounds the relative
+// error of a reported percentile by 1/HIST_SUB_BUCKETS
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 42     // ~73 minutes in ns, longer values are clamped
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct hist_thread {
+    struct hist_thread* next;
+    hist_t ops[HIST_NUM];
+} hist_thread_t;
+
+static const char* const hist_names[HIST_NUM] = {
+    [HIST_OPEN]      = "open",
+    [HIST_CLOSE]     = "close",
+    [HIST_READ]      = "read",
+    [HIST_WRITE]     = "write",
+    [HIST_LSTAT]     = "lstat",
+    [HIST_MKDIR]     = "mkdir",
+    [HIST_CHMOD]     = "chmod",
+    [HIST_CHOWN]     = "chown",
+    [HIST_UTIMENS]   = "utimens",
+    [HIST_XATTR]     = "xattr",
+    [HIST_UNLINK]    = "unlink",
+    [HIST_FDATASYNC] = "fdatasync",
+    [HIST_OPENDIR]   = "opendir",
+    [HIST_READDIR]   = "readdir",
+    [HIST_CLONE]     = "clone",
+};
+
+int hist_enabled = 0;
+
+static _Atomic(hist_thread_t*) hist_threads = NULL;
+static _Thread_local hist_thread_t* hist_local = NULL;
+
+
+static inline uint64_t hist_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t hist_index(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) { return (size_t)v; }
+
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > HIST_MAX_EXP) { return HIST_BUCKETS - 1; }
+
+    size_t sub = (size_t)(v >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (size_t)(exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// Lowest value that falls into bucket `i`
+static inline uint64_t hist_value(size_t i) {
+    if (i < HIST_SUB_BUCKETS) { return i; }
+
+    int exp = (int)(i / HIST_SUB_BUCKETS) + HIST_SUB_BITS - 1;
+    uint64_t sub = i % HIST_SUB_BUCKETS;
+    return (1ull << exp) | (sub << (exp - HIST_SUB_BITS));
+}
+
+static hist_thread_t* hist_get_thread(void) {
+    if (hist_local != NULL) { return hist_local; }
+
+    hist_thread_t* h = calloc(1, sizeof(*h));
+    if (h == NULL) { return NULL; }
+
+    h->next = atomic_load(&hist_threads);
+    while (!atomic_compare_exchange_weak(&hist_threads, &h->next, h)) {}
+
+    hist_local = h;
+    return h;
+}
+
+void hist_enable(void) {
+    hist_enabled = 1;
+}
+
+uint64_t hist_begin(void) {
+    return hist_enabled ? hist_now() : 0;
+}
+
+void hist_end(int op, uint64_t start) {
+    if (start == 0) { return; }
+
+    uint64_t v = hist_now() - start;
+
+    hist_thread_t* h = hist_get_thread();
+    if (h == NULL) { return; }
+
+    hist_t* hist = &h->ops[op];
+    hist->count++;
+    hist->sum += v;
+    if (v > hist->max) { hist->max = v; }
+    hist->buckets[hist_index(v)]++;
+}
+
+void* hist_thread_self(void) {
+    return hist_enabled ? hist_get_thread() : NULL;
+}
+
+void hist_thread_adopt(void* h) {
+    if (h != NULL) { hist_local = h; }
+}
+
+static uint64_t hist_percentile(const hist_t* h, double p) {
+    uint64_t rank = (uint64_t)(p * (double)h->count);
+    if (rank >= h->count) { rank = h->count - 1; }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) { return hist_value(i); }
+    }
+    return h->max;
+}
+
+static void hist_print_ns(FILE* out, uint64_t ns) {
+    if (ns < 10000) {
+        fprintf(out, " %8lluns", (unsigned long long)ns);
+    } else if (ns < 10000000) {
+        fprintf(out, " %8.1fus", (double)ns / 1e3);
+    } else {
+        fprintf(out, " %8.1fms", (double)ns / 1e6);
+    }
+}
+
+void hist_report(FILE* out) {
+    static hist_t merged[HIST_NUM];
+    memset(merged, 0, sizeof(merged));
+
+    for (hist_thread_t* h = atomic_load(&hist_threads); h != NULL; h = h->next) {
+        for (int op = 0; op < HIST_NUM; op++) {
+            hist_t* m = &merged[op];
+            m->count += h->ops[op].count;
+            m->sum += h->ops[op].sum;
+            if (h->ops[op].max > m->max) { m->max = h->ops[op].max; }
+            for (size_t i = 0; i < HIST_BUCKETS; i++) {
+                m->buckets[i] += h->ops[op].buckets[i];
+            }
+        }
+    }
+
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s\n",
+            "syscall", "count", "mean", "p50", "p99", "p999", "max");
+
+    for (int op = 0; op < HIST_NUM; op++) {
+        const hist_t* m = &merged[op];
+        if (m->count == 0) { continue; }
+
+        fprintf(out, "%-10s %10llu", hist_names[op], (unsigned long long)m->count);
+        hist_print_ns(out, m->sum / m->count);
+        hist_print_ns(out, hist_percentile(m, 0.50));
+        hist_print_ns(out, hist_percentile(m, 0.99));
+        hist_print_ns(out, hist_percentile(m, 0.999));
+        hist_print_ns(out, m->max);
+        fputc('\n', out);
+    }
+}
+
+#endif /* CP_SYSCALL_HIST */
@@ -0,0 +1,68 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Syscalls timed on the copy hot path
+enum {
+    HIST_OPEN,
+    HIST_CLOSE,
+    HIST_READ,
+    HIST_WRITE,
+    HIST_LSTAT,
+    HIST_MKDIR,
+    HIST_CHMOD,
+    HIST_CHOWN,
+    HIST_UTIMENS,
+    HIST_XATTR,
+    HIST_UNLINK,
+    HIST_FDATASYNC,
+    HIST_OPENDIR,
+    HIST_READDIR,
+    HIST_CLONE,
+
+    HIST_NUM
+};
+
+// Latency histograms are only compiled in with meson
+// -Dsyscall_histograms=true; otherwise HIST_BEGIN/HIST_END expand to
+// nothing. When compiled in, recording is still off until hist_enable.
+#ifdef CP_SYSCALL_HIST
+
+extern int hist_enabled;
+
+void hist_enable(void);
+
+// Returns a start timestamp, or 0 when recording is disabled
+uint64_t hist_begin(void);
+
+// Records the time since `start` into the calling thread's histogram
+void hist_end(int op, uint64_t start);
+
+// The calling thread's histograms, NULL while recording is disabled.
+// A short-lived helper thread adopts those of the thread that started
+// it, instead of allocating a block of its own that would stay until
+// exit. The two must not time the same syscall at the same time.
+void* hist_thread_self(void);
+void hist_thread_adopt(void* h);
+
+// Merges all per-thread histograms and prints a table of percentiles.
+// Must be called once the recording threads are done.
+void hist_report(FILE* out);
+
+#define HIST_BEGIN(t) uint64_t t = hist_begin()
+#define HIST_END(op, t) hist_end((op), (t))
+#define HIST_SELF() hist_thread_self()
+#define HIST_ADOPT(h) hist_thread_adopt(h)
+
+#else
+
+#define HIST_BEGIN(t) (void)0
+#define HIST_END(op, t) (void)0
+#define HIST_SELF() NULL
+#define HIST_ADOPT(h) (void)(h)
+
+#endif /* CP_SYSCALL_HIST */
+
+#endif /* HIST_H */
@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERROR -1
+#define SUCCESS 0
+
+#define JOURNAL_MAGIC "CPJRNL1\n"
+#define JOURNAL_MAGIC_LEN 8
+
+#define DEFAULT_BATCH_SIZE (64 * 1024)
+#define MIN_BATCH_SIZE (2 * (sizeof(record_hdr_t) + PATH_MAX))
+
+// Pending records are flushed at least this often even if the batch
+// is not full, so that a slow run does not lose much progress
+#define FLUSH_INTERVAL_SEC 1
+
+#define INDEX_INITIAL_CAPACITY 1024
+
+enum {
+    RECORD_ROOTS = 1,
+    RECORD_DONE = 2,
+    RECORD_CHUNK = 3
+};
+
+// On-disk record header, followed by `path_len` bytes of path.
+// The checksum covers everything after itself, so a torn write at the
+// end of the journal is detected and the tail is dropped on replay.
+typedef struct {
+    uint32_t checksum;
+    uint16_t type;
+    uint16_t path_len;
+    uint64_t offset;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+} record_hdr_t;
+
+typedef struct {
+    const char* path;   // points into replay buffer, not NUL-terminated
+    size_t path_len;
+    uint64_t hash;
+
+    int type;
+    off_t offset;
+    off_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} index_entry_t;
+
+struct journal {
+    int fd;
+    char* path;
+
+    // Replayed state, read-only once journal_open returns
+    char* replay_buf;
+    index_entry_t* index;
+    size_t index_cap;
+    size_t index_num;
+
+    // Batched appends: records go to `buf`, which is swapped with
+    // `spare` and written out by whichever thread fills it up
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+
+    char* buf;
+    char* spare;
+    size_t len;
+    size_t cap;
+
+    int flushing;
+    int error;
+    time_t last_flush;
+
+    // Copy of conf->sync_path, or NULL; `done` is set while `buf`
+    // holds a DONE record
+    char* sync_path;
+    int done;
+};
+
+
+static uint32_t journal_checksum(const void* data, size_t len, uint32_t h) {
+    const uint8_t* p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint64_t journal_hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static inline uint32_t record_checksum(const record_hdr_t* hdr, const char* path) {
+    uint32_t h = journal_checksum((const char*)hdr + sizeof(hdr->checksum),
+                                  sizeof(*hdr) - sizeof(hdr->checksum),
+                                  2166136261u);
+    return journal_checksum(path, hdr->path_len, h);
+}
+
+static inline time_t journal_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == ERROR && errno == EINTR) { continue; }
+        if (n == ERROR) { return JOURNAL_IO_FAILURE; }
+
+        buf += n;
+        len -= (size_t)n;
+    }
+    return JOURNAL_SUCCESS;
+}
+
+static index_entry_t* index_find(const journal_t* j, const char* path,
+                                 size_t len, uint64_t hash) {
+    if (j->index_cap == 0) { return NULL; }
+
+    size_t mask = j->index_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        index_entry_t* e = &j->index[i];
+        if (e->path == NULL) { return e; }
+        if (e->hash == hash && e->path_len == len &&
+            memcmp(e->path, path, len) == 0) {
+            return e;
+        }
+    }
+}
+
+static int index_grow(journal_t* j) {
+    size_t cap = j->index_cap ? j->index_cap * 2 : INDEX_INITIAL_CAPACITY;
+    index_entry_t* old = j->index;
+    size_t old_cap = j->index_cap;
+
+    j->index = calloc(cap, sizeof(*j->index));
+    if (j->index == NULL) {
+        j->index = old;
+        return JOURNAL_ALLOCATION_FAILURE;
+    }
+    j->index_cap = cap;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].path == NULL) { continue; }
+        *index_find(j, old[i].path, old[i].path_len, old[i].hash) = old[i];
+    }
+
+    free(old);
+    return JOURNAL_SUCCESS;
+}
+
+static int index_put(journal_t* j, const record_hdr_t* hdr, const char* path) {
+    if ((j->index_num + 1) * 10 > j->index_cap * 7) {
+        int status = index_grow(j);
+        if (status != JOURNAL_SUCCESS) { return status; }
+    }
+
+    uint64_t hash = journal_hash(path, hdr->path_len);
+    index_entry_t* e = index_find(j, path, hdr->path_len, hash);
+    if (e->path == NULL) {
+        j->index_num++;
+    } else if (e->type == RECORD_DONE && hdr->type == RECORD_CHUNK) {
+        // A late chunk record must not downgrade a completed file
+        return JOURNAL_SUCCESS;
+    }
+
+    e->path = path;
+    e->path_len = hdr->path_len;
+    e->hash = hash;
+    e->type = hdr->type;
+    e->offset = (off_t)hdr->offset;
+    e->size = (off_t)hdr->size;
+    e->mtime_sec = hdr->mtime_sec;
+    e->mtime_nsec = hdr->mtime_nsec;
+
+    return JOURNAL_SUCCESS;
+}
+
+static int roots_match(const record_hdr_t* hdr, const char* path,
+                       const journal_conf_t* conf) {
+    size_t src_len = strlen(conf->src_root);
+    size_t dst_len = strlen(conf->dst_root);
+
+    return hdr->type == RECORD_ROOTS &&
+           hdr->path_len == src_len + 1 + dst_len &&
+           memcmp(path, conf->src_root, src_len) == 0 &&
+           path[src_len] == '\0' &&
+           memcmp(path + src_len + 1, conf->dst_root, dst_len) == 0;
+}
+
+// Reads the whole journal, builds the index and returns the length of
+// the valid prefix in `valid_len`. Anything after it is a torn tail.
+static int journal_replay(journal_t* j, const journal_conf_t* conf,
+                          size_t* valid_len) {
+    struct stat st;
+    if (fstat(j->fd, &st) == ERROR) { return JOURNAL_IO_FAILURE; }
+
+    *valid_len = 0;
+    size_t size = (size_t)st.st_size;
+    if (size == 0) { return JOURNAL_SUCCESS; }
+
+    j->replay_buf = malloc(size);
+    if (j->replay_buf == NULL) { return JOURNAL_ALLOCATION_FAILURE; }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(j->fd, j->replay_buf + done, size - done, (off_t)done);
+        if (n == ERROR && errno == EINTR) { continue; }
+        if (n == ERROR) { return JOURNAL_IO_FAILURE; }
+        if (n == 0) { break; }
+        done += (size_t)n;
+    }
+    size = done;
+
+    // A short file may be a journal torn in its first write; anything
+    // else is somebody's data, given as the journal by mistake
+    size_t magic_len = (size < JOURNAL_MAGIC_LEN) ? size : JOURNAL_MAGIC_LEN;
+    if (memcmp(j->replay_buf, JOURNAL_MAGIC, magic_len) != 0) {
+        return JOURNAL_NOT_A_JOURNAL;
+    }
+    if (size < JOURNAL_MAGIC_LEN) { return JOURNAL_SUCCESS; }
+
+    size_t pos = JOURNAL_MAGIC_LEN;
+    int first = 1;
+
+    while (pos + sizeof(record_hdr_t) <= size) {
+        record_hdr_t hdr;
+        memcpy(&hdr, j->replay_buf + pos, sizeof(hdr));
+
+        const char* path = j->replay_buf + pos + sizeof(hdr);
+        if (pos + sizeof(hdr) + hdr.path_len > size) { break; }
+        if (record_checksum(&hdr, path) != hdr.checksum) { break; }
+
+        if (first) {
+            if (!roots_match(&hdr, path, conf)) { return JOURNAL_ROOT_MISMATCH; }
+            first = 0;
+        } else if (hdr.type == RECORD_DONE || hdr.type == RECORD_CHUNK) {
+            int status = index_put(j, &hdr, path);
+            if (status != JOURNAL_SUCCESS) { return status; }
+        }
+
+        pos += sizeof(hdr) + hdr.path_len;
+        *valid_len = pos;
+    }
+
+    return JOURNAL_SUCCESS;
+}
+
+static void journal_fill_record(record_hdr_t* hdr, int type, size_t path_len,
+                                const struct stat* st, off_t offset) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = (uint16_t)type;
+    hdr->path_len = (uint16_t)path_len;
+    hdr->offset = (uint64_t)offset;
+
+    if (st != NULL) {
+        hdr->size = (uint64_t)st->st_size;
+        hdr->mtime_sec = st->st_mtim.tv_sec;
+        hdr->mtime_nsec = st->st_mtim.tv_nsec;
+    }
+}
+
+// Makes the data of the files a batch records as done durable before
+// the batch is
+static int journal_sync_data(const journal_t* j) {
+    int fd = open(j->sync_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == ERROR) { return JOURNAL_IO_FAILURE; }
+
+    int err = syncfs(fd);
+    close(fd);
+    return (err == ERROR) ? JOURNAL_IO_FAILURE : JOURNAL_SUCCESS;
+}
+
+// Must be called with the lock held; drops it while writing
+static int journal_flush_locked(journal_t* j) {
+    while (j->flushing) {
+        pthread_cond_wait(&j->flushed, &j->lock);
+    }
+
+    if (j->len == 0) { return j->error; }
+
+    char* full = j->buf;
+    size_t len = j->len;
+    int sync = j->done && j->sync_path != NULL;
+
+    j->buf = j->spare;
+    j->spare = full;
+    j->len = 0;
+    j->done = 0;
+    j->flushing = 1;
+    j->last_flush = journal_now();
+
+    pthread_mutex_unlock(&j->lock);
+
+    int status = sync ? journal_sync_data(j) : JOURNAL_SUCCESS;
+    if (status == JOURNAL_SUCCESS) { status = write_all(j->fd, full, len); }
+    if (status == JOURNAL_SUCCESS && fdatasync(j->fd) == ERROR) {
+        status = JOURNAL_IO_FAILURE;
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    if (status != JOURNAL_SUCCESS) { j->error = status; }
+    j->flushing = 0;
+    pthread_cond_broadcast(&j->flushed);
+
+    return j->error;
+}
+
+static int journal_append(journal_t* j, int type, const char* path,
+                          size_t path_len, const struct stat* st, off_t offset,
+                          int sync) {
+    if (j == NULL || path == NULL) { return JOURNAL_INVALID_ARGUMENT; }
+    if (path_len > UINT16_MAX) { return JOURNAL_INVALID_ARGUMENT; }
+
+    record_hdr_t hdr;
+    journal_fill_record(&hdr, type, path_len, st, offset);
+    hdr.checksum = record_checksum(&hdr, path);
+
+    // Flushing could never make room for it
+    size_t rec_len = sizeof(hdr) + path_len;
+    if (rec_len > j->cap) { return JOURNAL_INVALID_ARGUMENT; }
+
+    pthread_mutex_lock(&j->lock);
+
+    while (j->len + rec_len > j->cap) {
+        journal_flush_locked(j);
+    }
+
+    memcpy(j->buf + j->len, &hdr, sizeof(hdr));
+    memcpy(j->buf + j->len + sizeof(hdr), path, path_len);
+    j->len += rec_len;
+    if (type == RECORD_DONE) { j->done = 1; }
+
+    if (sync || journal_now() - j->last_flush >= FLUSH_INTERVAL_SEC) {
+        journal_flush_locked(j);
+    }
+
+    int status = j->error;
+    pthread_mutex_unlock(&j->lock);
+
+    return status;
+}
+
+static void journal_free(journal_t* j) {
+    if (j->fd != ERROR) { close(j->fd); }
+
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->flushed);
+
+    free(j->path);
+    free(j->sync_path);
+    free(j->replay_buf);
+    free(j->index);
+    free(j->buf);
+    free(j->spare);
+    free(j);
+}
+
+int journal_open(journal_t** p, const journal_conf_t* conf) {
+    if (p == NULL || conf == NULL || conf->path == NULL ||
+        conf->src_root == NULL || conf->dst_root == NULL) {
+        return JOURNAL_INVALID_ARGUMENT;
+    }
+
+    size_t roots_len = strlen(conf->src_root) + 1 + strlen(conf->dst_root);
+    if (roots_len > UINT16_MAX) { return JOURNAL_INVALID_ARGUMENT; }
+
+    journal_t* j = calloc(1, sizeof(*j));
+    if (j == NULL) { return JOURNAL_ALLOCATION_FAILURE; }
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->flushed, NULL);
+
+    j->cap = conf->batch_size ? conf->batch_size : DEFAULT_BATCH_SIZE;
+    if (j->cap < MIN_BATCH_SIZE) { j->cap = MIN_BATCH_SIZE; }
+
+    // The first batch holds the header, whatever the length of the roots
+    size_t head_len = JOURNAL_MAGIC_LEN + sizeof(record_hdr_t) + roots_len;
+    if (j->cap < head_len) { j->cap = head_len; }
+
+    j->path = strdup(conf->path);
+    j->sync_path = (conf->sync_path != NULL) ? strdup(conf->sync_path) : NULL;
+    j->buf = malloc(j->cap);
+    j->spare = malloc(j->cap);
+    if (j->path == NULL || j->buf == NULL || j->spare == NULL ||
+        (conf->sync_path != NULL && j->sync_path == NULL)) {
+        j->fd = ERROR;
+        journal_free(j);
+        return JOURNAL_ALLOCATION_FAILURE;
+    }
+
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (conf->resume ? 0 : O_TRUNC);
+    j->fd = open(conf->path, flags, S_IRUSR | S_IWUSR);
+    if (j->fd == ERROR) {
+        journal_free(j);
+        return JOURNAL_IO_FAILURE;
+    }
+
+    size_t valid_len = 0;
+    if (conf->resume) {
+        int status = journal_replay(j, conf, &valid_len);
+        if (status != JOURNAL_SUCCESS) {
+            journal_free(j);
+            return status;
+        }
+    }
+
+    // Cut off a torn tail so new records are appended after valid ones
+    if (ftruncate(j->fd, (off_t)valid_len) == ERROR ||
+        lseek(j->fd, (off_t)valid_len, SEEK_SET) == ERROR) {
+        journal_free(j);
+        return JOURNAL_IO_FAILURE;
+    }
+
+    if (valid_len == 0) {
+        char* roots = malloc(roots_len);
+        if (roots == NULL) {
+            journal_free(j);
+            return JOURNAL_ALLOCATION_FAILURE;
+        }
+
+        size_t src_len = strlen(conf->src_root);
+        memcpy(roots, conf->src_root, src_len + 1);
+        memcpy(roots + src_len + 1, conf->dst_root, roots_len - src_len - 1);
+
+        record_hdr_t hdr;
+        journal_fill_record(&hdr, RECORD_ROOTS, roots_len, NULL, 0);
+        hdr.checksum = record_checksum(&hdr, roots);
+
+        memcpy(j->buf, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+        memcpy(j->buf + JOURNAL_MAGIC_LEN, &hdr, sizeof(hdr));
+        memcpy(j->buf + JOURNAL_MAGIC_LEN + sizeof(hdr), roots, roots_len);
+        j->len = head_len;
+
+        free(roots);
+    }
+
+    j->last_flush = journal_now();
+
+    *p = j;
+    return JOURNAL_SUCCESS;
+}
+
+int journal_close(journal_t* j, int remove) {
+    if (j == NULL) { return JOURNAL_INVALID_ARGUMENT; }
+
+    pthread_mutex_lock(&j->lock);
+    int status = journal_flush_locked(j);
+    pthread_mutex_unlock(&j->lock);
+
+    if (status == JOURNAL_SUCCESS && remove) {
+        unlink(j->path);
+    }
+
+    journal_free(j);
+    return status;
+}
+
+int journal_file_done(journal_t* j, const char* path, const struct stat* st) {
+    return journal_append(j, RECORD_DONE, path, strlen(path), st, 0, 0);
+}
+
+int journal_file_chunk(journal_t* j, const char* path,
+                       const struct stat* st, off_t offset) {
+    // Chunks are rare and already paid for an fdatasync of the data,
+    // so their records are made durable right away
+    return journal_append(j, RECORD_CHUNK, path, strlen(path), st, offset, 1);
+}
+
+int journal_lookup(const journal_t* j, const char* path,
+                   const struct stat* st, off_t* offset) {
+    if (j == NULL || j->index_num == 0) { return JOURNAL_UNKNOWN; }
+
+    size_t len = strlen(path);
+    const index_entry_t* e = index_find(j, path, len, journal_hash(path, len));
+    if (e == NULL || e->path == NULL) { return JOURNAL_UNKNOWN; }
+
+    if (e->size != st->st_size ||
+        e->mtime_sec != st->st_mtim.tv_sec ||
+        e->mtime_nsec != st->st_mtim.tv_nsec) {
+        return JOURNAL_UNKNOWN;
+    }
+
+    if (e->type == RECORD_DONE) { return JOURNAL_DONE; }
+
+    if (offset != NULL) { *offset = e->offset; }
+    return JOURNAL_PARTIAL;
+}
@@ -0,0 +1,69 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum {
+    JOURNAL_SUCCESS = 0,
+    JOURNAL_FAILURE = -1,
+    JOURNAL_ALLOCATION_FAILURE = -2,
+    JOURNAL_INVALID_ARGUMENT = -3,
+    JOURNAL_IO_FAILURE = -4,
+    JOURNAL_ROOT_MISMATCH = -5,
+    JOURNAL_NOT_A_JOURNAL = -6
+};
+
+// Result of journal_lookup
+enum {
+    JOURNAL_UNKNOWN = 0,
+    JOURNAL_DONE = 1,
+    JOURNAL_PARTIAL = 2
+};
+
+typedef struct journal journal_t;
+
+typedef struct {
+    const char* path;
+    const char* src_root;
+    const char* dst_root;
+
+    // Replay an existing journal instead of starting a new one. A
+    // non-empty file that is not a journal is refused with
+    // JOURNAL_NOT_A_JOURNAL rather than overwritten.
+    int resume;
+
+    // If set, the filesystem holding this path is synced (syncfs)
+    // before a batch that records files as done is written, so that
+    // after a crash no record vouches for data that was lost. NULL if
+    // the caller makes files durable before journaling them.
+    const char* sync_path;
+
+    // Records are buffered in memory and written with a single
+    // write + fdatasync once this many bytes are pending (0 = default)
+    size_t batch_size;
+} journal_conf_t;
+
+int journal_open(journal_t** j, const journal_conf_t* conf);
+
+// Flushes pending records and closes the journal.
+// With `remove` set the journal file is unlinked afterwards.
+int journal_close(journal_t* j, int remove);
+
+// Records that `path` was copied completely from a source file with
+// the size and mtime given in `st`
+int journal_file_done(journal_t* j, const char* path, const struct stat* st);
+
+// Records that the first `offset` bytes of `path` are durable in the
+// destination. Caller must fdatasync the destination file beforehand.
+int journal_file_chunk(journal_t* j, const char* path,
+                       const struct stat* st, off_t offset);
+
+// Looks `path` up in the replayed journal. Entries whose source size or
+// mtime differ from `st` are reported as JOURNAL_UNKNOWN.
+// For JOURNAL_PARTIAL the durable offset is stored into `offset`.
+int journal_lookup(const journal_t* j, const char* path,
+                   const struct stat* st, off_t* offset);
+
+#endif /* JOURNAL_H */
@@ -1,36 +1,338 @@
 #include "log.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
-static inline size_t log_append_time(char* str, size_t size) {
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
+// Every logging thread owns a single-producer ring that a background
+// flusher drains with writev, so workers never share a lock or block on
+// stderr. When a ring is full the message is dropped and counted. The
+// ring of a thread that exits is orphaned, and freed by the flusher
+// once it has written out what is left in it.
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_LINE_MAX 1024
+#define LOG_FLUSH_INTERVAL_NS (50 * 1000 * 1000)
+#define LOG_IOV_MAX 64
 
-    size_t len = strftime(str, size, "%H:%M:%S ", tm);
+#define CACHE_LINE 64
+
+typedef struct log_ring {
+    struct log_ring* next;
+
+    _Alignas(CACHE_LINE) atomic_size_t head;   // advanced by the owner
+    _Alignas(CACHE_LINE) atomic_size_t tail;   // advanced by the flusher
+
+    atomic_int orphaned;    // set once the owner is gone
+
+    char data[LOG_RING_SIZE];
+} log_ring_t;
+
+static _Atomic(log_ring_t*) log_rings = NULL;
+static atomic_size_t log_dropped = 0;
+
+static const struct {
+    const char* name;
+    const char* tag;
+} log_level_names[] = {
+    [LOG_LEVEL_ERROR] = { "error", "ERROR" },
+    [LOG_LEVEL_WARN]  = { "warn",  "WARN " },
+    [LOG_LEVEL_INFO]  = { "info",  "INFO " },
+    [LOG_LEVEL_DEBUG] = { "debug", "DEBUG" },
+};
+
+int log_level = LOG_LEVEL_INFO;
+static int log_format = LOG_FORMAT_TEXT;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static pthread_t log_flusher;
+static atomic_int log_flusher_started = 0;
+static atomic_int log_stop = 0;
+
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+// Serializes draining between the flusher and log_flush callers
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local log_ring_t* log_local_ring = NULL;
+static _Thread_local time_t log_cached_sec = -1;
+static _Thread_local char log_cached_time[16];
+static _Thread_local size_t log_cached_time_len = 0;
+
+
+static void log_write_all(struct iovec* iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(STDERR_FILENO, iov, cnt);
+        if (n < 0) { return; }
+
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+// Unlinks and frees rings whose thread has exited and whose lines have
+// all been written. Only the drainer unlinks, while threads may push new
+// rings onto the head at any time: the head is swapped with a CAS, any
+// other ring is cut out of its predecessor, which no push touches.
+// Called with log_drain_lock held.
+static void log_reap(void) {
+    log_ring_t* prev = NULL;
+    log_ring_t* r = atomic_load_explicit(&log_rings, memory_order_acquire);
+
+    while (r != NULL) {
+        log_ring_t* next = r->next;
+
+        // The owner pushed its last line before orphaning the ring
+        int done = atomic_load_explicit(&r->orphaned, memory_order_acquire) &&
+                   atomic_load_explicit(&r->head, memory_order_relaxed) ==
+                   atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        // A failed CAS overwrites the expected value with the new head
+        log_ring_t* expected = r;
+        if (done && prev != NULL) {
+            prev->next = next;
+            free(r);
+        } else if (done && atomic_compare_exchange_strong(&log_rings, &expected, next)) {
+            free(r);
+        } else {
+            // Kept, or a new ring took the head: left for the next drain
+            prev = r;
+        }
+        r = next;
+    }
+}
+
+static void log_drain(void) {
+    struct iovec iov[LOG_IOV_MAX];
+    log_ring_t* owners[LOG_IOV_MAX];
+    size_t heads[LOG_IOV_MAX];
+    int cnt = 0;
+
+    pthread_mutex_lock(&log_drain_lock);
+
+    log_ring_t* r = atomic_load_explicit(&log_rings, memory_order_acquire);
+    while (r != NULL) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        if (head != tail) {
+            // A wrapped region needs two iovecs
+            if (cnt + 2 > LOG_IOV_MAX) {
+                log_write_all(iov, cnt);
+                for (int i = 0; i < cnt; i++) {
+                    atomic_store_explicit(&owners[i]->tail, heads[i], memory_order_release);
+                }
+                cnt = 0;
+            }
+
+            size_t start = tail % LOG_RING_SIZE;
+            size_t len = head - tail;
+            size_t first = LOG_RING_SIZE - start;
+            if (first > len) { first = len; }
+
+            iov[cnt].iov_base = r->data + start;
+            iov[cnt].iov_len = first;
+            owners[cnt] = r;
+            heads[cnt] = tail + first;
+            cnt++;
+
+            if (len > first) {
+                iov[cnt].iov_base = r->data;
+                iov[cnt].iov_len = len - first;
+                owners[cnt] = r;
+                heads[cnt] = head;
+                cnt++;
+            }
+        }
+
+        r = r->next;
+    }
+
+    if (cnt > 0) {
+        log_write_all(iov, cnt);
+        for (int i = 0; i < cnt; i++) {
+            atomic_store_explicit(&owners[i]->tail, heads[i], memory_order_release);
+        }
+    }
+
+    size_t dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%zu log messages dropped\n", dropped);
+        struct iovec v = { buf, (size_t)n };
+        log_write_all(&v, 1);
+    }
+
+    log_reap();
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+static void* log_flusher_thread(void* arg) {
+    (void)arg;
+
+    while (!atomic_load(&log_stop)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&log_wake_lock);
+        if (!atomic_load(&log_stop)) {
+            pthread_cond_timedwait(&log_wake, &log_wake_lock, &deadline);
+        }
+        pthread_mutex_unlock(&log_wake_lock);
+
+        log_drain();
+    }
+
+    return NULL;
+}
+
+void log_shutdown(void) {
+    if (log_flusher_started) {
+        // Lines logged from here on are written directly
+        log_flusher_started = 0;
+
+        pthread_mutex_lock(&log_wake_lock);
+        atomic_store(&log_stop, 1);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+
+        pthread_join(log_flusher, NULL);
+    }
+
+    log_drain();
+}
+
+// Thread-specific data destructor: runs as the owner exits
+static void log_ring_orphan(void* arg) {
+    log_ring_t* r = arg;
+
+    // A destructor that logs after this one gets a new ring
+    log_local_ring = NULL;
+    atomic_store_explicit(&r->orphaned, 1, memory_order_release);
+}
+
+static void log_start(void) {
+    if (pthread_key_create(&log_ring_key, log_ring_orphan) != 0) { return; }
+
+    if (pthread_create(&log_flusher, NULL, log_flusher_thread, NULL) == 0) {
+        log_flusher_started = 1;
+    }
+}
+
+static log_ring_t* log_get_ring(void) {
+    if (log_local_ring != NULL) { return log_local_ring; }
+
+    // Without the flusher, lines are written directly
+    pthread_once(&log_once, log_start);
+    if (!log_flusher_started) { return NULL; }
+
+    log_ring_t* r = aligned_alloc(CACHE_LINE, sizeof(*r));
+    if (r == NULL) { return NULL; }
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->orphaned, 0);
+
+    // Without a destructor the ring would outlive its thread unnoticed
+    if (pthread_setspecific(log_ring_key, r) != 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &r->next, r)) {}
+
+    log_local_ring = r;
+    return r;
+}
+
+static void log_push(const char* line, size_t len) {
+    log_ring_t* r = log_get_ring();
+    if (r == NULL || !log_flusher_started) {
+        struct iovec v = { (void*)line, len };
+        log_write_all(&v, 1);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t used = head - tail;
+
+    if (LOG_RING_SIZE - used < len) {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        pthread_cond_signal(&log_wake);
+        return;
+    }
+
+    size_t start = head % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - start;
+    if (first > len) { first = len; }
+
+    memcpy(r->data + start, line, first);
+    memcpy(r->data, line + first, len - first);
+
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+    // Wake the flusher early instead of waiting for the next interval
+    // only when the ring is getting full
+    if (used + len > LOG_RING_SIZE / 2) {
+        pthread_cond_signal(&log_wake);
+    }
+}
+
+// localtime_r is only called when the second changes
+static inline size_t log_append_time(char* str, size_t size,
+                                     const struct timespec* ts) {
+    if (ts->tv_sec != log_cached_sec) {
+        struct tm tm;
+        localtime_r(&ts->tv_sec, &tm);
+
+        log_cached_time_len = strftime(log_cached_time, sizeof(log_cached_time),
+                                       "%H:%M:%S ", &tm);
+        log_cached_sec = ts->tv_sec;
+    }
+
+    size_t len = log_cached_time_len < size ? log_cached_time_len : size;
+    memcpy(str, log_cached_time, len);
     return len;
 }
 
-static inline size_t log_append_location(char* str, size_t size,
+static inline size_t log_append_location(char* str, size_t size, int level,
                                          const char *file, int line) {
-    int n = snprintf(str, size, "\x1b[90m%s:%d\x1b[0m ", file, line);
-    return (size_t)n;
+    int n = snprintf(str, size, "%s \x1b[90m%s:%d\x1b[0m ",
+                     log_level_names[level].tag, file, line);
+    return (n < 0) ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
 }
 
-void log_print(const char *file, int line, const char *fmt, ...) {
-    char buf[256];
-    size_t size = sizeof(buf);
+static size_t log_format_text(char* buf, size_t size, int level,
+                              const struct timespec* ts, const char* file,
+                              int line, const char* fmt, va_list args) {
     size_t len = 0;
 
-    len += log_append_time(buf, size);
-    len += log_append_location(buf + len, size - len, file, line);
+    len += log_append_time(buf, size, ts);
+    len += log_append_location(buf + len, size - len, level, file, line);
 
     if (len < size - 2) {
-        va_list args;
-        va_start(args, fmt);
         int n = vsnprintf(buf + len, size - len, fmt, args);
-        va_end(args);
 
         if (n > 0) {
             len += n;
@@ -42,8 +344,111 @@ void log_print(const char *file, int line, const char *fmt, ...) {
 
     buf[len++] = '\n';
     buf[len]   = '\0';
+    return len;
+}
+
+// Appends `str` as the body of a JSON string, stopping before `size`
+static size_t log_json_escape(char* out, size_t size, const char* str) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+
+    for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+        char esc = 0;
+        switch (*p) {
+        case '"':  esc = '"';  break;
+        case '\\': esc = '\\'; break;
+        case '\n': esc = 'n';  break;
+        case '\r': esc = 'r';  break;
+        case '\t': esc = 't';  break;
+        default: break;
+        }
+
+        if (esc != 0) {
+            if (len + 2 >= size) { break; }
+            out[len++] = '\\';
+            out[len++] = esc;
+        } else if (*p < 0x20) {
+            if (len + 6 >= size) { break; }
+            memcpy(out + len, "\\u00", 4);
+            out[len + 4] = hex[*p >> 4];
+            out[len + 5] = hex[*p & 0xf];
+            len += 6;
+        } else {
+            if (len + 1 >= size) { break; }
+            out[len++] = (char)*p;
+        }
+    }
+    return len;
+}
+
+// One JSON object per line, so shippers can parse it without regexes:
+// {"ts":1700000000.123,"level":"error","file":"src/main.c","line":1,"msg":"..."}
+static size_t log_format_json(char* buf, size_t size, int level,
+                              const struct timespec* ts, const char* file,
+                              int line, const char* fmt, va_list args) {
+    char msg[LOG_LINE_MAX];
+    vsnprintf(msg, sizeof(msg), fmt, args);
+
+    // Reserve room for the closing "}\n
+    size_t room = size - 4;
+
+    int n = snprintf(buf, room, "{\"ts\":%lld.%03ld,\"level\":\"%s\",\"file\":\"",
+                     (long long)ts->tv_sec, ts->tv_nsec / 1000000,
+                     log_level_names[level].name);
+    size_t len = (n < 0) ? 0 : ((size_t)n < room ? (size_t)n : room - 1);
+
+    len += log_json_escape(buf + len, room - len, file);
+    n = snprintf(buf + len, room - len, "\",\"line\":%d,\"msg\":\"", line);
+    len += (n < 0) ? 0 : ((size_t)n < room - len ? (size_t)n : room - len - 1);
+    len += log_json_escape(buf + len, room - len, msg);
+
+    memcpy(buf + len, "\"}\n", 4);
+    return len + 3;
+}
+
+void log_print(int level, const char *file, int line, const char *fmt, ...) {
+    char buf[LOG_LINE_MAX];
+    size_t len;
+
+    if (level < LOG_LEVEL_ERROR) { level = LOG_LEVEL_ERROR; }
+    if (level > LOG_LEVEL_DEBUG) { level = LOG_LEVEL_DEBUG; }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
 
-    fputs(buf, stderr);
+    va_list args;
+    va_start(args, fmt);
+    if (log_format == LOG_FORMAT_JSON) {
+        len = log_format_json(buf, sizeof(buf), level, &ts, file, line, fmt, args);
+    } else {
+        len = log_format_text(buf, sizeof(buf), level, &ts, file, line, fmt, args);
+    }
+    va_end(args);
+
+    log_push(buf, len);
 }
 
+void log_flush(void) {
+    log_drain();
+}
 
+void log_set_level(int level) {
+    log_level = level;
+}
+
+void log_set_format(int format) {
+    log_format = format;
+}
+
+int log_parse_level(const char* name) {
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(name, log_level_names[i].name) == 0) { return i; }
+    }
+    return -1;
+}
+
+int log_parse_format(const char* name) {
+    if (strcmp(name, "text") == 0) { return LOG_FORMAT_TEXT; }
+    if (strcmp(name, "json") == 0) { return LOG_FORMAT_JSON; }
+    return -1;
+}
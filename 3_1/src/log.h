@@ -1,8 +1,57 @@
 #ifndef LOG_H
 #define LOG_H
 
-void log_print(const char *file, int line, const char *fmt, ...);
+enum {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN = 1,
+    LOG_LEVEL_INFO = 2,
+    LOG_LEVEL_DEBUG = 3
+};
 
-#define PRINT_LOG(fmt, ...) log_print(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
+enum {
+    LOG_FORMAT_TEXT = 0,
+    LOG_FORMAT_JSON = 1
+};
+
+// Messages above this level are compiled out (meson -Dlog_level_max=...)
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+// Runtime threshold, checked before any formatting happens.
+// Set it with log_set_level before starting other threads.
+extern int log_level;
+
+// Messages are queued in a per-thread buffer and written to stderr in
+// batches by a background thread, started by the first message
+void log_print(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+// Blocks until everything logged so far has been written out
+void log_flush(void);
+
+// Stops the background thread after writing out what is pending; later
+// messages are written directly. Call at exit, once nothing else logs.
+void log_shutdown(void);
+
+void log_set_level(int level);
+void log_set_format(int format);
+
+// Parse "error", "warn", "info", "debug" / "text", "json".
+// Return -1 for unknown names.
+int log_parse_level(const char* name);
+int log_parse_format(const char* name);
+
+#define LOG_AT(level, fmt, ...)                                          \
+    do {                                                                 \
+        if ((level) <= LOG_LEVEL_MAX && (level) <= log_level) {          \
+            log_print((level), __FILE__, __LINE__, fmt, ##__VA_ARGS__);  \
+        }                                                                \
+    } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
 
 #endif
@@ -8,169 +8,675 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <time.h>
 
+#include "cancel.h"
 #include "copy.h"
+#include "cptree.h"
+#include "filter.h"
+#include "hist.h"
 #include "log.h"
-#include "threadpool.h"
+#include "meta.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "tar.h"
+#include "trace.h"
 
 const size_t DEFAULT_THREAD_NUM = 6;
 
+// Files this large get a reader thread that works ahead of the writer
+const off_t PIPELINE_MIN_SIZE = 16 * 1024 * 1024;
+
+const char* const JOURNAL_SUFFIX = ".cp-journal";
+
+const unsigned DEFAULT_PROGRESS_INTERVAL = 5;
+
+const unsigned DEFAULT_GZIP_LEVEL = 6;
+
 
 typedef struct {
-    int mode;
-    char* src_path;
-    char* dst_path;
+    const char* src_root;
+    const char* dst_root;
+
+    size_t thread_num;
+    size_t device_threads;
+
+    const char* journal_path;
+    int journal;
+    int resume;
+
+    const char* files_from;
+    char delim;
+    filter_t* filter;   // NULL until the first rule
+    int delete;
+    int durability;
+
+    int tar;
+    unsigned gzip;      // level, 0 for none
+
+    int preserve;
+    int verify;
+    int no_pipeline;
+    int no_reflink;
+
+    uint64_t limit_bytes;
+    uint64_t limit_ops;
+    const char* limit_file;
+    int ioprio;     // -1 leaves it alone
+    copy_engine_rule_t engines[COPY_ENGINE_RULES_MAX];
+    size_t engine_num;
+
+    int progress;
+    unsigned stats_interval;
+    const char* stats_file;
+
+    int latency;
+    const char* trace_file;
+} options_t;
+
+
+static void usage(const char* name) {
+    printf("Usage: %s [options] <src_root> <dst_root>\n"
+           "\n"
+           "Options:\n"
+           "  -j, --threads=N   number of worker threads (default: %zu)\n"
+           "  --device-threads=N\n"
+           "                    at most N workers per source device (default: no limit)\n"
+           "  --journal[=FILE]  record progress in FILE (default: <dst_root>%s);\n"
+           "                    the destination filesystem is synced before files\n"
+           "                    are recorded as done, so a resume after a crash\n"
+           "                    only skips data that reached the disk\n"
+           "  --resume          replay the journal and skip completed work; FILE\n"
+           "                    must be a journal or empty\n"
+           "  --files-from=FILE copy only the paths listed in FILE ('-' for stdin),\n"
+           "                    relative to <src_root>, one per line\n"
+           "  -0, --null        paths in --files-from are NUL-separated\n"
+           "  --include=GLOB    copy names matching GLOB; the first matching\n"
+           "  --exclude=GLOB    include or exclude rule decides, unmatched names\n"
+           "                    are copied and a GLOB ending in '/' only matches\n"
+           "                    directories. Excluded directories are not entered\n"
+           "  --include-regex=RE, --exclude-regex=RE\n"
+           "                    same with an extended regular expression\n"
+           "  --tar             write <dst_root> as a pax archive instead of a\n"
+           "                    directory tree ('-' for stdout)\n"
+           "  -z, --gzip[=N]    compress the archive with gzip level N (default: %u)\n"
+           "                    in parallel blocks; implies --tar\n"
+           "  --delete          remove what is in <dst_root> but not in <src_root>,\n"
+           "                    except excluded names (not with --files-from)\n"
+           "  -p                same as --preserve=mode,ownership,timestamps\n"
+           "  --preserve=LIST   also copy metadata in LIST: mode, ownership,\n"
+           "                    timestamps, xattr, acl or all (mode is always kept)\n"
+           "  --verify          read every copied file back and compare its CRC-32C\n"
+           "  --no-pipeline     copy large files without a read-ahead thread\n"
+           "  --durability=MODE when copies reach the disk before exiting: none\n"
+           "                    (default), async (fdatasync every file right away\n"
+           "                    on flusher threads) or syncfs (sync each\n"
+           "                    destination filesystem once at the end)\n"
+           "  --engine=LIST     data copy engine per size class, e.g.\n"
+           "                    rw,mmap+populate@1M,cfr@1G; engines: rw, mmap,\n"
+           "                    mmap-dst, cfr; mmap modifiers: populate, hugepage\n"
+           "  --no-reflink      always copy data, even where it could be cloned\n"
+           "  --limit-bytes=RATE\n"
+           "                    copy at most RATE bytes/s (K, M, G suffixes)\n"
+           "  --limit-ops=RATE  do at most RATE file operations/s\n"
+           "  --limit-file=FILE read 'bytes=RATE ops=RATE' from FILE, again\n"
+           "                    whenever it changes or on SIGHUP\n"
+           "  --ioprio=CLASS    I/O scheduling class: idle, be or be:0..7\n"
+           "  --progress[=SEC]  log a progress line every SEC seconds (default: %u)\n"
+           "  --stats-file=FILE write a JSON stats snapshot to FILE on SIGUSR1\n"
+           "  --stats-interval=SEC\n"
+           "                    also rewrite the stats file every SEC seconds\n"
+           "  --latency         print per-syscall latency percentiles at exit\n"
+           "                    (needs meson -Dsyscall_histograms=true)\n"
+           "  --trace=FILE      write a Chrome trace of all tasks to FILE,\n"
+           "                    viewable in ui.perfetto.dev\n"
+           "  -v, --verbose     also log debug messages\n"
+           "  -q, --quiet       only log errors\n"
+           "  --log-level=LEVEL error, warn, info (default) or debug\n"
+           "  --log-format=FMT  text (default) or json, one object per line\n"
+           "  -h, --help        show this message\n",
+           name, DEFAULT_THREAD_NUM, JOURNAL_SUFFIX, DEFAULT_GZIP_LEVEL,
+           DEFAULT_PROGRESS_INTERVAL);
+}
 
-    tp_t* pool;
-} task_t;
+static int add_filter(options_t* opts, int action, int syntax, const char* pattern) {
+    if (opts->filter == NULL && filter_init(&opts->filter) != FILTER_SUCCESS) { return -1; }
 
+    if (filter_add(opts->filter, action, syntax, pattern) != FILTER_SUCCESS) {
+        LOG_ERROR("invalid pattern '%s'", pattern);
+        return -1;
+    }
+    return 0;
+}
 
-static void tp_handler(void* arg);
+// SIGINT and SIGTERM are blocked in every thread and taken by one that
+// cancels the copy: files being copied are finished or rolled back and
+// main takes its usual way out, closing the journal and writing the
+// last stats and logs. A second signal ends the process at once.
+typedef struct {
+    pthread_t thread;
+    cancel_t* cancel;
+    atomic_int stop;
+    atomic_int sig;     // the first one caught, 0 for none
+} interrupt_t;
+
+static void interrupt_signals(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+}
 
+static void* interrupt_thread(void* arg) {
+    interrupt_t* in = arg;
 
-static char* task_path_join(const char* a, const char* b) {
-    size_t la = strlen(a);
-    size_t lb = strlen(b);
+    sigset_t set;
+    interrupt_signals(&set);
 
-    int need_sep = (la == 0) ? 0 : (a[la-1] != '/');
+    while (1) {
+        int sig = sigwaitinfo(&set, NULL);
+        if (sig == -1) { continue; }
+        if (atomic_load(&in->stop)) { break; }
 
-    size_t total = la + need_sep + lb + 1;
-    char* res = malloc(total);
-    if (res == NULL) { return NULL; }
+        if (atomic_load(&in->sig) != 0) {
+            LOG_ERROR("interrupted again, exiting without cleaning up");
+            log_flush();
 
-    strcpy(res, a);
-    if (need_sep) { strcat(res, "/"); }
-    strcat(res, b);
+            signal(sig, SIG_DFL);
+            pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+            raise(sig);
+            _exit(128 + sig);
+        }
 
-    return res;
+        atomic_store(&in->sig, sig);
+        cancel_request(in->cancel);
+        LOG_WARN("interrupted, stopping after the files in flight");
+        log_flush();
+    }
+    return NULL;
 }
 
-static inline void task_destroy(task_t* task) {
-    free(task->src_path);
-    free(task->dst_path);
-    free(task);
+static int interrupt_start(interrupt_t* in, cancel_t* cancel) {
+    in->cancel = cancel;
+    atomic_init(&in->stop, 0);
+    atomic_init(&in->sig, 0);
+    return pthread_create(&in->thread, NULL, interrupt_thread, in);
 }
 
-static task_t* task_init(const char* src, const char* dst, const char* filename) {
-    task_t* task = malloc(sizeof(*task));
-    if (task == NULL) {
-        PRINT_LOG("Error: task allocation failed for '%s/%s'", src, filename);
-        return NULL;
-    }
+// Returns the signal that canceled the copy, 0 if none did
+static int interrupt_stop(interrupt_t* in) {
+    atomic_store(&in->stop, 1);
+    pthread_kill(in->thread, SIGTERM);
+    pthread_join(in->thread, NULL);
+    return atomic_load(&in->sig);
+}
 
-    task->src_path = NULL;
-    task->dst_path = NULL;
+static int parse_durability(const char* str) {
+    if (strcmp(str, "none") == 0) { return CPTREE_DURABLE_NONE; }
+    if (strcmp(str, "async") == 0) { return CPTREE_DURABLE_ASYNC; }
+    if (strcmp(str, "syncfs") == 0) { return CPTREE_DURABLE_SYNCFS; }
+    return -1;
+}
+
+static int parse_unsigned(const char* str, unsigned* res) {
+    char* end;
+    unsigned long v = strtoul(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || v == 0 || v > UINT_MAX) { return -1; }
+
+    *res = (unsigned)v;
+    return 0;
+}
 
-    if (filename != NULL) {
-        task->src_path = task_path_join(src, filename);
-        task->dst_path = task_path_join(dst, filename);
-    } else {
-        task->src_path = strdup(src);
-        task->dst_path = strdup(dst);
+static int parse_options(options_t* opts, int argc, char** argv) {
+    enum { OPT_JOURNAL = 256, OPT_RESUME, OPT_FILES_FROM, OPT_PRESERVE,
+           OPT_LOG_LEVEL, OPT_LOG_FORMAT, OPT_PROGRESS, OPT_STATS_FILE,
+           OPT_STATS_INTERVAL, OPT_LATENCY, OPT_TRACE,
+           OPT_VERIFY, OPT_NO_PIPELINE, OPT_ENGINE,
+           OPT_NO_REFLINK, OPT_LIMIT_BYTES, OPT_LIMIT_OPS, OPT_LIMIT_FILE,
+           OPT_IOPRIO, OPT_DEVICE_THREADS, OPT_INCLUDE, OPT_EXCLUDE,
+           OPT_INCLUDE_REGEX, OPT_EXCLUDE_REGEX, OPT_DELETE,
+           OPT_DURABILITY, OPT_TAR };
+
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 'j'         },
+        { "device-threads", required_argument, NULL, OPT_DEVICE_THREADS },
+        { "journal", optional_argument, NULL, OPT_JOURNAL },
+        { "resume",  no_argument,       NULL, OPT_RESUME  },
+        { "files-from", required_argument, NULL, OPT_FILES_FROM },
+        { "include", required_argument, NULL, OPT_INCLUDE },
+        { "exclude", required_argument, NULL, OPT_EXCLUDE },
+        { "include-regex", required_argument, NULL, OPT_INCLUDE_REGEX },
+        { "exclude-regex", required_argument, NULL, OPT_EXCLUDE_REGEX },
+        { "delete",  no_argument,       NULL, OPT_DELETE  },
+        { "tar",     no_argument,       NULL, OPT_TAR     },
+        { "gzip",    optional_argument, NULL, 'z'         },
+        { "null",    no_argument,       NULL, '0'         },
+        { "preserve", required_argument, NULL, OPT_PRESERVE },
+        { "verify",  no_argument,       NULL, OPT_VERIFY  },
+        { "no-pipeline", no_argument,   NULL, OPT_NO_PIPELINE },
+        { "durability", required_argument, NULL, OPT_DURABILITY },
+        { "engine",  required_argument, NULL, OPT_ENGINE  },
+        { "no-reflink", no_argument,    NULL, OPT_NO_REFLINK },
+        { "limit-bytes", required_argument, NULL, OPT_LIMIT_BYTES },
+        { "limit-ops",  required_argument, NULL, OPT_LIMIT_OPS  },
+        { "limit-file", required_argument, NULL, OPT_LIMIT_FILE },
+        { "ioprio",     required_argument, NULL, OPT_IOPRIO     },
+        { "verbose", no_argument,       NULL, 'v'         },
+        { "quiet",   no_argument,       NULL, 'q'         },
+        { "log-level",  required_argument, NULL, OPT_LOG_LEVEL  },
+        { "log-format", required_argument, NULL, OPT_LOG_FORMAT },
+        { "progress",   optional_argument, NULL, OPT_PROGRESS   },
+        { "stats-file", required_argument, NULL, OPT_STATS_FILE },
+        { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+        { "latency",    no_argument,       NULL, OPT_LATENCY    },
+        { "trace",      required_argument, NULL, OPT_TRACE      },
+        { "help",    no_argument,       NULL, 'h'         },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(opts, 0, sizeof(*opts));
+    opts->thread_num = DEFAULT_THREAD_NUM;
+    opts->ioprio = -1;
+    opts->delim = '\n';
+    opts->preserve = META_MODE;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "j:0pvqhz", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'j': {
+            unsigned n;
+            if (parse_unsigned(optarg, &n) != 0) { return -1; }
+            opts->thread_num = n;
+            break;
+        }
+        case OPT_DEVICE_THREADS: {
+            unsigned n;
+            if (parse_unsigned(optarg, &n) != 0) { return -1; }
+            opts->device_threads = n;
+            break;
+        }
+        case OPT_JOURNAL:
+            opts->journal = 1;
+            opts->journal_path = optarg;
+            break;
+        case OPT_RESUME:
+            opts->journal = 1;
+            opts->resume = 1;
+            break;
+        case OPT_FILES_FROM:
+            opts->files_from = optarg;
+            break;
+        case '0':
+            opts->delim = '\0';
+            break;
+        case 'p':
+            opts->preserve |= META_MODE | META_OWNERSHIP | META_TIMESTAMPS;
+            break;
+        case OPT_INCLUDE:
+            if (add_filter(opts, FILTER_INCLUDE, FILTER_GLOB, optarg) != 0) { return -1; }
+            break;
+        case OPT_EXCLUDE:
+            if (add_filter(opts, FILTER_EXCLUDE, FILTER_GLOB, optarg) != 0) { return -1; }
+            break;
+        case OPT_INCLUDE_REGEX:
+            if (add_filter(opts, FILTER_INCLUDE, FILTER_REGEX, optarg) != 0) { return -1; }
+            break;
+        case OPT_EXCLUDE_REGEX:
+            if (add_filter(opts, FILTER_EXCLUDE, FILTER_REGEX, optarg) != 0) { return -1; }
+            break;
+        case OPT_TAR:
+            opts->tar = 1;
+            break;
+        case 'z':
+            opts->tar = 1;
+            opts->gzip = DEFAULT_GZIP_LEVEL;
+            if (optarg != NULL &&
+                (parse_unsigned(optarg, &opts->gzip) != 0 || opts->gzip > 9)) {
+                return -1;
+            }
+            break;
+        case OPT_DELETE:
+            opts->delete = 1;
+            break;
+        case OPT_PRESERVE: {
+            int flags;
+            if (meta_parse(optarg, &flags) != META_SUCCESS) { return -1; }
+            opts->preserve |= flags;
+            break;
+        }
+        case OPT_VERIFY:
+            opts->verify = 1;
+            break;
+        case OPT_NO_PIPELINE:
+            opts->no_pipeline = 1;
+            break;
+        case OPT_DURABILITY:
+            opts->durability = parse_durability(optarg);
+            if (opts->durability < 0) { return -1; }
+            break;
+        case OPT_ENGINE:
+            if (copy_parse_engines(optarg, opts->engines,
+                                   &opts->engine_num) != COPY_SUCCESS) { return -1; }
+            break;
+        case OPT_NO_REFLINK:
+            opts->no_reflink = 1;
+            break;
+        case OPT_LIMIT_BYTES:
+            if (rl_parse_rate(optarg, &opts->limit_bytes) != RL_SUCCESS) { return -1; }
+            break;
+        case OPT_LIMIT_OPS:
+            if (rl_parse_rate(optarg, &opts->limit_ops) != RL_SUCCESS) { return -1; }
+            break;
+        case OPT_LIMIT_FILE:
+            opts->limit_file = optarg;
+            break;
+        case OPT_IOPRIO:
+            if (rl_parse_ioprio(optarg, &opts->ioprio) != RL_SUCCESS) { return -1; }
+            break;
+        case 'v':
+            log_set_level(LOG_LEVEL_DEBUG);
+            break;
+        case 'q':
+            log_set_level(LOG_LEVEL_ERROR);
+            break;
+        case OPT_LOG_LEVEL: {
+            int level = log_parse_level(optarg);
+            if (level < 0) { return -1; }
+            log_set_level(level);
+            break;
+        }
+        case OPT_LOG_FORMAT: {
+            int format = log_parse_format(optarg);
+            if (format < 0) { return -1; }
+            log_set_format(format);
+            break;
+        }
+        case OPT_PROGRESS:
+            opts->progress = 1;
+            if (optarg != NULL && parse_unsigned(optarg, &opts->stats_interval) != 0) {
+                return -1;
+            }
+            break;
+        case OPT_STATS_FILE:
+            opts->stats_file = optarg;
+            break;
+        case OPT_STATS_INTERVAL:
+            if (parse_unsigned(optarg, &opts->stats_interval) != 0) { return -1; }
+            break;
+        case OPT_LATENCY:
+            opts->latency = 1;
+            break;
+        case OPT_TRACE:
+            opts->trace_file = optarg;
+            break;
+        default:
+            return -1;
+        }
     }
 
-    if (task->src_path == NULL || task->dst_path == NULL) {
-        PRINT_LOG("Error: task allocation failed for '%s/%s'", src, filename);
-        task_destroy(task);
-        return NULL;
+    if (argc - optind != 2) { return -1; }
+    if (opts->delete && opts->files_from != NULL) { return -1; }
+    if (opts->tar && (opts->journal || opts->delete || opts->verify ||
+                      opts->durability != CPTREE_DURABLE_NONE)) {
+        return -1;
     }
+    if (opts->filter != NULL && filter_compile(opts->filter) != FILTER_SUCCESS) { return -1; }
 
-    struct stat st;
-    if (lstat(task->src_path, &st) != 0) {
-        PRINT_LOG("Error: lstat failed for '%s'", task->src_path);
-        task_destroy(task);
-        return NULL;
+    if (opts->progress && opts->stats_interval == 0) {
+        opts->stats_interval = DEFAULT_PROGRESS_INTERVAL;
     }
 
-    task->mode = st.st_mode;
+    opts->src_root = argv[optind];
+    opts->dst_root = argv[optind + 1];
+    return 0;
+}
+
+// Default journal lives next to the destination root, not inside it,
+// so it never ends up as part of the copied tree
+static char* journal_default_path(const char* dst_root) {
+    size_t len = strlen(dst_root);
+    while (len > 1 && dst_root[len - 1] == '/') { len--; }
+
+    char* path = malloc(len + strlen(JOURNAL_SUFFIX) + 1);
+    if (path == NULL) { return NULL; }
 
-    return task;
+    memcpy(path, dst_root, len);
+    strcpy(path + len, JOURNAL_SUFFIX);
+    return path;
 }
 
-static void process_folder(task_t* task) {
-    int status = mkdir_with_mode(task->dst_path, task->mode);
-    if (status != COPY_SUCCESS) {
-        PRINT_LOG("Error: failed to mkdir '%s'", task->dst_path);
-        return;
+// Feeds listed paths into the job as they arrive, so copying overlaps
+// with whatever produces the list
+static int job_read_list(cptree_job_t* job, const options_t* opts) {
+    FILE* in = stdin;
+    if (strcmp(opts->files_from, "-") != 0) {
+        in = fopen(opts->files_from, "r");
+        if (in == NULL) {
+            LOG_ERROR("failed to open file list '%s'", opts->files_from);
+            return -1;
+        }
     }
 
-    DIR* dir = opendir(task->src_path);
-    if (dir == NULL) {
-        PRINT_LOG("Error: failed to open directory '%s'", task->src_path);
-        return;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+
+    while ((n = getdelim(&line, &cap, opts->delim, in)) != -1) {
+        if (n > 0 && line[n - 1] == opts->delim) { line[n - 1] = '\0'; }
+        if (line[0] == '\0') { continue; }
+
+        // Failures are logged and counted by the job
+        if (cptree_job_add_path(job, line) == CPTREE_CANCELED) { break; }
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        char* filename = entry->d_name;
-        if (!strcmp(".", filename)|| !strcmp("..", filename)) { continue; }
+    int status = ferror(in) ? -1 : 0;
+    if (status != 0) { LOG_ERROR("failed to read file list"); }
+
+    free(line);
+    if (in != stdin) { fclose(in); }
+    return status;
+}
 
-        task_t* new_task = task_init(task->src_path, task->dst_path, filename);
-        if (new_task == NULL) { continue; }
+int main(int argc, char **argv) {
+    // Every way out writes the queued log lines
+    atexit(cptree_shutdown);
 
-        new_task->pool = task->pool;
-        tp_add(task->pool, new_task);
+    options_t opts;
+    if (parse_options(&opts, argc, argv) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
-    closedir(dir);
-}
+    if (opts.latency) {
+#ifdef CP_SYSCALL_HIST
+        hist_enable();
+#else
+        LOG_WARN("--latency ignored, built without syscall_histograms");
+#endif
+    }
+
+    if (opts.trace_file != NULL) { trace_enable(); }
+
+    // Blocked before the workers start, so they inherit the mask and
+    // SIGUSR1 is only ever picked up by the reporter
+    int reporting = opts.progress || opts.stats_file != NULL;
+    if (reporting) { stats_block_signal(); }
+
+    // Same for SIGINT and SIGTERM, which only the interrupt thread takes
+    sigset_t interrupt_set;
+    interrupt_signals(&interrupt_set);
+    pthread_sigmask(SIG_BLOCK, &interrupt_set, NULL);
+
+    cancel_t interrupted;
+    cancel_init(&interrupted, NULL);
 
-static void tp_handler(void* arg) {
-    task_t* task = arg;
-
-    if (S_ISDIR(task->mode)) {
-        process_folder(task);
-    } else if (S_ISREG(task->mode)) {
-        int status = copy_file(task->src_path, task->dst_path, task->mode);
-        if (status == COPY_MODE_CHANGE_FAILURE) {
-            PRINT_LOG("Warning: failed to copy mode of '%s' to '%s',"
-                      "but data was copied fully",
-                      task->src_path, task->dst_path);
-        } else if (status != COPY_SUCCESS) {
-            PRINT_LOG("Error: failed to create copy of '%s' at '%s': %d",
-                      task->src_path, task->dst_path, status);
+    interrupt_t interrupt;
+    if (interrupt_start(&interrupt, &interrupted) != 0) {
+        LOG_ERROR("failed to start the interrupt thread");
+        return EXIT_FAILURE;
+    }
+
+    // Same for SIGHUP and the limit file watcher
+    rl_t* limit = NULL;
+    if (opts.limit_bytes > 0 || opts.limit_ops > 0 || opts.limit_file != NULL) {
+        if (rl_init(&limit, opts.limit_bytes, opts.limit_ops) != RL_SUCCESS) {
+            LOG_ERROR("failed to init rate limiter");
+            return EXIT_FAILURE;
         }
-    } else if (S_ISLNK(task->mode)) {
-        PRINT_LOG("Info: ignoring '%s' because this is symlink", task->src_path);
-    } else {
-        PRINT_LOG("Info: ignoring '%s' because of unsupported file type", task->src_path);
+        if (opts.limit_file != NULL) { rl_block_signal(); }
     }
 
-    task_destroy(task);
-}
+    // Inherited by the workers and the threads they start
+    if (opts.ioprio != -1 && rl_set_ioprio(opts.ioprio) != RL_SUCCESS) {
+        LOG_WARN("failed to set I/O priority: %s", strerror(errno));
+    }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: %s <src_root> <dst_root>\n", argv[0]);
+    cptree_conf_t conf = { 0 };
+    conf.thread_num = opts.thread_num;
+    conf.device_threads = opts.device_threads;
+    conf.limit = limit;
+    conf.flush_threads = (opts.durability == CPTREE_DURABLE_ASYNC) ? opts.thread_num : 0;
+    conf.cancel = &interrupted;
+
+    cptree_t* engine;
+    if (cptree_init(&engine, &conf) != CPTREE_SUCCESS) {
+        rl_destroy(limit);
         return EXIT_FAILURE;
     }
 
-    task_t* first_task = task_init(argv[1], argv[2], NULL);
-    if (first_task == NULL) { return EXIT_FAILURE; }
+    char* journal_path = NULL;
+    if (opts.journal) {
+        journal_path = (opts.journal_path != NULL) ? strdup(opts.journal_path)
+                                                   : journal_default_path(opts.dst_root);
+        if (journal_path == NULL) {
+            LOG_ERROR("allocation failed for the journal path");
+            cptree_destroy(engine);
+            rl_destroy(limit);
+            return EXIT_FAILURE;
+        }
+    }
 
-    tp_conf_t conf;
-    conf.thread_num = DEFAULT_THREAD_NUM;
-    conf.handler = tp_handler;
+    int rc;
+    sink_t* sink = NULL;
+    if (opts.tar) {
+        tar_conf_t tconf = { 0 };
+        tconf.path = opts.dst_root;
+        tconf.gzip_level = (int)opts.gzip;
+        tconf.gzip_threads = opts.thread_num;
+
+        rc = tar_sink_open(&sink, &tconf);
+        if (rc != SINK_SUCCESS) {
+            if (rc == SINK_INVALID_ARGUMENT) {
+                LOG_ERROR("--gzip needs a build with zlib");
+            } else {
+                LOG_ERROR("failed to open archive '%s': %d", opts.dst_root, rc);
+            }
+            free(journal_path);
+            cptree_destroy(engine);
+            rl_destroy(limit);
+            return EXIT_FAILURE;
+        }
+    }
 
-    tp_t* pool = NULL;
-    int rc = tp_init(&pool, &conf);
-    if (rc != TP_SUCCESS) {
-        task_destroy(first_task);
-        PRINT_LOG("Failed to init threadpool: %d\n", rc);
+    cptree_job_conf_t job_conf = { 0 };
+    job_conf.src_root = opts.src_root;
+    job_conf.dst_root = opts.dst_root;
+    job_conf.list = opts.files_from != NULL;
+    job_conf.journal_path = journal_path;
+    job_conf.resume = opts.resume;
+    job_conf.preserve = opts.preserve;
+    job_conf.verify = opts.verify;
+    job_conf.pipeline_min = opts.no_pipeline ? 0 : PIPELINE_MIN_SIZE;
+    job_conf.engines = opts.engines;
+    job_conf.engine_num = opts.engine_num;
+    job_conf.reflink = !opts.no_reflink;
+    job_conf.filter = opts.filter;
+    job_conf.delete = opts.delete;
+    job_conf.durability = opts.durability;
+    job_conf.sink = sink;
+
+    // Before the job starts, so that the limit file applies to all of it
+    rl_control_t* limit_control = NULL;
+    if (opts.limit_file != NULL) {
+        rc = rl_control_start(&limit_control, limit, opts.limit_file);
+        if (rc != RL_SUCCESS) {
+            LOG_WARN("failed to watch limit file '%s': %d", opts.limit_file, rc);
+        }
+    }
+
+    cptree_job_t* job;
+    rc = cptree_submit(engine, &job_conf, &job);
+    free(journal_path);
+    if (rc != CPTREE_SUCCESS) {
+        rl_control_stop(limit_control);
+        sink_destroy(sink);
+        cptree_destroy(engine);
+        rl_destroy(limit);
         return EXIT_FAILURE;
     }
 
-    first_task->pool = pool;
-    tp_add(pool, first_task);
+    stats_reporter_t* reporter = NULL;
+    if (reporting) {
+        stats_reporter_conf_t rconf = { 0 };
+        rconf.stats = cptree_job_stats(job);
+        rconf.pool = cptree_pool(engine);
+        rconf.progress = opts.progress;
+        rconf.interval = opts.stats_interval;
+        rconf.path = opts.stats_file;
+
+        rc = stats_reporter_start(&reporter, &rconf);
+        if (rc != STATS_SUCCESS) {
+            LOG_WARN("failed to start stats reporter: %d", rc);
+        }
+    }
+
+    if (opts.files_from != NULL && job_read_list(job, &opts) != 0) {
+        stats_add(cptree_job_stats(job), STAT_ERRORS, 1);
+    }
+
+    int status = cptree_job_wait(job);
 
-    int status = tp_wait_idling(pool);
-    if (status != TP_SUCCESS) {
-        PRINT_LOG("Failed to wait threadpool work ending.");
-        return EXIT_FAILURE;
+    // The archive is only complete once its writer is done
+    if (sink != NULL && sink_finish(sink) != SINK_SUCCESS) {
+        LOG_ERROR("archive '%s' is incomplete", opts.dst_root);
+        status = CPTREE_FAILURE;
+    }
+
+    int sig = interrupt_stop(&interrupt);
+    if (sig != 0) {
+        LOG_WARN("copy to '%s' is incomplete%s", opts.dst_root,
+                 opts.journal ? ", rerun with --resume to finish it" : "");
+    }
+
+    rl_control_stop(limit_control);
+    stats_reporter_stop(reporter);
+    cptree_job_destroy(job);
+    cptree_destroy(engine);
+    rl_destroy(limit);
+    filter_destroy(opts.filter);
+    sink_destroy(sink);
+
+    if (opts.trace_file != NULL && trace_write(opts.trace_file) != TRACE_SUCCESS) {
+        LOG_WARN("failed to write trace '%s'", opts.trace_file);
+    }
+
+    if (status == CPTREE_JOURNAL_FAILURE || status == CPTREE_FAILURE) { return EXIT_FAILURE; }
+
+#ifdef CP_SYSCALL_HIST
+    if (opts.latency) {
+        log_flush();
+        hist_report(stderr);
     }
+#endif
 
-    tp_destroy(pool);
-    return EXIT_SUCCESS;
+    // As a shell reports a command killed by the signal. Copies with
+    // failed entries fail as well, so that scripts do not take them for
+    // complete.
+    if (sig != 0) { return 128 + sig; }
+    return (status == CPTREE_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
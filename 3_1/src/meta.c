@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include "meta.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "hist.h"
+
+#define ERROR -1
+
+#define XATTR_INITIAL_SIZE 1024
+
+// POSIX ACLs are stored by Linux as these two xattrs, so copying them
+// verbatim preserves ACLs without linking libacl
+#define ACL_ACCESS_XATTR "system.posix_acl_access"
+#define ACL_DEFAULT_XATTR "system.posix_acl_default"
+
+static const struct {
+    const char* name;
+    int flags;
+} meta_names[] = {
+    { "mode",       META_MODE       },
+    { "ownership",  META_OWNERSHIP  },
+    { "timestamps", META_TIMESTAMPS },
+    { "xattr",      META_XATTR      },
+    { "acl",        META_ACL        },
+    { "all",        META_ALL        },
+};
+
+int meta_parse(const char* list, int* flags) {
+    if (list == NULL || flags == NULL) { return META_INVALID_ARGUMENT; }
+
+    int res = 0;
+    const char* p = list;
+
+    while (*p != '\0') {
+        size_t len = strcspn(p, ",");
+        size_t i = 0;
+
+        for (; i < sizeof(meta_names) / sizeof(meta_names[0]); i++) {
+            if (strlen(meta_names[i].name) == len &&
+                strncmp(meta_names[i].name, p, len) == 0) {
+                res |= meta_names[i].flags;
+                break;
+            }
+        }
+        if (i == sizeof(meta_names) / sizeof(meta_names[0])) {
+            return META_INVALID_ARGUMENT;
+        }
+
+        p += len;
+        if (*p == ',') { p++; }
+    }
+
+    *flags = res;
+    return META_SUCCESS;
+}
+
+static inline int xattr_is_acl(const char* name) {
+    return strcmp(name, ACL_ACCESS_XATTR) == 0 ||
+           strcmp(name, ACL_DEFAULT_XATTR) == 0;
+}
+
+static int xattr_wanted(const char* name, int flags) {
+    if (xattr_is_acl(name)) { return flags & META_ACL; }
+    return flags & META_XATTR;
+}
+
+// Grows `buf` until the result of `get` fits. Returns the value size.
+static ssize_t xattr_read(int fd, const char* name, char** buf, size_t* size) {
+    while (1) {
+        ssize_t n = (name != NULL) ? fgetxattr(fd, name, *buf, *size)
+                                   : flistxattr(fd, *buf, *size);
+        if (n != ERROR || errno != ERANGE) { return n; }
+
+        char* tmp = realloc(*buf, *size * 2);
+        if (tmp == NULL) { return ERROR; }
+
+        *buf = tmp;
+        *size *= 2;
+    }
+}
+
+static int meta_copy_xattrs(int src_fd, int dst_fd, int flags) {
+    int status = META_SUCCESS;
+
+    size_t names_size = XATTR_INITIAL_SIZE;
+    size_t value_size = XATTR_INITIAL_SIZE;
+    char* names = malloc(names_size);
+    char* value = malloc(value_size);
+
+    if (names == NULL || value == NULL) {
+        status = META_XATTR_FAILURE;
+        goto exit;
+    }
+
+    ssize_t len = xattr_read(src_fd, NULL, &names, &names_size);
+    if (len == ERROR) {
+        // Source filesystem without xattr support has nothing to copy
+        if (errno != ENOTSUP) { status = META_XATTR_FAILURE; }
+        goto exit;
+    }
+
+    for (char* name = names; name < names + len; name += strlen(name) + 1) {
+        if (!xattr_wanted(name, flags)) { continue; }
+
+        ssize_t n = xattr_read(src_fd, name, &value, &value_size);
+        if (n == ERROR) {
+            if (errno != ENODATA) { status = META_XATTR_FAILURE; }
+            continue;
+        }
+
+        HIST_BEGIN(t_xattr);
+        int err = fsetxattr(dst_fd, name, value, (size_t)n, 0);
+        HIST_END(HIST_XATTR, t_xattr);
+        if (err == ERROR) { status = META_XATTR_FAILURE; }
+    }
+
+exit:
+    free(names);
+    free(value);
+    return status;
+}
+
+static int meta_chown(int dst_fd, const struct stat* st) {
+    HIST_BEGIN(t_chown);
+    int err = fchown(dst_fd, st->st_uid, st->st_gid);
+    HIST_END(HIST_CHOWN, t_chown);
+    if (err == 0) { return META_SUCCESS; }
+
+    // Like cp -p, an unprivileged user keeps the group if possible and
+    // otherwise silently owns the copy
+    if (errno == EPERM) {
+        fchown(dst_fd, (uid_t)-1, st->st_gid);
+        return META_SUCCESS;
+    }
+
+    return META_OWNERSHIP_FAILURE;
+}
+
+int meta_apply_fd(int src_fd, int dst_fd, const struct stat* st, int flags) {
+    int status = META_SUCCESS;
+
+    if (st == NULL) { return META_INVALID_ARGUMENT; }
+
+    // chown clears setuid/setgid bits, so it has to go before chmod
+    if (flags & META_OWNERSHIP) {
+        int err = meta_chown(dst_fd, st);
+        if (err != META_SUCCESS) { status = err; }
+    }
+
+    if (flags & META_MODE) {
+        HIST_BEGIN(t_chmod);
+        int err = fchmod(dst_fd, st->st_mode & 07777);
+        HIST_END(HIST_CHMOD, t_chmod);
+        if (err == ERROR) { status = META_MODE_FAILURE; }
+    }
+
+    // ACL xattrs after chmod, otherwise chmod rewrites their mask entry
+    if ((flags & (META_XATTR | META_ACL)) && src_fd != ERROR) {
+        int err = meta_copy_xattrs(src_fd, dst_fd, flags);
+        if (err != META_SUCCESS && status == META_SUCCESS) { status = err; }
+    }
+
+    if (flags & META_TIMESTAMPS) {
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+        HIST_BEGIN(t_utimens);
+        int err = futimens(dst_fd, times);
+        HIST_END(HIST_UTIMENS, t_utimens);
+        if (err == ERROR && status == META_SUCCESS) {
+            status = META_TIMESTAMPS_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+int meta_apply_path(const char* src, const char* dst,
+                    const struct stat* st, int flags) {
+    int src_fd = ERROR;
+
+    int dst_fd = open(dst, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (dst_fd == ERROR) { return META_FAILURE; }
+
+    if (flags & (META_XATTR | META_ACL)) {
+        src_fd = open(src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    }
+
+    int status = meta_apply_fd(src_fd, dst_fd, st, flags);
+    if (src_fd == ERROR && (flags & (META_XATTR | META_ACL)) &&
+        status == META_SUCCESS) {
+        status = META_XATTR_FAILURE;
+    }
+
+    if (src_fd != ERROR) { close(src_fd); }
+    close(dst_fd);
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef META_H
+#define META_H
+
+#include <sys/stat.h>
+
+enum {
+    META_SUCCESS = 0,
+    META_FAILURE = -1,
+    META_MODE_FAILURE = -2,
+    META_OWNERSHIP_FAILURE = -3,
+    META_TIMESTAMPS_FAILURE = -4,
+    META_XATTR_FAILURE = -5,
+    META_INVALID_ARGUMENT = -6
+};
+
+// What to preserve, combined as a bit mask
+enum {
+    META_MODE = 1 << 0,
+    META_OWNERSHIP = 1 << 1,
+    META_TIMESTAMPS = 1 << 2,
+    META_XATTR = 1 << 3,
+    META_ACL = 1 << 4,
+
+    META_ALL = META_MODE | META_OWNERSHIP | META_TIMESTAMPS | META_XATTR | META_ACL
+};
+
+// Parses a comma-separated list like "mode,timestamps,xattr" or "all"
+// into `flags`
+int meta_parse(const char* list, int* flags);
+
+// Applies the metadata of the source described by `st` to an open
+// destination descriptor. `src_fd` is only used to read xattrs and ACLs.
+// Timestamps are set last, so call this after all data was written.
+int meta_apply_fd(int src_fd, int dst_fd, const struct stat* st, int flags);
+
+// Same for a destination that is not open, used for directories
+// once their subtree is complete
+int meta_apply_path(const char* src, const char* dst,
+                    const struct stat* st, int flags);
+
+#endif /* META_H */
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include "ratelimit.h"
+
+#include <errno.h>
+#include <linux/ioprio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+#define SUCCESS 0
+
+// Seconds between checks of the control file
+#define RL_POLL_INTERVAL 1
+
+// Longer lines in the control file are cut
+#define RL_LINE_MAX 256
+
+enum { RL_BYTES, RL_OPS, RL_NUM };
+
+typedef struct {
+    atomic_uint_fast64_t rate;  // per second, read without the lock
+    double tokens;              // negative while callers sleep off a debt
+    uint64_t last_ns;
+} rl_bucket_t;
+
+struct rl {
+    pthread_mutex_t lock;
+    rl_bucket_t buckets[RL_NUM];
+};
+
+struct rl_control {
+    rl_t* rl;
+    const char* path;
+    pthread_t thread;
+    atomic_int stop;
+
+    struct timespec mtime;
+};
+
+static uint64_t rl_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int rl_init(rl_t** p, uint64_t bytes_per_s, uint64_t ops_per_s) {
+    if (p == NULL) { return RL_INVALID_ARGUMENT; }
+
+    rl_t* rl = calloc(1, sizeof(*rl));
+    if (rl == NULL) { return RL_ALLOCATION_FAILURE; }
+
+    pthread_mutex_init(&rl->lock, NULL);
+    for (int b = 0; b < RL_NUM; b++) { atomic_init(&rl->buckets[b].rate, 0); }
+    rl_set(rl, bytes_per_s, ops_per_s);
+
+    *p = rl;
+    return RL_SUCCESS;
+}
+
+void rl_destroy(rl_t* rl) {
+    if (rl == NULL) { return; }
+
+    pthread_mutex_destroy(&rl->lock);
+    free(rl);
+}
+
+void rl_set(rl_t* rl, uint64_t bytes_per_s, uint64_t ops_per_s) {
+    uint64_t rates[RL_NUM] = { bytes_per_s, ops_per_s };
+    uint64_t now = rl_now();
+
+    pthread_mutex_lock(&rl->lock);
+    for (int b = 0; b < RL_NUM; b++) {
+        rl_bucket_t* bucket = &rl->buckets[b];
+
+        // A new limit starts with a full second of burst, and debts
+        // run up under the old one are forgiven
+        bucket->tokens = (double)rates[b];
+        bucket->last_ns = now;
+        atomic_store(&bucket->rate, rates[b]);
+    }
+    pthread_mutex_unlock(&rl->lock);
+}
+
+// Takes `amount` tokens and returns how long the caller has to wait
+// for them, in nanoseconds. Called with the lock held.
+static uint64_t rl_take(rl_bucket_t* bucket, uint64_t amount, uint64_t now) {
+    uint64_t rate = atomic_load(&bucket->rate);
+    if (rate == 0 || amount == 0) { return 0; }
+
+    double tokens = bucket->tokens + (double)(now - bucket->last_ns) * (double)rate / 1e9;
+    if (tokens > (double)rate) { tokens = (double)rate; }
+
+    tokens -= (double)amount;
+    bucket->tokens = tokens;
+    bucket->last_ns = now;
+
+    return (tokens < 0.0) ? (uint64_t)(-tokens * 1e9 / (double)rate) : 0;
+}
+
+void rl_acquire(rl_t* rl, uint64_t bytes, uint64_t ops) {
+    if (rl == NULL) { return; }
+    if (atomic_load_explicit(&rl->buckets[RL_BYTES].rate, memory_order_relaxed) == 0 &&
+        atomic_load_explicit(&rl->buckets[RL_OPS].rate, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    uint64_t now = rl_now();
+
+    pthread_mutex_lock(&rl->lock);
+    uint64_t wait = rl_take(&rl->buckets[RL_BYTES], bytes, now);
+    uint64_t wait_ops = rl_take(&rl->buckets[RL_OPS], ops, now);
+    pthread_mutex_unlock(&rl->lock);
+
+    if (wait_ops > wait) { wait = wait_ops; }
+    if (wait == 0) { return; }
+
+    struct timespec ts = { (time_t)(wait / 1000000000ull), (long)(wait % 1000000000ull) };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) { }
+}
+
+int rl_parse_rate(const char* str, uint64_t* rate) {
+    char* end;
+    errno = 0;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (end == str || errno != 0) { return RL_INVALID_ARGUMENT; }
+
+    switch (*end) {
+    case '\0': break;
+    case 'K': case 'k': v <<= 10; end++; break;
+    case 'M': case 'm': v <<= 20; end++; break;
+    case 'G': case 'g': v <<= 30; end++; break;
+    default: return RL_INVALID_ARGUMENT;
+    }
+    if (*end != '\0') { return RL_INVALID_ARGUMENT; }
+
+    *rate = (uint64_t)v;
+    return RL_SUCCESS;
+}
+
+int rl_load(rl_t* rl, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { return RL_FAILURE; }
+
+    uint64_t rates[RL_NUM];
+    for (int b = 0; b < RL_NUM; b++) { rates[b] = atomic_load(&rl->buckets[b].rate); }
+
+    int status = RL_SUCCESS;
+    char line[RL_LINE_MAX];
+    while (status == RL_SUCCESS && fgets(line, sizeof(line), f) != NULL) {
+        char* save = NULL;
+        for (char* tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (tok[0] == '#') { break; }
+
+            char* value = strchr(tok, '=');
+            if (value == NULL) {
+                status = RL_INVALID_ARGUMENT;
+                break;
+            }
+            *value++ = '\0';
+
+            int b = !strcmp(tok, "bytes") ? RL_BYTES : !strcmp(tok, "ops") ? RL_OPS : -1;
+            if (b == -1 || rl_parse_rate(value, &rates[b]) != RL_SUCCESS) {
+                status = RL_INVALID_ARGUMENT;
+                break;
+            }
+        }
+    }
+    fclose(f);
+
+    if (status == RL_SUCCESS) { rl_set(rl, rates[RL_BYTES], rates[RL_OPS]); }
+    return status;
+}
+
+int rl_block_signal(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    return (pthread_sigmask(SIG_BLOCK, &set, NULL) == SUCCESS)
+           ? RL_SUCCESS : RL_FAILURE;
+}
+
+// Returns 1 if the file was modified since the last call
+static int rl_control_changed(rl_control_t* c) {
+    struct stat st;
+    if (stat(c->path, &st) != SUCCESS) { return 0; }
+
+    if (st.st_mtim.tv_sec == c->mtime.tv_sec && st.st_mtim.tv_nsec == c->mtime.tv_nsec) {
+        return 0;
+    }
+    c->mtime = st.st_mtim;
+    return 1;
+}
+
+static void rl_control_reload(rl_control_t* c) {
+    if (rl_load(c->rl, c->path) != RL_SUCCESS) {
+        LOG_WARN("failed to load rate limits from '%s', keeping the current ones", c->path);
+        return;
+    }
+
+    LOG_INFO("rate limits now %llu bytes/s, %llu ops/s (0 is unlimited)",
+             (unsigned long long)atomic_load(&c->rl->buckets[RL_BYTES].rate),
+             (unsigned long long)atomic_load(&c->rl->buckets[RL_OPS].rate));
+}
+
+static void* rl_control_thread(void* arg) {
+    rl_control_t* c = arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    while (!atomic_load(&c->stop)) {
+        struct timespec timeout = { RL_POLL_INTERVAL, 0 };
+        int sig = sigtimedwait(&set, NULL, &timeout);
+
+        if (atomic_load(&c->stop)) { break; }
+        if (rl_control_changed(c) || sig == SIGHUP) { rl_control_reload(c); }
+    }
+    return NULL;
+}
+
+int rl_control_start(rl_control_t** p, rl_t* rl, const char* path) {
+    if (p == NULL || rl == NULL || path == NULL) { return RL_INVALID_ARGUMENT; }
+
+    rl_control_t* c = calloc(1, sizeof(*c));
+    if (c == NULL) { return RL_ALLOCATION_FAILURE; }
+
+    c->rl = rl;
+    c->path = path;
+    atomic_init(&c->stop, 0);
+
+    // Whatever the file says now applies from the start
+    if (rl_control_changed(c)) { rl_control_reload(c); }
+
+    if (pthread_create(&c->thread, NULL, rl_control_thread, c) != SUCCESS) {
+        free(c);
+        return RL_THREAD_START_FAILURE;
+    }
+
+    *p = c;
+    return RL_SUCCESS;
+}
+
+void rl_control_stop(rl_control_t* c) {
+    if (c == NULL) { return; }
+
+    atomic_store(&c->stop, 1);
+    pthread_kill(c->thread, SIGHUP);
+    pthread_join(c->thread, NULL);
+
+    free(c);
+}
+
+int rl_parse_ioprio(const char* str, int* ioprio) {
+    if (strcmp(str, "idle") == 0) {
+        *ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+        return RL_SUCCESS;
+    }
+    if (strcmp(str, "be") == 0) {
+        *ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_NORM);
+        return RL_SUCCESS;
+    }
+    if (strncmp(str, "be:", 3) == 0 && str[3] >= '0' && str[3] <= '7' && str[4] == '\0') {
+        *ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, str[3] - '0');
+        return RL_SUCCESS;
+    }
+    return RL_INVALID_ARGUMENT;
+}
+
+int rl_set_ioprio(int ioprio) {
+    // No glibc wrapper; 0 is the calling thread
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1) { return RL_FAILURE; }
+    return RL_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+enum {
+    RL_SUCCESS = 0,
+    RL_FAILURE = -1,
+    RL_ALLOCATION_FAILURE = -2,
+    RL_INVALID_ARGUMENT = -3,
+    RL_THREAD_START_FAILURE = -4
+};
+
+// Token buckets for bytes/s and operations/s shared by all workers.
+// Each bucket holds at most one second worth of tokens; a caller that
+// takes more than there are goes into debt and sleeps it off, so
+// concurrent callers are served in the order they asked. A rate of 0
+// means unlimited.
+typedef struct rl rl_t;
+
+int rl_init(rl_t** rl, uint64_t bytes_per_s, uint64_t ops_per_s);
+void rl_destroy(rl_t* rl);
+
+// May be called at any time. Callers already asleep keep the delay
+// they were given under the old rate.
+void rl_set(rl_t* rl, uint64_t bytes_per_s, uint64_t ops_per_s);
+
+// Blocks until `bytes` and `ops` fit within the limits. Returns at
+// once for a NULL limiter or unlimited rates.
+void rl_acquire(rl_t* rl, uint64_t bytes, uint64_t ops);
+
+// "RATE" with an optional K, M or G suffix (powers of 1024)
+int rl_parse_rate(const char* str, uint64_t* rate);
+
+// Reads "bytes=RATE ops=RATE" from `path`; a key left out keeps its
+// current value
+int rl_load(rl_t* rl, const char* path);
+
+typedef struct rl_control rl_control_t;
+
+// Reloads the limits from `path` whenever it changes (checked every
+// second) and on SIGHUP. SIGHUP has to be blocked in every thread
+// first; see rl_block_signal.
+int rl_control_start(rl_control_t** c, rl_t* rl, const char* path);
+void rl_control_stop(rl_control_t* c);
+
+int rl_block_signal(void);
+
+// I/O priority as taken by ioprio_set: "idle", "be" or "be:LEVEL" with
+// LEVEL 0 (highest) to 7
+int rl_parse_ioprio(const char* str, int* ioprio);
+
+// Applies to the calling thread and to every thread it creates later
+int rl_set_ioprio(int ioprio);
+
+#endif /* RATELIMIT_H */
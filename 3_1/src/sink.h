@@ -0,0 +1,58 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum {
+    SINK_SUCCESS = 0,
+    SINK_FAILURE = -1,
+    SINK_ALLOCATION_FAILURE = -2,
+    SINK_INVALID_ARGUMENT = -3,
+    SINK_IO_FAILURE = -4,
+    SINK_OPEN_FAILURE = -5,
+    SINK_THREAD_START_FAILURE = -6
+};
+
+// A destination other than a directory tree. A job with a sink hands
+// it every directory and regular file instead of calling
+// mkdir_with_mode and copy_file; paths are relative to the roots, and
+// "" is the root itself.
+typedef struct sink sink_t;
+
+typedef struct {
+    // Called from any number of workers at once. Entries of a
+    // directory are always added after the directory.
+    int (*dir)(sink_t* sink, const char* rel_path, const struct stat* st);
+    int (*file)(sink_t* sink, const char* src_path, const char* rel_path,
+                const struct stat* st);
+
+    // Once all jobs using the sink are done: writes out what is left
+    // and reports any error that was not returned for an entry
+    int (*finish)(sink_t* sink);
+    void (*destroy)(sink_t* sink);
+} sink_ops_t;
+
+// Backends embed this first
+struct sink {
+    const sink_ops_t* ops;
+};
+
+static inline int sink_dir(sink_t* sink, const char* rel_path, const struct stat* st) {
+    return sink->ops->dir(sink, rel_path, st);
+}
+
+static inline int sink_file(sink_t* sink, const char* src_path, const char* rel_path,
+                            const struct stat* st) {
+    return sink->ops->file(sink, src_path, rel_path, st);
+}
+
+static inline int sink_finish(sink_t* sink) {
+    return sink->ops->finish(sink);
+}
+
+static inline void sink_destroy(sink_t* sink) {
+    if (sink != NULL) { sink->ops->destroy(sink); }
+}
+
+#endif /* SINK_H */
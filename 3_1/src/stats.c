@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+#define SUCCESS 0
+
+#define CACHE_LINE 64
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t values[STAT_NUM];
+} stats_slot_t;
+
+struct stats {
+    size_t slot_num;
+    stats_slot_t* slots;
+};
+
+struct stats_reporter {
+    stats_reporter_conf_t conf;
+    pthread_t thread;
+    atomic_int stop;
+
+    struct timespec start;
+    double last_time;
+    uint64_t last_bytes;
+    double rate;
+};
+
+
+int stats_init(stats_t** p, size_t thread_num) {
+    if (p == NULL) { return STATS_INVALID_ARGUMENT; }
+
+    stats_t* s = malloc(sizeof(*s));
+    if (s == NULL) { return STATS_ALLOCATION_FAILURE; }
+
+    s->slot_num = thread_num + 1;
+    s->slots = aligned_alloc(CACHE_LINE, s->slot_num * sizeof(*s->slots));
+    if (s->slots == NULL) {
+        free(s);
+        return STATS_ALLOCATION_FAILURE;
+    }
+
+    for (size_t i = 0; i < s->slot_num; i++) {
+        for (int c = 0; c < STAT_NUM; c++) {
+            atomic_init(&s->slots[i].values[c], 0);
+        }
+    }
+
+    *p = s;
+    return STATS_SUCCESS;
+}
+
+void stats_destroy(stats_t* s) {
+    if (s == NULL) { return; }
+
+    free(s->slots);
+    free(s);
+}
+
+void stats_add(stats_t* s, int counter, uint64_t value) {
+    // Slot 0 is shared by threads outside the pool
+    size_t slot = (size_t)(tp_worker_id() + 1);
+    if (slot >= s->slot_num) { slot = 0; }
+
+    atomic_fetch_add_explicit(&s->slots[slot].values[counter], value,
+                              memory_order_relaxed);
+}
+
+void stats_read(const stats_t* s, uint64_t* values) {
+    memset(values, 0, STAT_NUM * sizeof(*values));
+
+    for (size_t i = 0; i < s->slot_num; i++) {
+        for (int c = 0; c < STAT_NUM; c++) {
+            values[c] += atomic_load_explicit(&s->slots[i].values[c],
+                                              memory_order_relaxed);
+        }
+    }
+}
+
+int stats_block_signal(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    return (pthread_sigmask(SIG_BLOCK, &set, NULL) == SUCCESS)
+           ? STATS_SUCCESS : STATS_FAILURE;
+}
+
+static double stats_elapsed(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static const char* stats_human(double bytes, char* buf, size_t size) {
+    static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    size_t u = 0;
+
+    while (bytes >= 1024.0 && u + 1 < sizeof(units) / sizeof(units[0])) {
+        bytes /= 1024.0;
+        u++;
+    }
+
+    snprintf(buf, size, "%.1f %s", bytes, units[u]);
+    return buf;
+}
+
+static void stats_log_progress(const stats_reporter_t* r, const uint64_t* v,
+                               const tp_stats_t* tp, double eta) {
+    char done[32], found[32], rate[32];
+
+    uint64_t busy_total = tp->busy_ns + tp->idle_ns;
+    double busy_pct = busy_total ? 100.0 * (double)tp->busy_ns / (double)busy_total : 0.0;
+
+    LOG_INFO("progress: %llu/%llu files, %llu dirs, %s/%s, %s/s, eta %.0fs, "
+             "%llu errors, queue %zu, busy %zu/%zu (%.0f%%)",
+             (unsigned long long)v[STAT_FILES],
+             (unsigned long long)v[STAT_FILES_FOUND],
+             (unsigned long long)v[STAT_DIRS],
+             stats_human((double)v[STAT_BYTES], done, sizeof(done)),
+             stats_human((double)v[STAT_BYTES_FOUND], found, sizeof(found)),
+             stats_human(r->rate, rate, sizeof(rate)),
+             eta,
+             (unsigned long long)v[STAT_ERRORS],
+             tp->queue_depth, tp->busy_threads, tp->thread_num, busy_pct);
+}
+
+// Written to a temporary file and renamed, so readers never see a
+// half-written snapshot
+static void stats_write_file(const stats_reporter_t* r, const uint64_t* v,
+                             const tp_stats_t* tp, double elapsed, double eta) {
+    size_t len = strlen(r->conf.path);
+    char* tmp = malloc(len + 5);
+    if (tmp == NULL) { return; }
+
+    memcpy(tmp, r->conf.path, len);
+    strcpy(tmp + len, ".tmp");
+
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        LOG_WARN("failed to write stats file '%s'", tmp);
+        free(tmp);
+        return;
+    }
+
+    fprintf(f, "{\"elapsed_s\":%.3f,\"files\":%llu,\"dirs\":%llu,\"bytes\":%llu,"
+               "\"skipped\":%llu,\"errors\":%llu,\"files_found\":%llu,"
+               "\"bytes_found\":%llu,\"deleted\":%llu,\"bytes_per_s\":%.0f,\"eta_s\":%.0f,"
+               "\"threads\":%zu,\"busy_threads\":%zu,\"queue_depth\":%zu,"
+               "\"tasks_done\":%llu,\"busy_ns\":%llu,\"idle_ns\":%llu}\n",
+            elapsed,
+            (unsigned long long)v[STAT_FILES], (unsigned long long)v[STAT_DIRS],
+            (unsigned long long)v[STAT_BYTES], (unsigned long long)v[STAT_SKIPPED],
+            (unsigned long long)v[STAT_ERRORS], (unsigned long long)v[STAT_FILES_FOUND],
+            (unsigned long long)v[STAT_BYTES_FOUND], (unsigned long long)v[STAT_DELETED],
+            r->rate, eta,
+            tp->thread_num, tp->busy_threads, tp->queue_depth,
+            (unsigned long long)tp->tasks_done, (unsigned long long)tp->busy_ns,
+            (unsigned long long)tp->idle_ns);
+
+    int failed = ferror(f);
+    if (fclose(f) != SUCCESS || failed || rename(tmp, r->conf.path) != SUCCESS) {
+        LOG_WARN("failed to write stats file '%s'", r->conf.path);
+    }
+
+    free(tmp);
+}
+
+static void stats_report(stats_reporter_t* r, int final) {
+    uint64_t v[STAT_NUM];
+    tp_stats_t tp;
+
+    stats_read(r->conf.stats, v);
+    if (r->conf.pool == NULL || tp_stats(r->conf.pool, &tp) != TP_SUCCESS) {
+        memset(&tp, 0, sizeof(tp));
+    }
+
+    double elapsed = stats_elapsed(&r->start);
+
+    // Rate over the last period, so the ETA follows the current speed
+    // and the final report shows the average of the whole run
+    if (final && elapsed > 0.0) {
+        r->rate = (double)v[STAT_BYTES] / elapsed;
+    } else if (elapsed - r->last_time > 0.1) {
+        r->rate = (double)(v[STAT_BYTES] - r->last_bytes) / (elapsed - r->last_time);
+        r->last_time = elapsed;
+        r->last_bytes = v[STAT_BYTES];
+    }
+
+    double eta = 0.0;
+    if (r->rate > 0.0 && v[STAT_BYTES_FOUND] > v[STAT_BYTES]) {
+        eta = (double)(v[STAT_BYTES_FOUND] - v[STAT_BYTES]) / r->rate;
+    }
+
+    if (r->conf.progress) { stats_log_progress(r, v, &tp, eta); }
+    if (r->conf.path != NULL) { stats_write_file(r, v, &tp, elapsed, eta); }
+}
+
+static void* stats_reporter_thread(void* arg) {
+    stats_reporter_t* r = arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (!atomic_load(&r->stop)) {
+        int sig;
+        if (r->conf.interval > 0) {
+            struct timespec timeout = { (time_t)r->conf.interval, 0 };
+            sig = sigtimedwait(&set, NULL, &timeout);
+        } else {
+            sig = sigwaitinfo(&set, NULL);
+        }
+
+        if (sig == -1 && errno != EAGAIN) { continue; }
+        if (atomic_load(&r->stop)) { break; }
+
+        stats_report(r, 0);
+    }
+
+    stats_report(r, 1);
+    return NULL;
+}
+
+int stats_reporter_start(stats_reporter_t** p, const stats_reporter_conf_t* conf) {
+    if (p == NULL || conf == NULL || conf->stats == NULL) {
+        return STATS_INVALID_ARGUMENT;
+    }
+
+    stats_reporter_t* r = calloc(1, sizeof(*r));
+    if (r == NULL) { return STATS_ALLOCATION_FAILURE; }
+
+    r->conf = *conf;
+    atomic_init(&r->stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+
+    if (pthread_create(&r->thread, NULL, stats_reporter_thread, r) != SUCCESS) {
+        free(r);
+        return STATS_THREAD_START_FAILURE;
+    }
+
+    *p = r;
+    return STATS_SUCCESS;
+}
+
+void stats_reporter_stop(stats_reporter_t* r) {
+    if (r == NULL) { return; }
+
+    // The signal only wakes the reporter up; it sees the flag and
+    // writes the final report
+    atomic_store(&r->stop, 1);
+    pthread_kill(r->thread, SIGUSR1);
+    pthread_join(r->thread, NULL);
+
+    free(r);
+}
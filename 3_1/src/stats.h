@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+enum {
+    STATS_SUCCESS = 0,
+    STATS_FAILURE = -1,
+    STATS_ALLOCATION_FAILURE = -2,
+    STATS_INVALID_ARGUMENT = -3,
+    STATS_THREAD_START_FAILURE = -4
+};
+
+// Copier counters
+enum {
+    STAT_FILES,         // regular files copied
+    STAT_DIRS,          // directories created
+    STAT_BYTES,         // bytes of copied files
+    STAT_SKIPPED,       // entries skipped (journal, unsupported types)
+    STAT_ERRORS,
+    STAT_FILES_FOUND,   // regular files discovered so far
+    STAT_BYTES_FOUND,   // their total size, for an ETA
+    STAT_DELETED,       // destination entries removed by --delete
+
+    STAT_NUM
+};
+
+typedef struct stats stats_t;
+
+// One padded slot per pool worker plus one shared by all other threads
+int stats_init(stats_t** s, size_t thread_num);
+void stats_destroy(stats_t* s);
+
+void stats_add(stats_t* s, int counter, uint64_t value);
+
+// Sums all slots into `values[STAT_NUM]`
+void stats_read(const stats_t* s, uint64_t* values);
+
+typedef struct {
+    stats_t* stats;
+    tp_t* pool;
+
+    // Print a progress line through the logger every `interval` seconds
+    int progress;
+    unsigned interval;
+
+    // If set, this file is rewritten with a JSON snapshot every
+    // `interval` seconds (if non-zero) and on every SIGUSR1
+    const char* path;
+} stats_reporter_conf_t;
+
+typedef struct stats_reporter stats_reporter_t;
+
+// SIGUSR1 has to be blocked in every thread before this is called, so
+// that only the reporter receives it; see stats_block_signal
+int stats_reporter_start(stats_reporter_t** r, const stats_reporter_conf_t* conf);
+
+// Stops the reporter after writing a final report
+void stats_reporter_stop(stats_reporter_t* r);
+
+int stats_block_signal(void);
+
+#endif /* STATS_H */
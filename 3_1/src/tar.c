@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+
+#include "tar.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef CP_GZIP
+#include <zlib.h>
+#endif
+
+#include "hist.h"
+#include "log.h"
+#include "threadpool.h"
+
+#define ERROR -1
+#define SUCCESS 0
+
+#define TAR_BLOCK_SIZE 512
+
+// Archives end in two zero blocks and are padded to whole records of
+// 20 blocks, like tar writes them
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+
+// Room for the ustar header, an extended header and its records,
+// which hold at most a PATH_MAX path and a few numbers
+#define TAR_HEADER_MAX (3 * TAR_BLOCK_SIZE + PATH_MAX + 512)
+
+// Files up to this size are read by the workers, larger ones are
+// streamed by the writer so they never sit in memory whole
+#define TAR_INLINE_MAX (1024 * 1024)
+
+// Workers wait while this much is queued for the writer
+#define TAR_QUEUE_MAX (64 * 1024 * 1024)
+
+// Output buffer of the writer, and the size of a gzip block
+#define TAR_WRITE_SIZE (1024 * 1024)
+
+typedef struct tar_entry {
+    struct tar_entry* next;
+
+    // Headers, followed by the padded data of inline files
+    uint8_t* data;
+    size_t len;
+
+    // Streamed files: read by the writer, NULL otherwise
+    char* src_path;
+    off_t size;
+} tar_entry_t;
+
+struct tar;
+
+// One buffer of the archive on its way through the compressors
+typedef struct {
+    struct tar* tar;
+    uint8_t* in;
+    size_t in_len;
+    uint8_t* out;
+    size_t out_len;
+    size_t out_cap;
+    int status;
+    int done;           // under zlock
+} tar_block_t;
+
+typedef struct tar {
+    sink_t sink;        // first, see sink.h
+
+    int fd;
+    int close_fd;
+    const char* path;
+
+    pthread_t writer;
+    int writer_started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t more;    // something queued, or finishing
+    pthread_cond_t room;    // queue below TAR_QUEUE_MAX
+    tar_entry_t* head;
+    tar_entry_t* tail;
+    size_t queued;
+    int finishing;
+    int status;             // first error of the writer
+    int broken;             // output failed, entries are only dropped
+
+    // Owned by the writer
+    uint8_t* buf;
+    size_t buf_len;
+    uint64_t total;         // uncompressed bytes so far
+
+    // gzip only: a ring of blocks, written in order as they are done
+    int level;
+    tp_t* pool;
+    tar_block_t* blocks;
+    size_t block_num;
+    size_t block_head;      // oldest in flight
+    size_t block_count;
+    pthread_mutex_t zlock;
+    pthread_cond_t zdone;
+} tar_t;
+
+static const sink_ops_t tar_ops;
+
+
+static size_t tar_pad(uint64_t len) {
+    return (size_t)((len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE);
+}
+
+// Zero-padded octal with a terminating NUL. Returns ERROR if `v` needs
+// more than `width - 1` digits.
+static int tar_octal(char* field, size_t width, uint64_t v) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%0*llo", (int)(width - 1), (unsigned long long)v);
+    if (n < 0 || (size_t)n > width - 1) { return ERROR; }
+
+    memcpy(field, tmp, (size_t)n + 1);
+    return SUCCESS;
+}
+
+static size_t tar_digits(size_t v) {
+    size_t d = 1;
+    while (v >= 10) {
+        v /= 10;
+        d++;
+    }
+    return d;
+}
+
+// Appends "<len> key=value\n", where <len> counts the whole record
+static size_t tar_pax_record(char* out, const char* key, const char* value, size_t value_len) {
+    size_t base = strlen(key) + value_len + 3;
+    size_t len = base + tar_digits(base);
+    if (tar_digits(len) != tar_digits(base)) { len++; }
+
+    int n = sprintf(out, "%zu %s=", len, key);
+    memcpy(out + n, value, value_len);
+    out[len - 1] = '\n';
+    return len;
+}
+
+static size_t tar_pax_number(char* out, const char* key, long long v) {
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%lld", v);
+    return tar_pax_record(out, key, num, (size_t)n);
+}
+
+// Where a path longer than the name field can be split into prefix
+// and name, or 0 if it cannot
+static size_t tar_split(const char* path, size_t len) {
+    for (size_t i = len - 1; i > 0; i--) {
+        if (path[i] != '/') { continue; }
+        if (len - i - 1 > 100) { break; }
+        if (i <= 155 && i < len - 1) { return i; }
+    }
+    return 0;
+}
+
+static void tar_checksum(uint8_t* block) {
+    memset(block + 148, ' ', 8);
+
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) { sum += block[i]; }
+
+    snprintf((char*)block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+static void tar_ustar(uint8_t* block, const char* name, size_t name_len, size_t prefix_len,
+                      const struct stat* st, uint64_t size, char type) {
+    memset(block, 0, TAR_BLOCK_SIZE);
+    char* b = (char*)block;
+
+    if (prefix_len > 0) {
+        memcpy(b + 345, name, prefix_len);
+        name += prefix_len + 1;
+        name_len -= prefix_len + 1;
+    }
+    memcpy(b, name, (name_len > 100) ? 100 : name_len);
+
+    // Numbers that do not fit are 0 here and in the extended header
+    if (tar_octal(b + 100, 8, st->st_mode & 07777) != SUCCESS) { tar_octal(b + 100, 8, 0); }
+    if (tar_octal(b + 108, 8, st->st_uid) != SUCCESS) { tar_octal(b + 108, 8, 0); }
+    if (tar_octal(b + 116, 8, st->st_gid) != SUCCESS) { tar_octal(b + 116, 8, 0); }
+    if (tar_octal(b + 124, 12, size) != SUCCESS) { tar_octal(b + 124, 12, 0); }
+
+    uint64_t mtime = (st->st_mtime < 0) ? 0 : (uint64_t)st->st_mtime;
+    if (tar_octal(b + 136, 12, mtime) != SUCCESS) { tar_octal(b + 136, 12, 0); }
+
+    b[156] = type;
+    memcpy(b + 257, "ustar", 6);
+    memcpy(b + 263, "00", 2);
+    tar_octal(b + 329, 8, 0);
+    tar_octal(b + 337, 8, 0);
+
+    tar_checksum(block);
+}
+
+// Writes the header blocks of one entry into `out`, which has room for
+// TAR_HEADER_MAX bytes, and returns their length, or 0 if the path is
+// too long
+static size_t tar_header(uint8_t* out, const char* rel_path, const struct stat* st,
+                         uint64_t size, char type) {
+    char name[PATH_MAX + 1];
+    size_t len = strlen(rel_path);
+    if (len + 1 >= sizeof(name)) { return 0; }
+
+    memcpy(name, rel_path, len);
+    if (type == '5') { name[len++] = '/'; }
+    name[len] = '\0';
+
+    char records[PATH_MAX + 256];
+    size_t records_len = 0;
+
+    size_t prefix_len = 0;
+    if (len > 100) {
+        prefix_len = tar_split(name, len);
+        if (prefix_len == 0) { records_len += tar_pax_record(records, "path", name, len); }
+    }
+
+    char tmp[16];
+    if (size > 077777777777ull) {
+        records_len += tar_pax_number(records + records_len, "size", (long long)size);
+    }
+    if (tar_octal(tmp, 8, st->st_uid) != SUCCESS) {
+        records_len += tar_pax_number(records + records_len, "uid", (long long)st->st_uid);
+    }
+    if (tar_octal(tmp, 8, st->st_gid) != SUCCESS) {
+        records_len += tar_pax_number(records + records_len, "gid", (long long)st->st_gid);
+    }
+    if (st->st_mtime < 0 || tar_octal(tmp, 12, (uint64_t)st->st_mtime) != SUCCESS) {
+        records_len += tar_pax_number(records + records_len, "mtime", (long long)st->st_mtime);
+    }
+
+    size_t off = 0;
+    if (records_len > 0) {
+        tar_ustar(out, "PaxHeader", 9, 0, st, records_len, 'x');
+        memset(out + TAR_BLOCK_SIZE, 0, tar_pad(records_len));
+        memcpy(out + TAR_BLOCK_SIZE, records, records_len);
+        off = TAR_BLOCK_SIZE + tar_pad(records_len);
+    }
+
+    tar_ustar(out + off, name, len, prefix_len, st, size, type);
+    return off + TAR_BLOCK_SIZE;
+}
+
+static int tar_write_all(int fd, const uint8_t* buf, size_t len) {
+    while (len > 0) {
+        HIST_BEGIN(t_write);
+        ssize_t nw = write(fd, buf, len);
+        HIST_END(HIST_WRITE, t_write);
+
+        if (nw == ERROR) {
+            if (errno == EINTR) { continue; }
+            return SINK_IO_FAILURE;
+        }
+        buf += nw;
+        len -= (size_t)nw;
+    }
+    return SINK_SUCCESS;
+}
+
+#ifdef CP_GZIP
+// A complete gzip member, so blocks need nothing from each other
+static int tar_deflate(tar_block_t* b) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    // 15 window bits, +16 for a gzip header and trailer
+    if (deflateInit2(&z, b->tar->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return SINK_ALLOCATION_FAILURE;
+    }
+
+    z.next_in = b->in;
+    z.avail_in = (uInt)b->in_len;
+    z.next_out = b->out;
+    z.avail_out = (uInt)b->out_cap;
+
+    int rc = deflate(&z, Z_FINISH);
+    b->out_len = z.total_out;
+    deflateEnd(&z);
+
+    return (rc == Z_STREAM_END) ? SINK_SUCCESS : SINK_FAILURE;
+}
+#else
+static int tar_deflate(tar_block_t* b) {
+    (void)b;
+    return SINK_INVALID_ARGUMENT;
+}
+#endif
+
+static void tar_block_handler(void* arg) {
+    tar_block_t* b = arg;
+    int status = tar_deflate(b);
+
+    pthread_mutex_lock(&b->tar->zlock);
+    b->status = status;
+    b->done = 1;
+    pthread_cond_broadcast(&b->tar->zdone);
+    pthread_mutex_unlock(&b->tar->zlock);
+}
+
+// Writes out the oldest blocks, waiting for them to be compressed,
+// until at most `keep` are in flight
+static int tar_gzip_drain(tar_t* t, size_t keep) {
+    int status = SINK_SUCCESS;
+
+    while (t->block_count > keep) {
+        tar_block_t* b = &t->blocks[t->block_head];
+
+        pthread_mutex_lock(&t->zlock);
+        while (!b->done) { pthread_cond_wait(&t->zdone, &t->zlock); }
+        pthread_mutex_unlock(&t->zlock);
+
+        if (status == SINK_SUCCESS) { status = b->status; }
+        if (status == SINK_SUCCESS) { status = tar_write_all(t->fd, b->out, b->out_len); }
+
+        b->done = 0;
+        t->block_head = (t->block_head + 1) % t->block_num;
+        t->block_count--;
+    }
+    return status;
+}
+
+// Hands the buffer on: straight to the file, or to the compressors,
+// with the next free block becoming the buffer
+static int tar_flush(tar_t* t) {
+    if (t->buf_len == 0) { return SINK_SUCCESS; }
+
+    if (t->pool == NULL) {
+        int status = tar_write_all(t->fd, t->buf, t->buf_len);
+        t->buf_len = 0;
+        return status;
+    }
+
+    tar_block_t* b = &t->blocks[(t->block_head + t->block_count) % t->block_num];
+    b->in_len = t->buf_len;
+    t->block_count++;
+    if (tp_add(t->pool, b) != TP_SUCCESS) { tar_block_handler(b); }
+
+    int status = tar_gzip_drain(t, t->block_num - 1);
+
+    t->buf = t->blocks[(t->block_head + t->block_count) % t->block_num].in;
+    t->buf_len = 0;
+    return status;
+}
+
+static int tar_put(tar_t* t, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t n = TAR_WRITE_SIZE - t->buf_len;
+        if (n > len) { n = len; }
+
+        if (data != NULL) {
+            memcpy(t->buf + t->buf_len, data, n);
+            data += n;
+        } else {
+            memset(t->buf + t->buf_len, 0, n);
+        }
+        t->buf_len += n;
+        t->total += n;
+        len -= n;
+
+        if (t->buf_len == TAR_WRITE_SIZE) {
+            int status = tar_flush(t);
+            if (status != SINK_SUCCESS) { return status; }
+        }
+    }
+    return SINK_SUCCESS;
+}
+
+// Reads a big file straight into the buffer. The header promised
+// `e->size` bytes, so whatever the file no longer has is written as
+// zeros, and the archive stays readable.
+static int tar_stream(tar_t* t, const tar_entry_t* e) {
+    int fd = open(e->src_path, O_RDONLY | O_CLOEXEC);
+    if (fd == ERROR) { LOG_ERROR("failed to open '%s'", e->src_path); }
+    if (fd != ERROR) { posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); }
+
+    int failed = (fd == ERROR);
+    uint64_t left = (uint64_t)e->size;
+
+    while (left > 0 && !failed) {
+        size_t n = TAR_WRITE_SIZE - t->buf_len;
+        if (n > left) { n = (size_t)left; }
+
+        HIST_BEGIN(t_read);
+        ssize_t nr = read(fd, t->buf + t->buf_len, n);
+        HIST_END(HIST_READ, t_read);
+
+        if (nr == ERROR && errno == EINTR) { continue; }
+        if (nr <= 0) {
+            LOG_ERROR("failed to read '%s', or it shrank; padded with zeros", e->src_path);
+            failed = 1;
+            break;
+        }
+
+        t->buf_len += (size_t)nr;
+        t->total += (uint64_t)nr;
+        left -= (uint64_t)nr;
+
+        if (t->buf_len == TAR_WRITE_SIZE) {
+            int status = tar_flush(t);
+            if (status != SINK_SUCCESS) {
+                if (fd != ERROR) { close(fd); }
+                return status;
+            }
+        }
+    }
+    if (fd != ERROR) { close(fd); }
+
+    int status = tar_put(t, NULL, (size_t)left + (tar_pad((uint64_t)e->size) - (size_t)e->size));
+    if (status != SINK_SUCCESS) { return status; }
+    return failed ? SINK_FAILURE : SINK_SUCCESS;
+}
+
+static void tar_set_status(tar_t* t, int status, int broken) {
+    pthread_mutex_lock(&t->lock);
+    if (t->status == SINK_SUCCESS) { t->status = status; }
+    if (broken) { t->broken = 1; }
+    pthread_cond_broadcast(&t->room);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void tar_entry_free(tar_entry_t* e) {
+    free(e->data);
+    free(e->src_path);
+    free(e);
+}
+
+static void* tar_writer(void* arg) {
+    tar_t* t = arg;
+    int broken = 0;
+
+    pthread_mutex_lock(&t->lock);
+    while (1) {
+        while (t->head == NULL && !t->finishing) { pthread_cond_wait(&t->more, &t->lock); }
+        if (t->head == NULL) { break; }
+
+        tar_entry_t* e = t->head;
+        t->head = e->next;
+        if (t->head == NULL) { t->tail = NULL; }
+        t->queued -= e->len;
+        pthread_cond_broadcast(&t->room);
+        pthread_mutex_unlock(&t->lock);
+
+        if (!broken) {
+            int status = tar_put(t, e->data, e->len);
+            if (status == SINK_SUCCESS && e->src_path != NULL) { status = tar_stream(t, e); }
+
+            // A file that went wrong is still in the archive; output
+            // that went wrong is the end of it
+            broken = status != SINK_SUCCESS && status != SINK_FAILURE;
+            if (broken) { LOG_ERROR("failed to write archive '%s'", t->path); }
+            if (status != SINK_SUCCESS) { tar_set_status(t, status, broken); }
+        }
+        tar_entry_free(e);
+
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (broken) { return NULL; }
+
+    // End of archive, then the rest of the last record
+    int status = tar_put(t, NULL, 2 * TAR_BLOCK_SIZE);
+    if (status == SINK_SUCCESS && t->total % TAR_RECORD_SIZE != 0) {
+        status = tar_put(t, NULL, TAR_RECORD_SIZE - t->total % TAR_RECORD_SIZE);
+    }
+    if (status == SINK_SUCCESS) { status = tar_flush(t); }
+    if (status == SINK_SUCCESS && t->pool != NULL) { status = tar_gzip_drain(t, 0); }
+
+    if (status != SINK_SUCCESS) {
+        LOG_ERROR("failed to write archive '%s'", t->path);
+        tar_set_status(t, status, 1);
+    }
+    return NULL;
+}
+
+// Takes `e`, and waits while the writer is far behind
+static int tar_enqueue(tar_t* t, tar_entry_t* e) {
+    pthread_mutex_lock(&t->lock);
+    while (t->queued > TAR_QUEUE_MAX && !t->broken) {
+        pthread_cond_wait(&t->room, &t->lock);
+    }
+
+    // Past a write error there is no point in reading more
+    int status = t->status;
+    if (!t->broken) {
+        e->next = NULL;
+        if (t->tail != NULL) { t->tail->next = e; } else { t->head = e; }
+        t->tail = e;
+        t->queued += e->len;
+        pthread_cond_signal(&t->more);
+        e = NULL;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (e == NULL) { return SINK_SUCCESS; }
+
+    tar_entry_free(e);
+    return status;
+}
+
+static int tar_add(tar_t* t, const char* src_path, const char* rel_path,
+                   const struct stat* st, char type) {
+    uint64_t size = (type == '0') ? (uint64_t)st->st_size : 0;
+
+    uint8_t header[TAR_HEADER_MAX];
+    size_t header_len = tar_header(header, rel_path, st, size, type);
+    if (header_len == 0) { return SINK_INVALID_ARGUMENT; }
+
+    int streamed = size > TAR_INLINE_MAX;
+    size_t data_len = streamed ? 0 : tar_pad(size);
+
+    tar_entry_t* e = calloc(1, sizeof(*e));
+    if (e == NULL) { return SINK_ALLOCATION_FAILURE; }
+
+    e->len = header_len + data_len;
+    e->data = malloc(e->len);
+    if (e->data == NULL) {
+        free(e);
+        return SINK_ALLOCATION_FAILURE;
+    }
+    memcpy(e->data, header, header_len);
+
+    if (streamed) {
+        e->src_path = strdup(src_path);
+        e->size = (off_t)size;
+        if (e->src_path == NULL) {
+            tar_entry_free(e);
+            return SINK_ALLOCATION_FAILURE;
+        }
+    } else if (size > 0) {
+        int fd = open(src_path, O_RDONLY | O_CLOEXEC);
+        if (fd == ERROR) {
+            tar_entry_free(e);
+            return SINK_OPEN_FAILURE;
+        }
+
+        uint8_t* data = e->data + header_len;
+        size_t done = 0;
+        while (done < size) {
+            HIST_BEGIN(t_read);
+            ssize_t nr = read(fd, data + done, size - done);
+            HIST_END(HIST_READ, t_read);
+
+            if (nr == ERROR && errno == EINTR) { continue; }
+            if (nr <= 0) { break; }
+            done += (size_t)nr;
+        }
+        close(fd);
+
+        // Left out rather than padded, since nothing was promised yet
+        if (done < size) {
+            tar_entry_free(e);
+            return SINK_IO_FAILURE;
+        }
+        memset(data + size, 0, data_len - size);
+    }
+
+    return tar_enqueue(t, e);
+}
+
+static int tar_dir(sink_t* sink, const char* rel_path, const struct stat* st) {
+    // The root itself has no entry
+    if (rel_path[0] == '\0') { return SINK_SUCCESS; }
+    return tar_add((tar_t*)sink, NULL, rel_path, st, '5');
+}
+
+static int tar_file(sink_t* sink, const char* src_path, const char* rel_path,
+                    const struct stat* st) {
+    if (!S_ISREG(st->st_mode)) { return SINK_INVALID_ARGUMENT; }
+    return tar_add((tar_t*)sink, src_path, rel_path, st, '0');
+}
+
+static int tar_finish(sink_t* sink) {
+    tar_t* t = (tar_t*)sink;
+
+    if (t->writer_started) {
+        pthread_mutex_lock(&t->lock);
+        t->finishing = 1;
+        pthread_cond_signal(&t->more);
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_join(t->writer, NULL);
+        t->writer_started = 0;
+    }
+
+    if (t->close_fd) {
+        if (close(t->fd) != SUCCESS && t->status == SINK_SUCCESS) { t->status = SINK_IO_FAILURE; }
+        t->close_fd = 0;
+    }
+    return t->status;
+}
+
+static void tar_destroy(sink_t* sink) {
+    tar_t* t = (tar_t*)sink;
+    tar_finish(sink);
+
+    if (t->pool != NULL) { tp_destroy(t->pool); }
+    if (t->blocks != NULL) {
+        for (size_t i = 0; i < t->block_num; i++) {
+            free(t->blocks[i].in);
+            free(t->blocks[i].out);
+        }
+        free(t->blocks);
+    } else {
+        free(t->buf);
+    }
+
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->more);
+    pthread_cond_destroy(&t->room);
+    pthread_mutex_destroy(&t->zlock);
+    pthread_cond_destroy(&t->zdone);
+    free(t);
+}
+
+static const sink_ops_t tar_ops = { tar_dir, tar_file, tar_finish, tar_destroy };
+
+static int tar_gzip_init(tar_t* t, const tar_conf_t* conf) {
+#ifdef CP_GZIP
+    size_t threads = (conf->gzip_threads == 0) ? 1 : conf->gzip_threads;
+
+    // Two blocks per compressor keep them busy while the writer waits
+    // for the oldest
+    t->block_num = 2 * threads + 1;
+    t->blocks = calloc(t->block_num, sizeof(*t->blocks));
+    if (t->blocks == NULL) { return SINK_ALLOCATION_FAILURE; }
+
+    size_t out_cap = compressBound(TAR_WRITE_SIZE) + 64;
+    for (size_t i = 0; i < t->block_num; i++) {
+        tar_block_t* b = &t->blocks[i];
+        b->tar = t;
+        b->out_cap = out_cap;
+        b->in = malloc(TAR_WRITE_SIZE);
+        b->out = malloc(out_cap);
+        if (b->in == NULL || b->out == NULL) { return SINK_ALLOCATION_FAILURE; }
+    }
+    t->buf = t->blocks[0].in;
+
+    tp_conf_t tconf = { 0 };
+    tconf.thread_num = threads;
+    tconf.handler = tar_block_handler;
+    tconf.name = "cp-gzip";
+    if (tp_init(&t->pool, &tconf) != TP_SUCCESS) { return SINK_THREAD_START_FAILURE; }
+
+    return SINK_SUCCESS;
+#else
+    (void)t;
+    (void)conf;
+    return SINK_INVALID_ARGUMENT;
+#endif
+}
+
+int tar_sink_open(sink_t** p, const tar_conf_t* conf) {
+    if (p == NULL || conf == NULL || conf->path == NULL ||
+        conf->gzip_level < 0 || conf->gzip_level > 9) {
+        return SINK_INVALID_ARGUMENT;
+    }
+
+    tar_t* t = calloc(1, sizeof(*t));
+    if (t == NULL) { return SINK_ALLOCATION_FAILURE; }
+
+    t->sink.ops = &tar_ops;
+    t->path = conf->path;
+    t->level = conf->gzip_level;
+    t->fd = ERROR;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->more, NULL);
+    pthread_cond_init(&t->room, NULL);
+    pthread_mutex_init(&t->zlock, NULL);
+    pthread_cond_init(&t->zdone, NULL);
+
+    int status = SINK_SUCCESS;
+    if (t->level > 0) {
+        status = tar_gzip_init(t, conf);
+    } else {
+        t->buf = malloc(TAR_WRITE_SIZE);
+        if (t->buf == NULL) { status = SINK_ALLOCATION_FAILURE; }
+    }
+
+    if (status == SINK_SUCCESS) {
+        if (strcmp(conf->path, "-") == 0) {
+            t->fd = STDOUT_FILENO;
+        } else {
+            t->fd = open(conf->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            t->close_fd = 1;
+            if (t->fd == ERROR) {
+                t->close_fd = 0;
+                status = SINK_OPEN_FAILURE;
+            }
+        }
+    }
+
+    if (status == SINK_SUCCESS) {
+        if (pthread_create(&t->writer, NULL, tar_writer, t) != SUCCESS) {
+            status = SINK_THREAD_START_FAILURE;
+        } else {
+            t->writer_started = 1;
+        }
+    }
+
+    if (status != SINK_SUCCESS) {
+        tar_destroy(&t->sink);
+        return status;
+    }
+
+    *p = &t->sink;
+    return SINK_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+
+#include "sink.h"
+
+typedef struct {
+    // Archive to create or replace; "-" is stdout
+    const char* path;
+
+    // gzip level 1..9, 0 for a plain archive. Needs a build with zlib,
+    // SINK_INVALID_ARGUMENT otherwise.
+    int gzip_level;
+
+    // Threads compressing blocks, 0 for one
+    size_t gzip_threads;
+} tar_conf_t;
+
+// A sink that streams a POSIX pax archive. Workers read small files
+// whole and queue them with their headers; one writer thread puts the
+// queue out in order through a large buffer, and streams big files
+// itself. With gzip, every buffer becomes a gzip member of its own,
+// compressed on a pool while the writer fills the next one; gzip -d
+// and tar -z read the concatenation as one stream.
+//
+// Entries are named by their path relative to the roots. Only numeric
+// owners are stored, and extended headers are only added where ustar
+// fields do not fit (long paths, sizes from 8 GiB, large ids).
+int tar_sink_open(sink_t** sink, const tar_conf_t* conf);
+
+#endif /* TAR_H */
@@ -1,49 +1,145 @@
+#define _GNU_SOURCE
+
 #include "threadpool.h"
 
+#include <limits.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "trace.h"
+
 #define SUCCESS 0
 
+#define CACHE_LINE 64
+
+#define TP_NAME_MAX 16
+
+// Initial number of queue slots, doubled as keys show up
+#define TP_QUEUES_INIT 4
+
 typedef struct task_node {
     void* task;
     struct task_node* next;
+
+    // Only filled in while tracing
+    uint64_t enqueue_ns;
+    int producer;
 } task_node_t;
 
+// Counters are only written by their own worker; padding keeps
+// workers from bouncing each other's cache lines
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t tasks_done;
+    atomic_uint_fast64_t busy_ns;
+    atomic_uint_fast64_t idle_ns;
+
+    struct tp* pool;
+    int id;
+} tp_worker_t;
+
+// Tasks added with the same key, typically those touching one device
+typedef struct {
+    uint64_t key;
+    task_node_t* head;
+    task_node_t* tail;
+
+    size_t num;         // queued
+    size_t running;     // taken by workers and not finished yet
+} tp_queue_t;
+
 struct tp {
     pthread_t* threads;
+    tp_worker_t* workers;
     size_t thread_num;
 
     void (*handler)(void*);
+    void (*drop)(void*);
+    const cancel_t* cancel;
 
     size_t inactive_thread_num;
 
-    task_node_t* head;
-    task_node_t* tail;
+    // Workers take from the queues in turn, skipping those that have
+    // `queue_limit` tasks running
+    tp_queue_t* queues;
+    size_t queue_count;
+    size_t queue_cap;
+    size_t queue_next;
+    size_t queue_limit;
 
+    // Tasks over all queues
     size_t queue_num;
 
     pthread_mutex_t lock;
     pthread_cond_t notify;
 
     int shutdown;
+
+    // For traces
+    int trace_base;
+    const char* name;
 };
 
-static void* tp_thread(void* tp) {
+static _Thread_local int tp_current_worker = -1;
+
+// Trace numbering of workers over all pools: each pool takes the next
+// `thread_num` numbers
+static atomic_int tp_trace_next = 0;
+static _Thread_local int tp_current_trace = -1;
+
+static inline uint64_t tp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void tp_counter_add(atomic_uint_fast64_t* c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+// Index of the next queue to take a task from, round robin, or -1 if
+// there is none. Called with the lock held.
+static long tp_pick_queue(tp_t* pool) {
+    if (pool->queue_num == 0) { return -1; }
+
+    for (size_t n = 0; n < pool->queue_count; n++) {
+        size_t i = (pool->queue_next + n) % pool->queue_count;
+        tp_queue_t* q = &pool->queues[i];
+
+        if (q->num > 0 && (pool->queue_limit == 0 || q->running < pool->queue_limit)) {
+            pool->queue_next = i + 1;
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+static void* tp_thread(void* arg) {
     int status;
-    tp_t* pool = (tp_t*)tp;
+    tp_worker_t* worker = arg;
+    tp_t* pool = worker->pool;
+
+    tp_current_worker = worker->id;
+    tp_current_trace = pool->trace_base + worker->id;
+    uint64_t idle_start = tp_now_ns();
+    long taken = -1;
 
     while(1) {
         status = pthread_mutex_lock(&pool->lock);
         if (status != SUCCESS) { break; }
 
+        if (taken != -1) { pool->queues[taken].running--; }
         pool->inactive_thread_num++;
         pthread_cond_broadcast(&pool->notify);
 
-        while((pool->queue_num == 0) && (!pool->shutdown)) {
+        while(((taken = tp_pick_queue(pool)) == -1) && (!pool->shutdown)) {
             pthread_cond_wait(&pool->notify, &pool->lock);
         }
 
@@ -52,23 +148,55 @@ static void* tp_thread(void* tp) {
             break;
         }
 
-        task_node_t* node = pool->head;
+        tp_queue_t* queue = &pool->queues[taken];
+        task_node_t* node = queue->head;
         void* task = node->task;
-        
-        pool->head = node->next;
-        if (pool->head == NULL) {
-            pool->tail = NULL;
+
+        trace_task_t trace;
+        if (trace_enabled) {
+            trace.worker = tp_current_trace;
+            trace.producer = node->producer;
+            trace.pool = pool->name;
+            trace.index = worker->id;
+            trace.enqueue_ns = node->enqueue_ns;
+            trace.dequeue_ns = trace_now();
+        }
+
+        queue->head = node->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
         }
 
+        queue->num--;
+        queue->running++;
         pool->queue_num--;
         pool->inactive_thread_num--;
 
+        if (trace_enabled) { trace.queue_depth = pool->queue_num; }
+
         free(node);
 
         pthread_cond_broadcast(&pool->notify);
         pthread_mutex_unlock(&pool->lock);
 
-        pool->handler(task);
+        uint64_t busy_start = tp_now_ns();
+        tp_counter_add(&worker->idle_ns, busy_start - idle_start);
+
+        if (pool->drop != NULL && cancel_requested(pool->cancel)) {
+            pool->drop(task);
+        } else {
+            pool->handler(task);
+        }
+
+        idle_start = tp_now_ns();
+        tp_counter_add(&worker->busy_ns, idle_start - busy_start);
+        tp_counter_add(&worker->tasks_done, 1);
+
+        if (trace_enabled) {
+            trace.start_ns = busy_start;
+            trace.end_ns = idle_start;
+            trace_task(&trace);
+        }
     }
     return NULL;
 }
@@ -83,11 +211,15 @@ static inline tp_t* tp_alloc(size_t thread_num) {
     pthread_cond_init(&pool->notify, NULL);
 
     pool->queue_num = 0;
-    pool->head = NULL;
-    pool->tail = NULL;
+    pool->queue_cap = TP_QUEUES_INIT;
+    pool->queues = calloc(pool->queue_cap, sizeof(*pool->queues));
 
     pool->threads = malloc(sizeof(*pool->threads) * thread_num);
-    if (pool->threads == NULL) {
+    pool->workers = aligned_alloc(CACHE_LINE, sizeof(*pool->workers) * thread_num);
+    if (pool->threads == NULL || pool->workers == NULL || pool->queues == NULL) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->queues);
         pthread_mutex_destroy(&pool->lock);
         pthread_cond_destroy(&pool->notify);
         free(pool);
@@ -97,6 +229,47 @@ static inline tp_t* tp_alloc(size_t thread_num) {
     return pool;
 }
 
+static int tp_attr_init(pthread_attr_t* attr, const tp_conf_t* conf) {
+    if (pthread_attr_init(attr) != SUCCESS) { return TP_FAILURE; }
+
+    int err = SUCCESS;
+
+    if (conf->stack_size != 0) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t size = (conf->stack_size + page - 1) / page * page;
+        if (size < (size_t)PTHREAD_STACK_MIN) { size = (size_t)PTHREAD_STACK_MIN; }
+
+        err = pthread_attr_setstacksize(attr, size);
+    }
+
+    if (err == SUCCESS && conf->guard_size != 0) {
+        err = pthread_attr_setguardsize(attr, conf->guard_size);
+    }
+
+    if (err == SUCCESS && (conf->sched_policy != 0 || conf->sched_priority != 0)) {
+        struct sched_param param = { .sched_priority = conf->sched_priority };
+
+        err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (err == SUCCESS) { err = pthread_attr_setschedpolicy(attr, conf->sched_policy); }
+        if (err == SUCCESS) { err = pthread_attr_setschedparam(attr, &param); }
+    }
+
+    if (err != SUCCESS) {
+        pthread_attr_destroy(attr);
+        return TP_INVALID_ARGUMENT;
+    }
+    return TP_SUCCESS;
+}
+
+static void tp_set_name(pthread_t thread, const char* name, size_t id) {
+    char buf[TP_NAME_MAX];
+    // Longer names are cut, the kernel keeps only 15 characters anyway
+    if (snprintf(buf, sizeof(buf), "%s-%zu", name, id) < 0) { return; }
+
+    // Naming is cosmetic, a failure is not worth failing the pool over
+    pthread_setname_np(thread, buf);
+}
+
 int tp_init(tp_t** p, const tp_conf_t* conf) {
     tp_t* pool;
 
@@ -104,22 +277,45 @@ int tp_init(tp_t** p, const tp_conf_t* conf) {
         return TP_INVALID_ARGUMENT;
     }
 
+    pthread_attr_t attr;
+    int status = tp_attr_init(&attr, conf);
+    if (status != TP_SUCCESS) { return status; }
+
     pool = tp_alloc(conf->thread_num);
-    if (pool == NULL) { return TP_ALLOCATION_FAILURE; }
+    if (pool == NULL) {
+        pthread_attr_destroy(&attr);
+        return TP_ALLOCATION_FAILURE;
+    }
 
+    pool->trace_base = atomic_fetch_add(&tp_trace_next, (int)conf->thread_num);
+    pool->name = conf->name;
     pool->handler = conf->handler;
+    pool->drop = conf->drop;
+    pool->cancel = conf->cancel;
+    pool->queue_limit = conf->queue_limit;
 
     for(size_t i = 0; i < conf->thread_num; i++) {
-        int status = pthread_create(&pool->threads[i], NULL,
-                                    tp_thread, (void*)pool);
+        tp_worker_t* worker = &pool->workers[i];
+        atomic_init(&worker->tasks_done, 0);
+        atomic_init(&worker->busy_ns, 0);
+        atomic_init(&worker->idle_ns, 0);
+        worker->pool = pool;
+        worker->id = (int)i;
+
+        status = pthread_create(&pool->threads[i], &attr,
+                                tp_thread, (void*)worker);
         if(status != SUCCESS) { 
-            pool->shutdown = 1;
+            // Stops and joins the workers started so far
+            pthread_attr_destroy(&attr);
             tp_destroy(pool); 
             return TP_THREAD_START_FAILURE; 
         }
         pool->thread_num++;
+
+        if (conf->name != NULL) { tp_set_name(pool->threads[i], conf->name, i); }
     }
 
+    pthread_attr_destroy(&attr);
     *p = pool;
     return TP_SUCCESS;
 }
@@ -144,14 +340,19 @@ int tp_destroy(tp_t* pool) {
         pthread_join(pool->threads[i], NULL);
     }
 
-    task_node_t* current = pool->head;
-    while (current != NULL) {
-        task_node_t* temp = current;
-        current = current->next;
-        free(temp);
+    for (size_t i = 0; i < pool->queue_count; i++) {
+        task_node_t* current = pool->queues[i].head;
+        while (current != NULL) {
+            task_node_t* temp = current;
+            current = current->next;
+            if (pool->drop != NULL) { pool->drop(temp->task); }
+            free(temp);
+        }
     }
 
+    free(pool->queues);
     free(pool->threads);
+    free(pool->workers);
     
     pthread_mutex_destroy(&pool->lock);
     pthread_cond_destroy(&pool->notify);
@@ -161,7 +362,32 @@ int tp_destroy(tp_t* pool) {
     return TP_SUCCESS;
 }
 
+// Finds the queue for `key`, adding it if it is new. Called with the
+// lock held; NULL if out of memory.
+static tp_queue_t* tp_queue_get(tp_t* pool, uint64_t key) {
+    for (size_t i = 0; i < pool->queue_count; i++) {
+        if (pool->queues[i].key == key) { return &pool->queues[i]; }
+    }
+
+    if (pool->queue_count == pool->queue_cap) {
+        tp_queue_t* queues = realloc(pool->queues, 2 * pool->queue_cap * sizeof(*queues));
+        if (queues == NULL) { return NULL; }
+
+        pool->queues = queues;
+        pool->queue_cap *= 2;
+    }
+
+    tp_queue_t* q = &pool->queues[pool->queue_count++];
+    memset(q, 0, sizeof(*q));
+    q->key = key;
+    return q;
+}
+
 int tp_add(tp_t* pool, void* task) {
+    return tp_add_keyed(pool, task, 0);
+}
+
+int tp_add_keyed(tp_t* pool, void* task, uint64_t key) {
     int status = pthread_mutex_lock(&pool->lock);
     if (status != SUCCESS) { return TP_LOCK_FAILED; }
 
@@ -170,8 +396,10 @@ int tp_add(tp_t* pool, void* task) {
         return TP_CANCELED_BY_DESTROY;
     }
 
+    tp_queue_t* queue = tp_queue_get(pool, key);
     task_node_t* new_node = malloc(sizeof(task_node_t));
-    if (new_node == NULL) {
+    if (queue == NULL || new_node == NULL) {
+        free(new_node);
         pthread_mutex_unlock(&pool->lock);
         return TP_ALLOCATION_FAILURE;
     }
@@ -179,12 +407,18 @@ int tp_add(tp_t* pool, void* task) {
     new_node->task = task;
     new_node->next = NULL;
 
-    if (pool->tail != NULL) {
-        pool->tail->next = new_node;
+    if (trace_enabled) {
+        new_node->enqueue_ns = trace_now();
+        new_node->producer = tp_current_trace;
+    }
+
+    if (queue->tail != NULL) {
+        queue->tail->next = new_node;
     } else {
-        pool->head = new_node;
+        queue->head = new_node;
     }
-    pool->tail = new_node;
+    queue->tail = new_node;
+    queue->num++;
     pool->queue_num++;
 
     pthread_cond_broadcast(&pool->notify);
@@ -203,3 +437,31 @@ int tp_wait_idling(tp_t *pool) {
     pthread_mutex_unlock(&pool->lock);
     return TP_SUCCESS;
 }
+
+int tp_stats(tp_t* pool, tp_stats_t* stats) {
+    if (pool == NULL || stats == NULL) { return TP_INVALID_ARGUMENT; }
+
+    memset(stats, 0, sizeof(*stats));
+
+    int status = pthread_mutex_lock(&pool->lock);
+    if (status != SUCCESS) { return TP_LOCK_FAILED; }
+
+    stats->thread_num = pool->thread_num;
+    stats->queue_depth = pool->queue_num;
+    stats->busy_threads = pool->thread_num - pool->inactive_thread_num;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < stats->thread_num; i++) {
+        tp_worker_t* w = &pool->workers[i];
+        stats->tasks_done += atomic_load_explicit(&w->tasks_done, memory_order_relaxed);
+        stats->busy_ns += atomic_load_explicit(&w->busy_ns, memory_order_relaxed);
+        stats->idle_ns += atomic_load_explicit(&w->idle_ns, memory_order_relaxed);
+    }
+
+    return TP_SUCCESS;
+}
+
+int tp_worker_id(void) {
+    return tp_current_worker;
+}
@@ -2,6 +2,9 @@
 #define THREADPOOL_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "cancel.h"
 
 enum {
     TP_SUCCESS = 0,
@@ -19,15 +22,67 @@ typedef struct {
     size_t thread_num;
 
     void (*handler)(void*);
+
+    // Worker stack and guard size in bytes, 0 for the pthread defaults.
+    // The stack is rounded up to whole pages and PTHREAD_STACK_MIN.
+    size_t stack_size;
+    size_t guard_size;
+
+    // Scheduling policy (SCHED_*) and priority, taken instead of the
+    // creator's when either is non-zero. Realtime policies need
+    // privileges, otherwise tp_init fails.
+    int sched_policy;
+    int sched_priority;
+
+    // Workers are named "<name>-<id>" (cut to 15 characters) for top -H
+    // and gdb, if set. Traces keep the pointer, so it has to outlive them.
+    const char* name;
+
+    // Most tasks of one key (see tp_add_keyed) handled at the same time,
+    // 0 for no limit
+    size_t queue_limit;
+
+    // Tasks that are not to be run: every task dequeued once `cancel` is
+    // requested, and whatever is still queued at tp_destroy. Lets the
+    // owner release what the task holds, so a canceled pool drains at
+    // once instead of working through its queue. Without it, dequeued
+    // tasks always go to `handler` and those left at tp_destroy leak.
+    void (*drop)(void*);
+    const cancel_t* cancel;     // NULL for none
 } tp_conf_t;
 
 int tp_init(tp_t** p, const tp_conf_t* conf);
 
-// Graceful destroy
+// Stops the workers once their current tasks are done; the pool need
+// not be idle. Tasks still queued are handed to `drop` on the calling
+// thread.
 int tp_destroy(tp_t* pool);
 
 int tp_add(tp_t* pool, void* task);
 
+// Tasks with the same key share a FIFO queue, and workers take from the
+// queues in turn. Keyed by device, a burst of work on one slow disk
+// then holds at most `queue_limit` workers and the others keep serving
+// the remaining disks. tp_add uses key 0.
+int tp_add_keyed(tp_t* pool, void* task, uint64_t key);
+
 int tp_wait_idling(tp_t* pool);
 
+typedef struct {
+    size_t thread_num;
+    size_t queue_depth;
+    size_t busy_threads;
+
+    uint64_t tasks_done;
+    uint64_t busy_ns;   // time spent in the handler, summed over workers
+    uint64_t idle_ns;   // time spent waiting for tasks
+} tp_stats_t;
+
+// Aggregates per-worker counters; cheap enough to call periodically
+int tp_stats(tp_t* pool, tp_stats_t* stats);
+
+// Index of the calling worker thread in [0, thread_num), -1 for threads
+// that do not belong to a pool
+int tp_worker_id(void);
+
 #endif /* THREADPOOL_H */
@@ -0,0 +1,208 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUCCESS 0
+
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_ARENA_SIZE (256 * 1024)
+
+typedef struct {
+    trace_task_t task;
+    const char* name;
+    const char* path;
+} trace_event_t;
+
+typedef struct trace_chunk {
+    struct trace_chunk* next;
+    size_t used;
+    trace_event_t events[TRACE_CHUNK_EVENTS];
+} trace_chunk_t;
+
+// Paths are copied here, since tasks free theirs when they finish
+typedef struct trace_arena {
+    struct trace_arena* next;
+    size_t used;
+    char data[TRACE_ARENA_SIZE];
+} trace_arena_t;
+
+typedef struct trace_thread {
+    struct trace_thread* next;
+
+    trace_chunk_t* chunks;      // newest first
+    trace_arena_t* arena;
+
+    const char* name;
+    const char* path;
+} trace_thread_t;
+
+int trace_enabled = 0;
+
+static uint64_t trace_base = 0;
+
+static _Atomic(trace_thread_t*) trace_threads = NULL;
+static _Thread_local trace_thread_t* trace_local = NULL;
+
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void trace_enable(void) {
+    trace_base = trace_now();
+    trace_enabled = 1;
+}
+
+static trace_thread_t* trace_get_thread(void) {
+    if (trace_local != NULL) { return trace_local; }
+
+    trace_thread_t* t = calloc(1, sizeof(*t));
+    if (t == NULL) { return NULL; }
+
+    t->next = atomic_load(&trace_threads);
+    while (!atomic_compare_exchange_weak(&trace_threads, &t->next, t)) {}
+
+    trace_local = t;
+    return t;
+}
+
+static const char* trace_copy_path(trace_thread_t* t, const char* path) {
+    size_t len = strlen(path) + 1;
+    if (len > TRACE_ARENA_SIZE) { return NULL; }
+
+    if (t->arena == NULL || t->arena->used + len > TRACE_ARENA_SIZE) {
+        trace_arena_t* arena = malloc(sizeof(*arena));
+        if (arena == NULL) { return NULL; }
+
+        arena->next = t->arena;
+        arena->used = 0;
+        t->arena = arena;
+    }
+
+    char* res = t->arena->data + t->arena->used;
+    memcpy(res, path, len);
+    t->arena->used += len;
+    return res;
+}
+
+void trace_label(const char* name, const char* path) {
+    trace_thread_t* t = trace_get_thread();
+    if (t == NULL) { return; }
+
+    t->name = name;
+    t->path = (path != NULL) ? trace_copy_path(t, path) : NULL;
+}
+
+void trace_task(const trace_task_t* task) {
+    trace_thread_t* t = trace_get_thread();
+    if (t == NULL) { return; }
+
+    if (t->chunks == NULL || t->chunks->used == TRACE_CHUNK_EVENTS) {
+        trace_chunk_t* chunk = malloc(sizeof(*chunk));
+        if (chunk == NULL) { return; }
+
+        chunk->next = t->chunks;
+        chunk->used = 0;
+        t->chunks = chunk;
+    }
+
+    trace_event_t* e = &t->chunks->events[t->chunks->used++];
+    e->task = *task;
+    e->name = (t->name != NULL) ? t->name : "task";
+    e->path = t->path;
+
+    t->name = NULL;
+    t->path = NULL;
+}
+
+static void trace_write_string(FILE* f, const char* str) {
+    fputc('"', f);
+    for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', f);
+            fputc(*p, f);
+        } else if (*p < 0x20) {
+            fprintf(f, "\\u%04x", *p);
+        } else {
+            fputc(*p, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// Chrome wants microseconds; threads outside the pool share tid 0
+static inline double trace_us(uint64_t ns) {
+    return (ns > trace_base) ? (double)(ns - trace_base) / 1e3 : 0.0;
+}
+
+static inline int trace_tid(int worker) {
+    return worker + 1;
+}
+
+// Each task becomes a slice on its worker, a flow arrow from the
+// thread that enqueued it, and a sample of the queue depth
+static void trace_write_event(FILE* f, const trace_event_t* e, uint64_t id) {
+    const trace_task_t* t = &e->task;
+    int tid = trace_tid(t->worker);
+
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,"
+               "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":",
+            e->name, tid, trace_us(t->start_ns),
+            (double)(t->end_ns - t->start_ns) / 1e3);
+    trace_write_string(f, (e->path != NULL) ? e->path : "");
+    fprintf(f, ",\"wait_us\":%.3f,\"dequeue_ts\":%.3f}}",
+            (double)(t->start_ns - t->enqueue_ns) / 1e3, trace_us(t->dequeue_ns));
+
+    fprintf(f, ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"s\",\"id\":%llu,"
+               "\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+            (unsigned long long)id, trace_tid(t->producer), trace_us(t->enqueue_ns));
+    fprintf(f, ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"f\",\"bp\":\"e\","
+               "\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+            (unsigned long long)id, tid, trace_us(t->start_ns));
+
+    fprintf(f, ",\n{\"name\":\"queue depth\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+               "\"args\":{\"tasks\":%zu}}",
+            trace_us(t->dequeue_ns), t->queue_depth);
+}
+
+int trace_write(const char* path) {
+    if (path == NULL) { return TRACE_INVALID_ARGUMENT; }
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) { return TRACE_FAILURE; }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+          "\"args\":{\"name\":\"main\"}}", f);
+
+    uint64_t id = 0;
+    for (trace_thread_t* t = atomic_load(&trace_threads); t != NULL; t = t->next) {
+        if (t->chunks == NULL) { continue; }
+
+        const trace_task_t* first = &t->chunks->events[0].task;
+        if (first->worker >= 0) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                       "\"tid\":%d,\"args\":{\"name\":\"%s-%d\"}}",
+                    trace_tid(first->worker),
+                    (first->pool != NULL) ? first->pool : "worker", first->index);
+        }
+
+        for (trace_chunk_t* c = t->chunks; c != NULL; c = c->next) {
+            for (size_t i = 0; i < c->used; i++) {
+                trace_write_event(f, &c->events[i], id++);
+            }
+        }
+    }
+
+    fputs("\n]}\n", f);
+
+    int failed = ferror(f);
+    if (fclose(f) != SUCCESS || failed) { return TRACE_FAILURE; }
+    return TRACE_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    TRACE_SUCCESS = 0,
+    TRACE_FAILURE = -1,
+    TRACE_ALLOCATION_FAILURE = -2,
+    TRACE_INVALID_ARGUMENT = -3
+};
+
+// Task tracing for chrome://tracing and ui.perfetto.dev. Events are kept
+// in per-thread buffers and only serialized by trace_write, so enabling
+// it costs a few clock reads per task.
+extern int trace_enabled;
+
+void trace_enable(void);
+
+uint64_t trace_now(void);
+
+typedef struct {
+    // Threads of all pools are numbered together, so that every one
+    // gets a track of its own; -1 is a thread outside any pool
+    int worker;         // the thread that ran the task
+    int producer;       // the thread that enqueued it
+
+    const char* pool;   // name of the worker's pool, NULL if it has none
+    int index;          // tp_worker_id of the worker within its pool
+
+    uint64_t enqueue_ns;
+    uint64_t dequeue_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+
+    size_t queue_depth; // tasks left in the queue after the dequeue
+} trace_task_t;
+
+// Labels the task running on the calling thread; called by the handler,
+// picked up by the following trace_task
+void trace_label(const char* name, const char* path);
+
+// Records a finished task on the calling thread
+void trace_task(const trace_task_t* task);
+
+// Dumps every recorded event as Chrome trace-event JSON. Must be called
+// once the traced threads are done.
+int trace_write(const char* path);
+
+#endif /* TRACE_H */